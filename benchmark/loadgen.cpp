@@ -0,0 +1,358 @@
+// kurisu_loadgen: 用kurisu自身实现的压测工具
+// 支持echo(ping-pong)与request/response两种负载，结果以JSON输出到stdout，日志输出到stderr
+//
+// 例:
+//   kurisu_loadgen --mode pingpong --connections 100 --size 1024 --depth 1 --duration 10
+//   kurisu_loadgen --mode reqresp --size 64 --response-size 4096 --depth 8 --threads 4
+//   kurisu_loadgen --no-server --host 10.0.0.2 --port 5005   // 压测外部的echo server
+//   kurisu_loadgen --transport unix --unix-path @kurisu_loadgen  // 与loopback TCP对比延迟
+#include <kurisu/kurisu.h>
+#include <getopt.h>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace {
+    enum class Mode {
+        PingPong,  // 服务端原样返回，每个消息size字节
+        ReqResp,   // 4字节长度+size字节的请求，服务端回复4字节长度+responseSize字节的响应
+    };
+
+    struct Options {
+        Mode mode = Mode::PingPong;
+        int connections = 1;
+        int size = 1024;
+        int responseSize = 1024;
+        int depth = 1;  // 每个连接同时在途的请求数
+        double duration = 10.0;
+        int threads = 1;        // 客户端IO线程数
+        int serverThreads = 1;  // 服务端IO线程数
+        bool withServer = true;
+        bool isUnix = false;
+        std::string host = "127.0.0.1";
+        uint16_t port = 5005;
+        std::string unixPath = "@kurisu_loadgen";  // '@'开头的是抽象命名空间
+    };
+
+    struct Stats {
+        kurisu::detail::Histogram latency;  // ns
+        std::atomic_uint64_t messages = 0;
+        std::atomic_uint64_t bytes = 0;
+    };
+
+    std::atomic_bool g_isRunning = false;
+    std::atomic_int g_connected = 0;
+
+    int64_t NowNs()
+    {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    void OutputToStderr(const char* msg, const uint64_t len) { fwrite(msg, 1, len, stderr); }
+
+
+    class Session : kurisu::detail::uncopyable {
+    public:
+        Session(kurisu::EventLoop* loop, const kurisu::SockAddr& addr, const std::string& name, const Options& opt, const std::string& request, Stats* stats)
+            : m_opt(opt), m_request(request), m_stats(stats), m_client(loop, addr, name)
+        {
+            using namespace std::placeholders;
+            m_client.SetTcpNoDelay(true);
+            m_client.SetConnectionCallback(std::bind(&Session::OnConn, this, _1));
+            m_client.SetMessageCallback(std::bind(&Session::OnMsg, this, _1, _2, _3));
+        }
+
+        void Connect() { m_client.Connect(); }
+        void Disconnect() { m_client.Disconnect(); }
+        // 开始发送，可以跨线程调用
+        void Start()
+        {
+            m_client.GetLoop()->Run([this] {
+                for (int i = 0; i < m_opt.depth; i++)
+                    SendOne();
+            });
+        }
+
+    private:
+        void OnConn(const std::shared_ptr<kurisu::TcpConnection>& conn)
+        {
+            if (conn->Connected())
+            {
+                m_conn = conn;
+                g_connected++;
+            }
+            else
+            {
+                m_conn.reset();
+                g_connected--;
+            }
+        }
+        void OnMsg(const std::shared_ptr<kurisu::TcpConnection>&, kurisu::Buffer* buf, kurisu::Timestamp)
+        {
+            if (m_opt.mode == Mode::PingPong)
+            {
+                m_pending += buf->ReadableBytes();
+                buf->DiscardAll();
+                while (m_pending >= (uint64_t)m_opt.size)
+                {
+                    m_pending -= m_opt.size;
+                    Complete(m_opt.size);
+                }
+            }
+            else
+            {
+                while (buf->ReadableBytes() >= sizeof(int))
+                {
+                    uint64_t len = (uint64_t)buf->PeekInt32();
+                    if (buf->ReadableBytes() < sizeof(int) + len)
+                        break;
+                    buf->Discard(sizeof(int) + len);
+                    Complete(sizeof(int) + len);
+                }
+            }
+        }
+        // 一个请求完成了
+        void Complete(uint64_t bytes)
+        {
+            if (m_sendTimes.empty())
+                return;
+            int64_t now = NowNs();
+            if (g_isRunning)
+            {
+                m_stats->latency.Record((uint64_t)(now - m_sendTimes.front()));
+                m_stats->messages.fetch_add(1, std::memory_order_relaxed);
+                m_stats->bytes.fetch_add(bytes, std::memory_order_relaxed);
+            }
+            m_sendTimes.pop_front();
+            if (g_isRunning)
+                SendOne();
+        }
+        void SendOne()
+        {
+            if (!m_conn)
+                return;
+            m_sendTimes.push_back(NowNs());
+            m_conn->Send(m_request.data(), (int)m_request.size());
+        }
+
+        const Options& m_opt;
+        const std::string& m_request;
+        Stats* m_stats;
+        uint64_t m_pending = 0;          // ping-pong模式下已收到但还不够一个消息的字节数
+        std::deque<int64_t> m_sendTimes;  // 在途请求的发送时间
+        std::shared_ptr<kurisu::TcpConnection> m_conn;
+        kurisu::TcpClient m_client;
+    };
+
+
+    void Usage(const char* name)
+    {
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "  --mode pingpong|reqresp   workload (default pingpong)\n"
+                "  --connections N           number of connections (default 1)\n"
+                "  --size N                  message/request size in bytes (default 1024)\n"
+                "  --response-size N         response size in reqresp mode (default 1024)\n"
+                "  --depth N                 pipelining depth per connection (default 1)\n"
+                "  --duration SECONDS        measuring duration (default 10)\n"
+                "  --threads N               client IO threads (default 1)\n"
+                "  --server-threads N        in-process server IO threads (default 1)\n"
+                "  --host HOST               server host (default 127.0.0.1)\n"
+                "  --port PORT               server port (default 5005)\n"
+                "  --transport tcp|unix      transport (default tcp)\n"
+                "  --unix-path PATH          AF_UNIX path, '@name' for abstract namespace (default @kurisu_loadgen)\n"
+                "  --no-server               do not start the in-process server\n",
+                name);
+    }
+
+    bool ParseOptions(int argc, char* argv[], Options* opt)
+    {
+        static const option longOptions[] = {
+            {"mode", required_argument, nullptr, 'm'},
+            {"connections", required_argument, nullptr, 'c'},
+            {"size", required_argument, nullptr, 's'},
+            {"response-size", required_argument, nullptr, 'r'},
+            {"depth", required_argument, nullptr, 'd'},
+            {"duration", required_argument, nullptr, 't'},
+            {"threads", required_argument, nullptr, 'T'},
+            {"server-threads", required_argument, nullptr, 'S'},
+            {"host", required_argument, nullptr, 'H'},
+            {"port", required_argument, nullptr, 'p'},
+            {"transport", required_argument, nullptr, 'x'},
+            {"unix-path", required_argument, nullptr, 'u'},
+            {"no-server", no_argument, nullptr, 'n'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0},
+        };
+
+        int ch;
+        while ((ch = getopt_long(argc, argv, "m:c:s:r:d:t:T:S:H:p:x:u:nh", longOptions, nullptr)) != -1)
+        {
+            switch (ch)
+            {
+                case 'm':
+                    if (strcmp(optarg, "pingpong") == 0)
+                        opt->mode = Mode::PingPong;
+                    else if (strcmp(optarg, "reqresp") == 0)
+                        opt->mode = Mode::ReqResp;
+                    else
+                        return false;
+                    break;
+                case 'c': opt->connections = std::max(atoi(optarg), 1); break;
+                case 's': opt->size = std::max(atoi(optarg), 1); break;
+                case 'r': opt->responseSize = std::max(atoi(optarg), 0); break;
+                case 'd': opt->depth = std::max(atoi(optarg), 1); break;
+                case 't': opt->duration = std::max(atof(optarg), 0.1); break;
+                case 'T': opt->threads = std::max(atoi(optarg), 0); break;
+                case 'S': opt->serverThreads = std::max(atoi(optarg), 0); break;
+                case 'H': opt->host = optarg; break;
+                case 'p': opt->port = (uint16_t)atoi(optarg); break;
+                case 'x':
+                    if (strcmp(optarg, "tcp") == 0)
+                        opt->isUnix = false;
+                    else if (strcmp(optarg, "unix") == 0)
+                        opt->isUnix = true;
+                    else
+                        return false;
+                    break;
+                case 'u': opt->unixPath = optarg; break;
+                case 'n': opt->withServer = false; break;
+                default: return false;
+            }
+        }
+        return true;
+    }
+
+    void PrintResult(const Options& opt, const std::vector<std::unique_ptr<Stats>>& stats, double seconds)
+    {
+        kurisu::detail::Histogram latency;
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        for (auto&& item : stats)
+        {
+            latency.Merge(item->latency);
+            messages += item->messages;
+            bytes += item->bytes;
+        }
+
+        auto us = [&latency](double percentile) { return (double)latency.Percentile(percentile) / 1000.0; };
+        printf("{\"mode\":\"%s\",\"transport\":\"%s\",\"connections\":%d,\"size\":%d,\"response_size\":%d,\"depth\":%d,"
+               "\"client_threads\":%d,\"server_threads\":%d,\"duration_s\":%.3f,"
+               "\"messages\":%lu,\"bytes\":%lu,\"msgs_per_sec\":%.1f,\"mib_per_sec\":%.3f,"
+               "\"latency_us\":{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"p9999\":%.3f,\"max\":%.3f}}\n",
+               opt.mode == Mode::PingPong ? "pingpong" : "reqresp", opt.isUnix ? "unix" : "tcp", opt.connections, opt.size, opt.responseSize, opt.depth,
+               opt.threads, opt.withServer ? opt.serverThreads : -1, seconds,
+               messages, bytes, (double)messages / seconds, (double)bytes / seconds / 1024 / 1024,
+               (double)latency.Min() / 1000.0, latency.Mean() / 1000.0, us(50), us(90), us(99), us(99.9), us(99.99), (double)latency.Max() / 1000.0);
+        fflush(stdout);
+    }
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    if (!ParseOptions(argc, argv, &opt))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+    kurisu::Logger::SetOutput(OutputToStderr);  // stdout只留给JSON结果
+
+    kurisu::EventLoop loop;
+    kurisu::SockAddr addr;
+    if (!opt.isUnix)
+        addr = kurisu::SockAddr(opt.port, opt.host.c_str());
+    else if (opt.unixPath[0] == '@')
+        addr = kurisu::SockAddr::AbstractUnix(opt.unixPath.substr(1));
+    else
+        addr = kurisu::SockAddr::Unix(opt.unixPath);
+
+    // 请求/响应的内容在整个压测中都不变
+    std::string request(opt.size, 'x');
+    std::string response(opt.responseSize, 'y');
+    if (opt.mode == Mode::ReqResp)
+    {
+        kurisu::Buffer buf;
+        buf.AppendInt32(opt.size);
+        buf.Append(request);
+        request = buf.RetrieveAllAsString();
+    }
+
+    kurisu::LengthFieldCodec codec(64 * 1024 * 1024, 0, 4, 0, 4);
+    std::unique_ptr<kurisu::TcpServer> server;
+    if (opt.withServer)
+    {
+        server = std::make_unique<kurisu::TcpServer>(&loop, addr, "loadgen-server");
+        server->SetThreadNum(opt.serverThreads);
+        server->SetTcpNoDelay(true);
+        if (opt.mode == Mode::PingPong)
+            server->SetMessageCallback([](const std::shared_ptr<kurisu::TcpConnection>& conn, kurisu::Buffer* buf, kurisu::Timestamp) { conn->Send(buf); });
+        else
+        {
+            server->SetMessageCallback([&codec, &response](const std::shared_ptr<kurisu::TcpConnection>& conn, kurisu::Buffer* buf, kurisu::Timestamp) {
+                buf->DiscardAll();
+                codec.SendString(conn, response);
+            });
+            server->SetLengthFieldCodec(codec);
+        }
+        server->Start();
+    }
+
+    kurisu::detail::EventLoopThreadPool clientThreads(&loop, "loadgen-client");
+    clientThreads.SetThreadNum(opt.threads);
+    clientThreads.Start();
+    std::vector<kurisu::EventLoop*> loops = clientThreads.GetAllLoops();
+
+    std::vector<std::unique_ptr<Stats>> stats;
+    for (uint64_t i = 0; i < loops.size(); i++)
+        stats.emplace_back(std::make_unique<Stats>());
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (int i = 0; i < opt.connections; i++)
+    {
+        int index = i % (int)loops.size();
+        std::string name = "loadgen-client" + std::to_string(i);
+        sessions.emplace_back(std::make_unique<Session>(loops[index], addr, name, opt, request, stats[index].get()));
+    }
+    for (auto&& session : sessions)
+        session->Connect();
+
+    int64_t startNs = 0;
+    bool isFinished = false;
+    auto stop = [&] {
+        g_isRunning = false;
+        isFinished = true;
+        PrintResult(opt, stats, (double)(NowNs() - startNs) / 1e9);
+        for (auto&& session : sessions)
+            session->Disconnect();
+        loop.RunAfter(0.2, [&loop] { loop.Quit(); });
+    };
+    auto start = [&] {
+        LOG_INFO << "loadgen: " << opt.connections << " connections established, running for " << opt.duration << "s";
+        startNs = NowNs();
+        g_isRunning = true;
+        for (auto&& session : sessions)
+            session->Start();
+        loop.RunAfter(opt.duration, stop);
+    };
+
+    // 等所有连接都建立之后才开始计时
+    kurisu::Timestamp connectDeadline = kurisu::Timestamp::AddTime(kurisu::Timestamp::Now(), 10.0);
+    std::function<void()> waitConnected = [&] {
+        if (g_connected == opt.connections)
+            start();
+        else if (kurisu::Timestamp::Now() > connectDeadline)
+        {
+            LOG_ERROR << "loadgen: only " << g_connected << " of " << opt.connections << " connections established";
+            loop.Quit();
+        }
+        else
+            loop.RunAfter(0.01, waitConnected);
+    };
+    loop.RunAfter(0.01, waitConnected);
+
+    loop.Loop();
+    return isFinished ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+// 日志吞吐量测试，线程数从1到max-threads，每个线程写lines行LOG_INFO到AsyncLogFile，结果以JSON输出到stdout
+//
+// empty    单线程LOG_INFO << ""，输出什么都不做，只看每行固定的开销(时间、tid、等级、文件名、行号)
+// stream   单线程LOG_INFO << ...，输出什么都不做，只看前端格式化的耗时
+// fmt      单线程LOG_INFO_F(...)，同上
+// kv       单线程LOG_INFO_KV(...)，同上，整行是JSON
+// async    LOG_INFO << ... 写入AsyncLogFile
+// binary   LOG_INFO_B(...) 写入BinaryLogFile，调用线程不格式化
+// mmap     LOG_INFO << ... 写入MmapLogFile，调用线程直接复制进映射的文件
+// sinks    LOG_INFO << ... 经LogSinks交给两个异步的输出(AsyncLogFile和什么都不做的)，外加一个只要ERROR的同步输出
+//
+// append_ns   前端平均每行的耗时(所有线程写完为止)
+// total       包括后台线程写完文件的时间
+//
+// 例:
+//   kurisu_log_bench --lines 200000 --max-threads 32 --basename /tmp/kurisu_log_bench
+#include <kurisu/kurisu.h>
+#include <getopt.h>
+
+namespace {
+    kurisu::AsyncLogFile* g_asyncLog = nullptr;
+    kurisu::MmapLogFile* g_mmapLog = nullptr;
+
+    void AsyncOutput(const char* msg, const uint64_t len) { g_asyncLog->Append(msg, len); }
+    void MmapOutput(const char* msg, const uint64_t len) { g_mmapLog->Append(msg, len); }
+    void NullOutput(const char*, const uint64_t) {}
+
+    double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void PrintResult(const char* workload, int threads, int64_t total, double appendSeconds, double totalSeconds)
+    {
+        printf("{\"workload\":\"%s\",\"threads\":%d,\"lines\":%ld,\"append_ns\":%.1f,\"lines_per_sec\":%.1f,\"total_seconds\":%.4f}\n",
+               workload, threads, total, appendSeconds * 1e9 / (double)total * threads, (double)total / appendSeconds, totalSeconds);
+        fflush(stdout);
+    }
+
+    void RunFrontend(const std::string& workload, int64_t lines)
+    {
+        kurisu::Logger::SetOutput(NullOutput);
+        auto start = std::chrono::steady_clock::now();
+        if (workload == "empty")
+        {
+            for (int64_t j = 0; j < lines; j++)
+                LOG_INFO << "";
+        }
+        else if (workload == "fmt")
+        {
+            for (int64_t j = 0; j < lines; j++)
+                LOG_INFO_F("thread {} line {} value {}", 0, j, 3.14159 * (double)j);
+        }
+        else if (workload == "kv")
+        {
+            for (int64_t j = 0; j < lines; j++)
+                LOG_INFO_KV("bench", "thread", 0, "line", j, "value", 3.14159 * (double)j);
+        }
+        else
+        {
+            for (int64_t j = 0; j < lines; j++)
+                LOG_INFO << "thread " << 0 << " line " << j << " value " << 3.14159 * (double)j;
+        }
+        double seconds = Seconds(start);
+        kurisu::Logger::SetOutput(kurisu::detail::DefaultOutput);
+        PrintResult(workload.c_str(), 1, lines, seconds, seconds);
+    }
+
+    void RunAsync(const std::string& basename, int threads, int64_t lines)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double appendSeconds;
+        {
+            kurisu::AsyncLogFile log(basename, 1L << 40);
+            g_asyncLog = &log;
+            kurisu::Logger::SetOutput(AsyncOutput);
+
+            std::vector<std::thread> thrds;
+            for (int i = 0; i < threads; i++)
+                thrds.emplace_back([lines, i] {
+                    for (int64_t j = 0; j < lines; j++)
+                        LOG_INFO << "thread " << i << " line " << j << " value " << 3.14159 * (double)j;
+                });
+            for (auto&& thrd : thrds)
+                thrd.join();
+            appendSeconds = Seconds(start);
+            kurisu::Logger::SetOutput(kurisu::detail::DefaultOutput);
+        }
+        PrintResult("async", threads, lines * threads, appendSeconds, Seconds(start));
+    }
+
+    void RunBinary(const std::string& basename, int threads, int64_t lines)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double appendSeconds;
+        {
+            kurisu::BinaryLogFile log(basename, 1L << 40);
+            kurisu::BinaryLogFile::SetDefault(&log);
+
+            std::vector<std::thread> thrds;
+            for (int i = 0; i < threads; i++)
+                thrds.emplace_back([lines, i] {
+                    for (int64_t j = 0; j < lines; j++)
+                        LOG_INFO_B("thread {} line {} value {}", i, j, 3.14159 * (double)j);
+                });
+            for (auto&& thrd : thrds)
+                thrd.join();
+            appendSeconds = Seconds(start);
+        }
+        PrintResult("binary", threads, lines * threads, appendSeconds, Seconds(start));
+    }
+
+    void RunMmap(const std::string& basename, int threads, int64_t lines)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double appendSeconds;
+        {
+            kurisu::MmapLogFile log(basename, 1L << 40);
+            g_mmapLog = &log;
+            kurisu::Logger::SetOutput(MmapOutput);
+
+            std::vector<std::thread> thrds;
+            for (int i = 0; i < threads; i++)
+                thrds.emplace_back([lines, i] {
+                    for (int64_t j = 0; j < lines; j++)
+                        LOG_INFO << "thread " << i << " line " << j << " value " << 3.14159 * (double)j;
+                });
+            for (auto&& thrd : thrds)
+                thrd.join();
+            appendSeconds = Seconds(start);
+            kurisu::Logger::SetOutput(kurisu::detail::DefaultOutput);
+        }
+        PrintResult("mmap", threads, lines * threads, appendSeconds, Seconds(start));
+    }
+
+    void RunSinks(const std::string& basename, int threads, int64_t lines)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double appendSeconds;
+        {
+            kurisu::AsyncLogFile log(basename, 1L << 40);
+            kurisu::LogSinkOptions asyncOptions;
+            asyncOptions.isAsync = true;
+            kurisu::LogSinkOptions errorOptions;
+            errorOptions.minLevel = kurisu::Logger::LogLevel::ERROR;
+            int ids[] = {
+                kurisu::LogSinks::Add([&log](const char* msg, uint64_t len) { log.Append(msg, len); }, asyncOptions),
+                kurisu::LogSinks::Add(NullOutput, asyncOptions),
+                kurisu::LogSinks::Add(NullOutput, errorOptions),
+            };
+
+            std::vector<std::thread> thrds;
+            for (int i = 0; i < threads; i++)
+                thrds.emplace_back([lines, i] {
+                    for (int64_t j = 0; j < lines; j++)
+                        LOG_INFO << "thread " << i << " line " << j << " value " << 3.14159 * (double)j;
+                });
+            for (auto&& thrd : thrds)
+                thrd.join();
+            appendSeconds = Seconds(start);
+            for (int id : ids)
+                kurisu::LogSinks::Remove(id);
+        }
+        PrintResult("sinks", threads, lines * threads, appendSeconds, Seconds(start));
+    }
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int64_t lines = 200000;
+    int maxThreads = 32;
+    std::string basename = "/tmp/kurisu_log_bench";
+
+    static const option longOptions[] = {
+        {"lines", required_argument, nullptr, 'n'},
+        {"max-threads", required_argument, nullptr, 't'},
+        {"basename", required_argument, nullptr, 'b'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:t:b:", longOptions, nullptr)) != -1)
+    {
+        switch (ch)
+        {
+            case 'n': lines = std::max(atol(optarg), 1L); break;
+            case 't': maxThreads = std::max(atoi(optarg), 1); break;
+            case 'b': basename = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [--lines N] [--max-threads N] [--basename PATH]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (auto&& workload : {"empty", "stream", "fmt", "kv"})
+        RunFrontend(workload, lines);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunAsync(basename, threads, lines);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunBinary(basename, threads, lines);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunMmap(basename, threads, lines);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunSinks(basename, threads, lines);
+}
@@ -0,0 +1,138 @@
+// detail::ThreadPool吞吐量测试，线程数从1到64，结果以JSON输出到stdout
+//
+// 两种负载:
+//   external  池外的一个线程不断Run空任务(走注入队列)
+//   batch     池外的一个线程每次RunBatch 64个任务
+//   spawn     任务在池内递归地Run子任务(走各自的队列和窃取)
+//
+// 例:
+//   kurisu_threadpool_bench --tasks 2000000 --max-threads 64
+#include <kurisu/kurisu.h>
+#include <getopt.h>
+
+namespace {
+    std::atomic_int64_t g_doneNum = 0;
+
+    double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // 做一点点事，避免任务被优化成什么都不做
+    void Work(int spin)
+    {
+        volatile uint64_t x = 0;
+        for (int i = 0; i < spin; i++)
+            x = x + i;
+        g_doneNum.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 每个任务生成fanout个子任务，直到depth为0
+    void Spawn(kurisu::detail::ThreadPool* pool, int depth, int fanout, int spin)
+    {
+        Work(spin);
+        if (depth > 0)
+            for (int i = 0; i < fanout; i++)
+                pool->Run([=] { Spawn(pool, depth - 1, fanout, spin); });
+    }
+
+    void WaitDone(int64_t total)
+    {
+        while (g_doneNum.load(std::memory_order_relaxed) < total)
+            std::this_thread::yield();
+    }
+
+    void PrintResult(const char* workload, int threads, int64_t tasks, double seconds)
+    {
+        printf("{\"workload\":\"%s\",\"threads\":%d,\"tasks\":%ld,\"seconds\":%.4f,\"tasks_per_sec\":%.1f}\n",
+               workload, threads, tasks, seconds, (double)tasks / seconds);
+        fflush(stdout);
+    }
+
+    void RunExternal(int threads, int64_t tasks, int spin)
+    {
+        kurisu::detail::ThreadPool pool("bench");
+        pool.SetThrdNum(threads);
+        g_doneNum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < tasks; i++)
+            pool.Run([spin] { Work(spin); });
+        WaitDone(tasks);
+        PrintResult("external", threads, tasks, Seconds(start));
+        pool.Stop();
+    }
+
+    void RunBatch(int threads, int64_t tasks, int spin)
+    {
+        const int64_t batchSize = 64;
+        kurisu::detail::ThreadPool pool("bench");
+        pool.SetThrdNum(threads);
+        g_doneNum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < tasks; i += batchSize)
+        {
+            std::vector<std::function<void()>> batch(std::min(batchSize, tasks - i), [spin] { Work(spin); });
+            pool.RunBatch(std::move(batch));
+        }
+        WaitDone(tasks);
+        PrintResult("batch", threads, tasks, Seconds(start));
+        pool.Stop();
+    }
+
+    void RunSpawn(int threads, int64_t tasks, int spin)
+    {
+        // 满fanout叉树的节点数 = (fanout^(depth+1)-1)/(fanout-1)，选一个不超过tasks的depth
+        const int fanout = 4;
+        int depth = 0;
+        int64_t total = 1;
+        for (int64_t level = fanout; total + level <= tasks; level *= fanout)
+        {
+            total += level;
+            depth++;
+        }
+
+        kurisu::detail::ThreadPool pool("bench");
+        pool.SetThrdNum(threads);
+        g_doneNum = 0;
+        auto start = std::chrono::steady_clock::now();
+        pool.Run([&pool, depth, spin] { Spawn(&pool, depth, fanout, spin); });
+        WaitDone(total);
+        PrintResult("spawn", threads, total, Seconds(start));
+        pool.Stop();
+    }
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int64_t tasks = 1000000;
+    int maxThreads = 64;
+    int spin = 0;
+
+    static const option longOptions[] = {
+        {"tasks", required_argument, nullptr, 'n'},
+        {"max-threads", required_argument, nullptr, 't'},
+        {"spin", required_argument, nullptr, 's'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:t:s:", longOptions, nullptr)) != -1)
+    {
+        switch (ch)
+        {
+            case 'n': tasks = std::max(atol(optarg), 1L); break;
+            case 't': maxThreads = std::max(atoi(optarg), 1); break;
+            case 's': spin = std::max(atoi(optarg), 0); break;
+            default:
+                fprintf(stderr, "Usage: %s [--tasks N] [--max-threads N] [--spin N]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunExternal(threads, tasks, spin);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunBatch(threads, tasks, spin);
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        RunSpawn(threads, tasks, spin);
+}
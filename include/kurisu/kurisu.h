@@ -9,11 +9,18 @@
 #include <condition_variable>
 #include <atomic>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <sys/epoll.h>
 #include <deque>
 #include <map>
 #include <set>
 #include <any>
+#include <optional>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "fmt/compile.h"
 
 
 uint64_t htonll(uint64_t val);
@@ -23,6 +30,7 @@ uint64_t ntohll(uint64_t val);
 
 namespace kurisu {
     class LengthFieldCodec;
+    class EventLoop;
 
     namespace detail {
         class copyable {
@@ -227,6 +235,58 @@ namespace kurisu {
             char* m_index;
         };
 
+        // LogStream的缓冲区，接口和FixedBuffer一样，平时只用自带的k_SmallBuf字节，不分配内存
+        // 放不下时把已写的内容搬到线程缓存的溢出缓冲区里接着写，一条日志最长SetMaxSize字节，超出的部分被截掉
+        class LogBuffer : uncopyable {
+        public:
+            LogBuffer() : m_data(m_inline), m_index(m_inline), m_end(m_inline + k_SmallBuf) {}
+            ~LogBuffer()
+            {
+                if (m_data != m_inline)
+                    ReleaseSpill();
+            }
+
+            uint64_t Size() const { return (uint64_t)(m_index - m_data); }
+            const char* Data() const { return m_data; }
+            void IndexShiftRight(uint64_t num) { m_index += num; }
+            char* Index() { return m_index; }
+            void Reset()
+            {
+                if (m_data != m_inline)
+                    ReleaseSpill();
+                m_index = m_data;
+            }
+            std::string String() const { return std::string(m_data, Size()); }
+            std::string_view StringView() const { return std::string_view(m_data, Size()); }
+            uint64_t AvalibleSize() { return (uint64_t)(m_end - m_index); }
+            bool IsSpilled() const { return m_data != m_inline; }
+
+            // 保证Index()之后至少有n字节可写，超过最大长度时尽量扩大并返回false
+            bool Reserve(uint64_t n) { return AvalibleSize() >= n || Spill(n); }
+            void Append(const char* buf, uint64_t len)
+            {
+                if (!Reserve(len))
+                    len = AvalibleSize();
+                memcpy(m_index, buf, len);
+                m_index += len;
+            }
+
+            // 一条日志的最大长度，不小于k_SmallBuf
+            static void SetMaxSize(uint64_t size) { s_maxSize.store(std::max(size, k_SmallBuf), std::memory_order_relaxed); }
+            static uint64_t MaxSize() { return s_maxSize.load(std::memory_order_relaxed); }
+
+        private:
+            bool Spill(uint64_t n);
+            void ReleaseSpill();
+
+        private:
+            char* m_data;
+            char* m_index;
+            char* m_end;
+            char m_inline[k_SmallBuf];
+            static std::atomic_uint64_t s_maxSize;
+        };
+
 
         // 效率很高的itoa算法，比to_string快5倍以上
         template <typename T>
@@ -302,6 +362,243 @@ namespace kurisu {
             uint64_t m_writtenBytes = 0;
         };
 
+        // 不经过stdio，攒够一大块再pwrite，按syncBytes定期fdatasync，并让已经落盘的部分离开page cache
+        // preallocateSize不为0时先用fallocate预分配磁盘空间，文件大小不变，关闭时释放没用到的部分
+        class DirectLogFileAppender : uncopyable {
+        public:
+            DirectLogFileAppender(StringArg filename, uint64_t preallocateSize, uint64_t syncBytes);
+            ~DirectLogFileAppender();
+            void Append(const char* logline, const uint64_t len);
+            // 把缓冲区中的日志pwrite进文件，不等它落盘
+            void Flush();
+            uint64_t WrittenBytes() const { return m_writtenBytes; }
+
+        private:
+            void WriteBuf();
+            void Sync();
+
+            static const uint64_t k_BufSize = 1024 * 1024;
+            int m_fd;
+            const uint64_t m_syncBytes;
+            std::unique_ptr<char[]> m_buf;
+            uint64_t m_bufLen = 0;
+            uint64_t m_fileOffset = 0;    // 已经pwrite到哪里
+            uint64_t m_syncedOffset = 0;  // 已经fdatasync到哪里
+            uint64_t m_writtenBytes = 0;
+        };
+
+
+        // HdrHistogram风格的对数-线性直方图，相对误差不超过1/k_SubBucketNum
+        // Record只用relaxed原子操作，可以多线程同时记录
+        class Histogram : uncopyable {
+        public:
+            Histogram() { Reset(); }
+
+            void Record(uint64_t value);
+            // 把other的数据合并进来
+            void Merge(const Histogram& other);
+            void Reset();
+
+            uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+            uint64_t Min() const { return Count() ? m_min.load(std::memory_order_relaxed) : 0; }
+            uint64_t Max() const { return m_max.load(std::memory_order_relaxed); }
+            double Mean() const { return Count() ? (double)m_sum.load(std::memory_order_relaxed) / (double)Count() : 0.0; }
+            // percentile的范围是[0,100]
+            uint64_t Percentile(double percentile) const;
+
+        private:
+            static const int k_SubBucketBits = 5;
+            static const uint64_t k_SubBucketNum = 1 << k_SubBucketBits;                 // 每个2的幂区间被分成多少份
+            static const uint64_t k_BucketNum = (64 - k_SubBucketBits + 1) * k_SubBucketNum;  // 桶的总数
+
+            static uint64_t IndexOf(uint64_t value);
+            // 这个桶能表示的最大值
+            static uint64_t HighestOf(uint64_t index);
+
+            std::atomic_uint64_t m_count;
+            std::atomic_uint64_t m_sum;
+            std::atomic_uint64_t m_min;
+            std::atomic_uint64_t m_max;
+            std::atomic_uint64_t m_buckets[k_BucketNum];
+        };
+
+
+        // 线程池中的任务，enqueueTime用于统计排队时间，不统计时为0
+        struct PoolTask {
+            std::function<void()> func;
+            int64_t enqueueTime = 0;  // steady_clock的纳秒数
+        };
+
+        // Chase-Lev工作窃取双端队列
+        // 只有所属的线程能Push/Pop(在底部，后进先出)，其他线程只能Steal(在顶部，先进先出)
+        // 满了会扩容，旧的数组可能还在被Steal读，所以留到析构时才释放
+        class WorkStealingDeque : uncopyable {
+        public:
+            using Task = PoolTask;
+
+            explicit WorkStealingDeque(int64_t capacity = 256);
+            ~WorkStealingDeque();
+
+            // 只能在所属线程中调用
+            void Push(Task* task);
+            // 只能在所属线程中调用，空时返回nullptr
+            Task* Pop();
+            // 可以在任何线程中调用，空或者竞争失败时返回nullptr
+            Task* Steal();
+            bool Empty() const { return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed); }
+
+        private:
+            struct Array {
+                explicit Array(int64_t cap) : capacity(cap), mask(cap - 1), buf(new std::atomic<Task*>[cap]) {}
+                Task* Get(int64_t i) const { return buf[i & mask].load(std::memory_order_relaxed); }
+                void Put(int64_t i, Task* task) { buf[i & mask].store(task, std::memory_order_relaxed); }
+
+                const int64_t capacity;
+                const int64_t mask;
+                std::unique_ptr<std::atomic<Task*>[]> buf;
+            };
+
+            alignas(64) std::atomic_int64_t m_top = 0;     // 下一个被窃取的位置
+            alignas(64) std::atomic_int64_t m_bottom = 0;  // 下一个Push的位置
+            std::atomic<Array*> m_array;
+            std::vector<std::unique_ptr<Array>> m_arrays;  // 所有分配过的数组，只由所属线程修改
+        };
+
+
+        // Vyukov有界多生产者多消费者队列
+        // 每个槽带一个序号，生产者和消费者各自CAS抢位置，不加锁
+        // 容量会向上取整到2的幂
+        template <typename T>
+        class BoundedMpmcQueue : uncopyable {
+        public:
+            explicit BoundedMpmcQueue(uint64_t capacity);
+
+            // 满了返回false
+            bool TryPush(T&& val);
+            // 一次CAS占住n个连续的槽再逐个填入，空间不够返回false，n不能超过容量
+            bool TryPushBatch(T* vals, uint64_t n);
+            // 空了返回false
+            bool TryPop(T& val);
+
+            uint64_t Capacity() const { return m_mask + 1; }
+            // 并发时只是个近似值
+            uint64_t SizeApprox() const;
+
+        private:
+            struct Slot {
+                std::atomic_uint64_t seq;  // 等于pos时可写，等于pos+1时可读
+                T val;
+            };
+
+            const uint64_t m_mask;
+            std::unique_ptr<Slot[]> m_slots;
+            alignas(64) std::atomic_uint64_t m_enqueuePos = 0;
+            alignas(64) std::atomic_uint64_t m_dequeuePos = 0;
+        };
+
+        template <typename T>
+        BoundedMpmcQueue<T>::BoundedMpmcQueue(uint64_t capacity)
+            : m_mask([capacity] {
+                  uint64_t cap = 1;
+                  while (cap < capacity)
+                      cap <<= 1;
+                  return cap - 1;
+              }()),
+              m_slots(new Slot[m_mask + 1])
+        {
+            for (uint64_t i = 0; i <= m_mask; i++)
+                m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        template <typename T>
+        bool BoundedMpmcQueue<T>::TryPush(T&& val)
+        {
+            uint64_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot& slot = m_slots[pos & m_mask];
+                int64_t diff = (int64_t)slot.seq.load(std::memory_order_acquire) - (int64_t)pos;
+                if (diff == 0)
+                {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.val = std::move(val);
+                        slot.seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)  // 上一圈的还没被取走，满了
+                    return false;
+                else
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        template <typename T>
+        bool BoundedMpmcQueue<T>::TryPushBatch(T* vals, uint64_t n)
+        {
+            if (n == 0)
+                return true;
+            if (n > Capacity())
+                return false;
+
+            // 最后一个槽可写，说明前面的槽在上一圈都已经被消费者占住了
+            uint64_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot& last = m_slots[(pos + n - 1) & m_mask];
+                int64_t diff = (int64_t)last.seq.load(std::memory_order_acquire) - (int64_t)(pos + n - 1);
+                if (diff == 0)
+                {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+
+            for (uint64_t i = 0; i < n; i++)
+            {
+                Slot& slot = m_slots[(pos + i) & m_mask];
+                // 占住了但消费者可能还没把值搬走，等一下
+                while (slot.seq.load(std::memory_order_acquire) != pos + i)
+                    std::this_thread::yield();
+                slot.val = std::move(vals[i]);
+                slot.seq.store(pos + i + 1, std::memory_order_release);
+            }
+            return true;
+        }
+        template <typename T>
+        bool BoundedMpmcQueue<T>::TryPop(T& val)
+        {
+            uint64_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot& slot = m_slots[pos & m_mask];
+                int64_t diff = (int64_t)slot.seq.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+                if (diff == 0)
+                {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        val = std::move(slot.val);
+                        slot.seq.store(pos + m_mask + 1, std::memory_order_release);  // 留给下一圈的生产者
+                        return true;
+                    }
+                }
+                else if (diff < 0)  // 还没有生产者写入，空的
+                    return false;
+                else
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        template <typename T>
+        uint64_t BoundedMpmcQueue<T>::SizeApprox() const
+        {
+            uint64_t dequeuePos = m_dequeuePos.load(std::memory_order_relaxed);
+            uint64_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+            return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+        }
+
 
         class Thread : uncopyable {
         public:
@@ -332,53 +629,219 @@ namespace kurisu {
         };
 
 
+        // 线程池任务完成后要回到EventLoop中执行的回调，侵入式链表节点
+        struct Completion {
+            std::function<void()> callback;
+            Completion* next = nullptr;
+        };
+
+        // Then的回调类型，void的任务回调没有参数
+        template <typename T>
+        struct TaskCallback {
+            using type = std::function<void(T)>;
+        };
+        template <>
+        struct TaskCallback<void> {
+            using type = std::function<void()>;
+        };
+
+        // ThreadPool::Submit的返回值
+        // 任务的结果和Then的回调都到齐后，回调在提交任务的线程的EventLoop中执行，结果被移动给回调
+        // 提交任务的线程没有EventLoop时，回调在执行任务的线程(或者调用Then的线程)中执行
+        template <typename T>
+        class TaskHandle {
+        public:
+            using Callback = typename TaskCallback<T>::type;
+
+            TaskHandle() = default;
+            // 只能调用一次，EventLoop要比任务活得久
+            void Then(Callback callback);
+            bool Valid() const { return m_state != nullptr; }
+
+        private:
+            friend class ThreadPool;
+            static const int k_ResultReady = 1;
+            static const int k_CallbackReady = 2;
+
+            struct State {
+                EventLoop* loop = nullptr;
+                std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+                Callback callback;
+                std::atomic_int flags = 0;
+            };
+
+            explicit TaskHandle(std::shared_ptr<State> state) : m_state(std::move(state)) {}
+            // 标记flag，结果和回调都到齐时由后到的一方调度回调
+            static void Complete(const std::shared_ptr<State>& state, int flag);
+
+            std::shared_ptr<State> m_state;
+        };
+
+
+        // 工作窃取线程池
+        // 每个工作线程有自己的WorkStealingDeque，在池内线程中Run的任务直接放进自己的队列，不加锁
+        // 池外线程Run的任务放进有界无锁的注入队列，空闲的线程依次从自己的队列、注入队列、其他线程的队列中取任务
+        // 取不到任务时先自旋一会儿，再睡眠等待唤醒
+        // 弹性模式下由监控线程根据排队时间增加线程，空闲太久的线程自己退出，线程数在[min,max]之间
         class ThreadPool : uncopyable {
         public:
-            explicit ThreadPool(const std::string& name = "ThreadPool") : m_name(name) {}
+            explicit ThreadPool(const std::string& name = "ThreadPool");
             ~ThreadPool();
-            // 这个函数的调用必须在SetThrdNum前，用于设置等待队列的大小
+            // 这个函数的调用必须在SetThrdNum前，用于设置注入队列的大小(向上取整到2的幂)
+            // 为0时不限制大小，注入队列满了就放进加锁的溢出队列
             void SetMaxQueueSize(int maxSize) { m_maxSize = maxSize; }
-            // 设置线程池的大小
+            // 这个函数的调用必须在SetThrdNum前，开启弹性模式，同时开启统计
+            // 最近一段时间任务的平均排队时间超过maxQueueWait秒就加一个线程，线程空闲超过maxIdle秒就退出
+            void SetElastic(int minThrdNum, int maxThrdNum, double maxQueueWait = 0.001, double maxIdle = 5.0);
+            // 这个函数的调用必须在SetThrdNum前，统计每个任务的排队时间和执行时间
+            void EnableMetrics() { m_isRecording = true; }
+            // 设置线程池的大小，弹性模式下是初始的线程数
             void SetThrdNum(int thrdNum);
             // 设置创建线程池时会调用的初始化函数
             void SetThreadInitCallback(const std::function<void()>& callback) { m_thrdInitCallBack = callback; }
 
             void Stop();
-            // 在线程池内执行该函数
+            // 在线程池内执行该函数，注入队列满了会阻塞
             void Run(std::function<void()> func);
+            // 一次放进多个任务，每批只抢一次位置、唤醒一次，注入队列满了会阻塞
+            void RunBatch(std::vector<std::function<void()>> funcs);
+            // 不阻塞，注入队列满了返回false，适合在IO线程中调用
+            bool TryRun(std::function<void()> func);
+            // 在线程池内执行func，通过返回值的Then回到当前线程的EventLoop中拿到结果
+            template <typename Func>
+            TaskHandle<std::invoke_result_t<std::decay_t<Func>&>> Submit(Func&& func);
+            // 等待已经Run的任务全部执行完，然后Stop
             void Join();
 
             const std::string& Name() const { return m_name; }
+            // 所有队列中还没开始执行的任务数
             uint64_t Size() const;
+            // 注入队列(包括溢出队列)中的任务数
+            uint64_t QueueDepth() const;
+            // TryRun因为队列满了被拒绝的次数
+            uint64_t RejectedNum() const { return m_rejectedNum.load(std::memory_order_relaxed); }
+            // 正在运行的线程数
+            int ThrdNum() const { return m_activeNum.load(std::memory_order_relaxed); }
+            // 合并所有线程的排队时间直方图到out，单位纳秒，需要EnableMetrics或SetElastic
+            void GetQueueWaitHistogram(Histogram* out) const;
+            // 合并所有线程的执行时间直方图到out，单位纳秒，需要EnableMetrics或SetElastic
+            void GetRunTimeHistogram(Histogram* out) const;
 
         private:
-            // 线程不安全，这个函数必须在m_mu已被锁上时才能调用
-            // 当 m_maxSize == 0时恒为不满
-            bool Full() const;
+            using Task = WorkStealingDeque::Task;
+            struct Worker {
+                WorkStealingDeque deque;
+                std::unique_ptr<Thread> thrd;
+                std::atomic_bool isRetired = false;  // 空闲太久退出了，可以被监控线程重新启动
+                Histogram queueWait;
+                Histogram runTime;
+                alignas(64) std::atomic_uint64_t windowWaitSum = 0;  // 本监控周期内的排队时间之和
+                std::atomic_uint64_t windowWaitNum = 0;              // 本监控周期内开始执行的任务数
+            };
+
             // 线程池在这个函数中循环
-            void Handle();
-            std::function<void()> Take();
+            void Handle(int index);
+            // 取出一个任务，没有任务时自旋后睡眠，线程池停止或者这个线程该退出时返回nullptr
+            Task* Take(int index);
+            // 弹性模式下空闲太久时调用，线程数大于下限才退出
+            bool TryRetire(int index);
+            // 在下标为index的槽上启动线程
+            void StartWorker(int index);
+            // 监控线程在这个函数中循环，排队时间太长就加线程
+            void Monitor();
+            // 新建任务，需要统计时记下入队时间
+            Task* NewTask(std::function<void()>&& func);
+            // 依次尝试自己的队列、注入队列、其他线程的队列
+            Task* TryTake(int index);
+            // 有睡眠的线程时唤醒num个
+            void WakeUp(uint64_t num);
+            // 注入队列满了，等到有num个空位为止
+            void WaitNotFull(uint64_t num);
+            // 把num个任务放进注入队列，num不超过容量，isBlocking为false时放不下就返回false
+            bool Inject(Task** tasks, uint64_t num, bool isBlocking);
 
         private:
+            static const int k_SpinNum = 64;                  // 睡眠前自旋的次数
+            static const uint64_t k_DefaultQueueSize = 4096;  // 不限制大小时注入队列的容量
+            static const int k_MonitorIntervalMs = 10;        // 监控线程的检查间隔
+
             std::atomic_bool m_isRunning = 0;  // 退出的标志
             uint64_t m_maxSize = 0;
             std::string m_name;
-            mutable std::mutex m_mu;
-            std::condition_variable m_notEmptyCond;
+            bool m_isRecording = false;  // 是否统计排队时间和执行时间
+            bool m_isElastic = false;
+            int m_minThrdNum = 0;
+            int m_maxThrdNum = 0;
+            int64_t m_maxQueueWait = 0;  // 纳秒
+            int64_t m_maxIdle = 0;       // 纳秒
+            std::atomic_int m_activeNum = 0;  // 正在运行的工作线程数
+            std::unique_ptr<Thread> m_monitor;
+            std::mutex m_monitorMu;
+            std::condition_variable m_monitorCond;  // Stop时唤醒监控线程
+            alignas(64) std::atomic_int64_t m_queuedNum = 0;   // 所有队列中的任务数
+            alignas(64) std::atomic_int64_t m_pendingNum = 0;  // 已Run但还没执行完的任务数
+            std::atomic_int m_sleeperNum = 0;                  // 正在睡眠的线程数
+            std::atomic_int m_notFullWaiterNum = 0;            // 在等待队列有空位的线程数
+            std::mutex m_parkMu;
+            std::condition_variable m_parkCond;
+            std::mutex m_notFullMu;
             std::condition_variable m_notFullCond;
+            std::atomic_uint64_t m_rejectedNum = 0;
+            std::unique_ptr<BoundedMpmcQueue<Task*>> m_injection;
+            std::atomic_int64_t m_overflowNum = 0;  // 溢出队列中的任务数
+            std::mutex m_overflowMu;                // 保护m_overflow
+            std::deque<Task*> m_overflow;
             std::function<void()> m_thrdInitCallBack;
-            std::vector<std::unique_ptr<Thread>> m_thrds;
-            std::deque<std::function<void()>> m_tasks;
+            std::vector<std::unique_ptr<Worker>> m_workers;
+        };
+
+
+        // 在ThreadPool上串行执行的执行器，同一个Strand的任务按Run的顺序执行，不会同时执行
+        // 不同的Strand之间完全并行，例如每个TcpConnection一个Strand
+        // 任务放进侵入式无锁MPSC队列，队列从空变成非空时才往线程池投递一次Drain
+        // 必须用std::make_shared创建，没执行完的任务会让Strand一直活着
+        class Strand : uncopyable, public std::enable_shared_from_this<Strand> {
+        public:
+            explicit Strand(ThreadPool* pool) : m_pool(pool) { m_head.store(&m_stub, std::memory_order_relaxed); }
+            ~Strand();
+
+            // 可以跨线程调用
+            void Run(std::function<void()> func);
+            ThreadPool* GetPool() const { return m_pool; }
+            // 还没执行完的任务数
+            uint64_t Size() const { return m_pendingNum.load(std::memory_order_relaxed); }
+
+        private:
+            struct Node {
+                std::atomic<Node*> next = nullptr;
+                std::function<void()> task;
+            };
+
+            // 只有生产者调用
+            void Push(Node* node);
+            // 只有Drain调用，有生产者正在Push时可能返回nullptr
+            Node* Pop();
+            // 在线程池中依次执行任务，每次最多执行k_BatchNum个，剩下的重新投递，以免一个Strand占着线程不放
+            void Drain();
+
+            static const int k_BatchNum = 64;
+
+            ThreadPool* m_pool;
+            Node m_stub;                                   // 哨兵节点
+            alignas(64) std::atomic<Node*> m_head;         // 生产者在这里入队
+            alignas(64) Node* m_tail = &m_stub;            // Drain从这里出队
+            alignas(64) std::atomic_uint64_t m_pendingNum = 0;  // 从0变成1的Run负责投递Drain
         };
 
 
 
         class LogStream : uncopyable {
         public:
-            using FixedBuf = FixedBuffer<k_SmallBuf>;
+            using Buf = LogBuffer;
 
             void Append(const char* data, int len) { m_buf.Append(data, len); }
-            const FixedBuf& Buffer() const { return m_buf; }
+            const Buf& Buffer() const { return m_buf; }
+            Buf& Buffer() { return m_buf; }
             void ResetBuffer() { m_buf.Reset(); }
 
             LogStream& operator<<(bool val);
@@ -396,29 +859,129 @@ namespace kurisu {
             LogStream& operator<<(const unsigned char* p);
             LogStream& operator<<(const std::string& str);
             LogStream& operator<<(const std::string_view& str);
-            LogStream& operator<<(const FixedBuf& buf);
+            LogStream& operator<<(const Buf& buf);
             LogStream& operator<<(const FixedString& str);
             LogStream& operator<<(const detail::KnownLengthString& str);
 
+            // fmt的语法，直接格式化到m_buf，不产生临时的string，超过一条日志最大长度的部分被截掉
+            // format是FMT_COMPILE时，能确定放得下就走编译期生成的格式化代码，自定义类型特化fmt::formatter即可
+            template <typename S, typename... Args>
+            LogStream& Format(const S& format, const Args&... args);
+
         private:
             template <class T>
             void FormatInt(T val);
+            template <typename S, typename... Args>
+            void FormatToN(const S& format, const Args&... args);
 
         private:
-            FixedBuf m_buf;
+            Buf m_buf;
             static const int k_MaxSize = 32;  // 除const char* std::strubg std::string_view之外，一次能写入的最大字节数
         };
 
         template <class T>
         void LogStream::FormatInt(T val)
         {
-            if (m_buf.AvalibleSize() >= k_MaxSize)
+            if (m_buf.Reserve(k_MaxSize))
             {
                 uint64_t len = Convert(m_buf.Index(), val);
                 m_buf.IndexShiftRight(len);
             }
         }
 
+        // 格式化结果长度的上界，算不出来时返回k_Unbounded
+        inline constexpr uint64_t k_Unbounded = UINT64_MAX / 4;
+        // 格式字符串本身的长度加上宽度、精度，{}里嵌套{}时宽度是运行时才知道的
+        constexpr uint64_t FormatStringSizeBound(fmt::string_view format)
+        {
+            uint64_t bound = format.size();
+            bool isInField = false;
+            uint64_t num = 0;
+            for (uint64_t i = 0; i < format.size(); i++)
+            {
+                char ch = format.data()[i];
+                if (!isInField)
+                {
+                    if (ch == '{' && i + 1 < format.size() && format.data()[i + 1] == '{')
+                        i++;
+                    else if (ch == '{')
+                        isInField = true;
+                    continue;
+                }
+                if (ch == '{')
+                    return k_Unbounded;
+                if (ch >= '0' && ch <= '9')
+                {
+                    if ((num = num * 10 + uint64_t(ch - '0')) > 1000000)
+                        return k_Unbounded;
+                    continue;
+                }
+                bound += num * 4;  // 填充字符最多4字节
+                num = 0;
+                if (ch == '}')
+                    isInField = false;
+            }
+            return bound;
+        }
+        // 一个参数的长度上界，字符串要到运行时才知道，记为0
+        template <typename T>
+        constexpr uint64_t FormatArgSizeBound()
+        {
+            if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, char>)
+                return 8;
+            else if constexpr (std::is_integral_v<T>)
+                return 72;  // 二进制64位加前缀和符号
+            else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>)
+                return 330;  // 定点格式的DBL_MAX有309位
+            else if constexpr (std::is_pointer_v<T> && !std::is_convertible_v<T, const char*>)
+                return 24;
+            else if constexpr (std::is_convertible_v<T, std::string_view>)
+                return 0;
+            else
+                return k_Unbounded;
+        }
+        template <typename T>
+        uint64_t FormatArgSize(const T& arg)
+        {
+            if constexpr (std::is_convertible_v<T, std::string_view> && !std::is_same_v<T, std::nullptr_t>)
+                return std::string_view(arg).size();
+            else
+                return 0;
+        }
+
+        template <typename S, typename... Args>
+        LogStream& LogStream::Format(const S& format, const Args&... args)
+        {
+            if constexpr (fmt::detail::is_compiled_string<S>::value)
+            {
+                constexpr uint64_t bound = (FormatStringSizeBound(S()) + ... + FormatArgSizeBound<std::decay_t<Args>>());
+                if (bound < k_Unbounded && m_buf.Reserve(bound + (FormatArgSize(args) + ... + 0)))
+                {
+                    char* end = fmt::format_to(m_buf.Index(), format, args...);
+                    m_buf.IndexShiftRight(end - m_buf.Index());
+                    return *this;
+                }
+                // 可能放不下，一边格式化一边检查长度，编译期已经检查过格式字符串了
+                FormatToN(fmt::string_view(S()), args...);
+            }
+            else
+                FormatToN(format, args...);
+            return *this;
+        }
+        template <typename S, typename... Args>
+        void LogStream::FormatToN(const S& format, const Args&... args)
+        {
+            uint64_t n = m_buf.AvalibleSize();
+            auto res = fmt::format_to_n(m_buf.Index(), n, format, args...);
+            // 放不下时换到更大的缓冲区重新格式化一次
+            if (res.size > n && m_buf.Reserve(res.size))
+            {
+                n = m_buf.AvalibleSize();
+                res = fmt::format_to_n(m_buf.Index(), n, format, args...);
+            }
+            m_buf.IndexShiftRight(std::min<uint64_t>(res.size, n));
+        }
+
 
 
     }  // namespace detail
@@ -433,27 +996,51 @@ namespace kurisu {
             ERROR,
             FATAL,
         };
+        // LOG_*_KV整行的格式
+        enum class KvFormat {
+            k_Json,    // {"time":"...","tid":1,"level":"INFO","file":"a.cpp","line":1,"msg":"...","key":value}
+            k_Logfmt,  // time=... tid=1 level=INFO file=a.cpp line=1 msg=... key=value
+        };
+        struct KvTag {};
+
+        // file只取文件名部分，LOG_*在编译期就去掉了目录
         Logger(const std::string_view& file, int line);
         Logger(const std::string_view& file, int line, LogLevel level);
         Logger(const std::string_view& file, int line, LogLevel level, const char* func);
         Logger(const std::string_view& file, int line, bool toAbort);
+        // LOG_*_KV用，前缀也按KvFormat写
+        Logger(const std::string_view& file, int line, LogLevel level, KvTag);
         ~Logger();
 
         detail::LogStream& Stream() { return m_fmt.m_strm; }
-        static LogLevel Level();
-
-        class SetLogLevel;
-
+        // LOG_*_KV用，写入msg和成对的key、value，value可以是bool、数字、字符和字符串
+        // 直接转义进Stream的缓冲区，放不下时截断字符串或者丢掉后面的key，整行仍然是完整的JSON
+        template <typename... Args>
+        void Kv(std::string_view msg, const Args&... args);
+        static LogLevel Level();  // 内联，只读一个全局变量
+        // 任意线程都可以调用，没有单独设置过等级的LogCategory也跟着改
+        static void SetLevel(LogLevel level);
+        // 在SetOutput设置的函数或者LogSinks的输出中调用，返回正在输出的这条日志的等级，不是Logger输出的算INFO
+        static LogLevel OutputLevel();
+
+        // 只有一个输出，要同时输出到多个地方用LogSinks
         static void SetOutput(void (*)(const char* msg, const uint64_t len));
         static void SetFlush(void (*)());
         static void SetTimeZone(bool isLocal) { s_isLocalTimeZone = isLocal; }
+        static void SetKvFormat(KvFormat format) { s_kvFormat = format; }
+        // 一条日志的最大长度，默认256KB，超过4000字节的日志才会用到溢出缓冲区
+        static void SetMaxRecordSize(uint64_t size) { detail::LogBuffer::SetMaxSize(size); }
 
     private:
         class Formatter {
         public:
             using LogLevel = Logger::LogLevel;
             Formatter(LogLevel level, int old_errno, std::string_view file, int line);
-            void FormatTime();
+            Formatter(LogLevel level, std::string_view file, int line, KvTag);
+            // 写入时间、tid、日志等级
+            void FormatPrefix();
+            // 按m_kvFormat写入时间、tid、日志等级、文件名、行号和msg
+            void FormatKvPrefix(std::string_view msg);
             void Finish();
 
             Timestamp m_time;  // 要格式化的时间戳
@@ -462,17 +1049,175 @@ namespace kurisu {
             int m_line;               // 要格式化的行号
             const char* m_fileName;   // 要格式化的日志名
             uint64_t m_fileNameSize;  // 日志名的长度
+            bool m_isKv = false;      // LOG_*_KV写的
+            KvFormat m_kvFormat = KvFormat::k_Json;
+
+        private:
+            // 更新线程缓存的前缀中的时间和tid
+            void UpdatePrefix();
         };
 
+        template <typename K, typename V, typename... Args>
+        void KvPairs(const K& key, const V& val, const Args&... args);
+
     private:
         static bool s_isLocalTimeZone;  // 日志是否采用本地时区
+        static KvFormat s_kvFormat;     // LOG_*_KV的格式
         Formatter m_fmt;                // 要格式器
     };
 
     namespace detail {
+        // 路径中最后一个'/'之后的位置
+        constexpr uint64_t BasenameOffset(std::string_view file)
+        {
+            auto slash = file.rfind('/');
+            return slash == std::string_view::npos ? 0 : slash + 1;
+        }
         void DefaultOutput(const char* msg, const uint64_t len);
         void DefaultFlush();
         Logger::LogLevel InitLogLevel();
+        extern std::atomic<Logger::LogLevel> g_logLevel;  // 独占一个cache line，几乎只读
+    }  // namespace detail
+
+    inline Logger::LogLevel Logger::Level() { return detail::g_logLevel.load(std::memory_order_relaxed); }
+
+    namespace detail {
+        // LOG_*_KV的一对key、value，按format转义后写进strm，放不下就整对丢掉
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, std::string_view val);
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, bool val);
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, int64_t val);
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, uint64_t val);
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, double val);
+    }  // namespace detail
+
+    template <typename... Args>
+    void Logger::Kv(std::string_view msg, const Args&... args)
+    {
+        static_assert(sizeof...(Args) % 2 == 0, "LOG_*_KV needs key value pairs");
+        m_fmt.FormatKvPrefix(msg);
+        if constexpr (sizeof...(Args) != 0)
+            KvPairs(args...);
+    }
+    template <typename K, typename V, typename... Args>
+    void Logger::KvPairs(const K& key, const V& val, const Args&... args)
+    {
+        detail::LogStream& strm = m_fmt.m_strm;
+        if constexpr (std::is_same_v<V, bool>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, val);
+        else if constexpr (std::is_same_v<V, char>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, std::string_view(&val, 1));
+        else if constexpr (std::is_integral_v<V> && std::is_signed_v<V>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, (int64_t)val);
+        else if constexpr (std::is_integral_v<V>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, (uint64_t)val);
+        else if constexpr (std::is_enum_v<V>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, (int64_t)val);
+        else if constexpr (std::is_floating_point_v<V>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, (double)val);
+        else if constexpr (std::is_convertible_v<const V&, std::string_view>)
+            detail::AppendKv(strm, m_fmt.m_kvFormat, key, std::string_view(val));
+        else
+            static_assert(sizeof(V) == 0, "LOG_*_KV values must be bool, numbers, enums, chars or strings");
+        if constexpr (sizeof...(Args) != 0)
+            KvPairs(args...);
+    }
+
+    // 日志分类，每个分类有自己的等级，用LOG_*_C(category)写日志
+    // 库里的分类有net.poller net.loop net.conn net.client net.server timer
+    class LogCategory : detail::uncopyable {
+    public:
+        // name必须一直有效，一般是字符串字面量，等级一开始跟随Logger::Level
+        explicit LogCategory(const char* name);
+        ~LogCategory();
+
+        const char* Name() const { return m_name; }
+        Logger::LogLevel Level() const { return m_level.load(std::memory_order_relaxed); }
+        // 单独设置等级之后不再跟随Logger::SetLevel
+        void SetLevel(Logger::LogLevel level);
+        // 不再单独设置，回到Logger::Level
+        void ResetLevel();
+
+        // 按名字设置等级，"net.*"匹配所有net.开头的分类，"*"匹配所有，返回匹配到几个
+        static int SetLevel(std::string_view pattern, Logger::LogLevel level);
+        // 所有分类和它们的等级
+        static std::vector<std::pair<std::string, Logger::LogLevel>> List();
+
+    private:
+        friend class Logger;
+        const char* m_name;
+        std::atomic<Logger::LogLevel> m_level;
+        bool m_isExplicit = false;  // 是否单独设置过等级，由注册表的锁保护
+    };
+
+    namespace detail {
+        // LOG_EVERY_N等限流日志的调用点状态，Check返回k_LogDenied表示这条不写，否则返回上次写之后被丢掉了多少条
+        inline constexpr uint64_t k_LogDenied = UINT64_MAX;
+
+        // 写在日志开头的"(suppressed N) "，N为0时什么都不写
+        struct LogSuppressed {
+            uint64_t num;
+        };
+        inline LogStream& operator<<(LogStream& strm, LogSuppressed suppressed)
+        {
+            if (suppressed.num != 0)
+                strm << "(suppressed " << suppressed.num << ") ";
+            return strm;
+        }
+
+        // 每n条写一条
+        class LogEveryN : uncopyable {
+        public:
+            explicit LogEveryN(uint64_t n) : m_n(n == 0 ? 1 : n) {}
+            uint64_t Check()
+            {
+                uint64_t i = m_count.fetch_add(1, std::memory_order_relaxed);
+                if (i % m_n != 0)
+                    return k_LogDenied;
+                return i == 0 ? 0 : m_n - 1;
+            }
+
+        private:
+            const uint64_t m_n;
+            std::atomic_uint64_t m_count = 0;
+        };
+        // 只写前n条
+        class LogFirstN : uncopyable {
+        public:
+            explicit LogFirstN(uint64_t n) : m_n(n) {}
+            uint64_t Check()
+            {
+                if (m_count.load(std::memory_order_relaxed) >= m_n)
+                    return k_LogDenied;
+                return m_count.fetch_add(1, std::memory_order_relaxed) < m_n ? 0 : k_LogDenied;
+            }
+
+        private:
+            const uint64_t m_n;
+            std::atomic_uint64_t m_count = 0;
+        };
+        // 每隔seconds秒最多写一条
+        class LogEverySeconds : uncopyable {
+        public:
+            explicit LogEverySeconds(double seconds) : m_intervalNs((int64_t)(seconds * 1e9)) {}
+            uint64_t Check();
+
+        private:
+            const int64_t m_intervalNs;
+            std::atomic_int64_t m_nextNs = 0;  // 下一次可以写的时间
+            std::atomic_uint64_t m_suppressed = 0;
+        };
+        // 令牌桶，平均每秒perSecond条，最多连续burst条，用GCRA实现，只有一个CAS
+        class LogRateLimit : uncopyable {
+        public:
+            LogRateLimit(double perSecond, double burst);
+            uint64_t Check();
+
+        private:
+            const int64_t m_intervalNs;   // 每条之间的间隔
+            const int64_t m_toleranceNs;  // 允许提前多久，即burst-1条的间隔
+            std::atomic_int64_t m_tatNs = 0;  // 理论上下一条到来的时间
+            std::atomic_uint64_t m_suppressed = 0;
+        };
     }  // namespace detail
 
     namespace process {
@@ -502,23 +1247,67 @@ namespace kurisu {
 
     }  // namespace process
 
+    // 日志文件怎么写
+    struct LogFileOptions {
+        bool isDirect = false;                 // 用DirectLogFileAppender代替stdio，磁盘忙时少阻塞，日志不占page cache
+        bool isPreallocate = true;             // isDirect时按rollSize预分配磁盘空间
+        uint64_t syncBytes = 8 * 1024 * 1024;  // isDirect时每写入多少字节fdatasync一次，0表示只在关闭文件时
+        bool isPreopen = false;                // 由PrepareNext提前打开下一个文件，roll时只要改个名字
+        bool isCompress = false;               // roll掉的文件在低优先级的后台线程中压缩成.gz，编译时要打开KURISU_WITH_ZLIB
+        int maxFiles = 0;                      // 最多保留多少个roll掉的文件，0表示不限
+        uint64_t maxTotalBytes = 0;            // roll掉的文件最多占多少字节，0表示不限
+    };
+
+    namespace detail {
+        // 在低优先级的后台线程中压缩roll掉的日志文件，并按LogFileOptions删掉最老的
+        class LogFileArchiver : uncopyable {
+        public:
+            LogFileArchiver(const std::string& basename, const LogFileOptions& options);
+            // 处理完已经交进来的文件再退出
+            ~LogFileArchiver();
+            // closedFile已经关闭，activeFile是正在写的文件，不能删
+            void Add(const std::string& closedFile, const std::string& activeFile);
+
+        private:
+            void Handle();
+            void Compress(const std::string& filename);
+            // 按文件名中的时间从新到旧保留，超出maxFiles或maxTotalBytes的删掉
+            void Retain(const std::string& activeFile);
+
+            const std::string m_dir;     // 日志文件所在的目录
+            const std::string m_prefix;  // 日志文件名的开头
+            const LogFileOptions m_options;
+            std::mutex m_mu;
+            std::condition_variable m_cond;
+            std::deque<std::string> m_closedFiles;
+            std::string m_activeFile;
+            bool m_isStopping = false;
+            Thread m_thrd;
+        };
+    }  // namespace detail
+
     class SyncLogFile : detail::uncopyable {
     public:
-        SyncLogFile(const std::string& filename, uint64_t rollSize, bool isLocalTimeZone, bool threadSafe = true, int flushInterval = 3, int checkEveryN = 1024)
-            : m_filename(filename), k_RollSize(rollSize), k_FlushInterval(flushInterval), k_CheckEveryN(checkEveryN), m_isLocalTimeZone(isLocalTimeZone), m_mu(threadSafe ? std::make_unique<std::mutex>() : NULL) { Roll(); }
-        ~SyncLogFile() = default;
+        SyncLogFile(const std::string& filename, uint64_t rollSize, bool isLocalTimeZone, bool threadSafe = true, int flushInterval = 3, int checkEveryN = 1024,
+                    const LogFileOptions& options = LogFileOptions());
+        ~SyncLogFile();
         void Append(const char* logline, const uint64_t len);
         void Flush();
         bool Roll();
+        // isPreopen时在写日志之外的线程调用，提前打开下一个文件，AsyncLogFile的后台线程每轮写完都会调用
+        void PrepareNext();
 
     private:
         void AppendUnlocked(const char* logline, const uint64_t len);
+        void FlushUnlocked();
         std::string MakeLogFileName(const std::string& basename, const Timestamp& now);
+        void OpenNext(const std::string& filename);
 
         const std::string m_filename;
         const uint64_t k_RollSize;  //   多少byte就roll一次
         const int k_FlushInterval;  // 多少秒就flush一次
         const int k_CheckEveryN;    // 每写入N次就强制检查一次，与m_count配合使用
+        const LogFileOptions m_options;
 
         bool m_isLocalTimeZone;  // 是否使用本地时区
         int m_count = 0;         // 记录被写入的次数，与k_CheckEveryN配合使用
@@ -526,22 +1315,155 @@ namespace kurisu {
         time_t m_lastRoll = 0;   // 上次roll的时间
         time_t m_lastFlush = 0;  // 上次flush的时间
         std::unique_ptr<std::mutex> m_mu;
-        std::unique_ptr<detail::LogFileAppender> m_appender;
+        std::unique_ptr<detail::LogFileAppender> m_appender;              // 默认
+        std::unique_ptr<detail::DirectLogFileAppender> m_directAppender;  // m_options.isDirect
+        std::unique_ptr<detail::LogFileAppender> m_nextAppender;          // PrepareNext打开的，还用着临时的名字
+        std::unique_ptr<detail::DirectLogFileAppender> m_nextDirectAppender;
+        const std::string m_fileSuffix;  // .主机名.pid.log，只算一次
+        const std::string m_nextName;    // 提前打开的文件的临时名字
+        std::string m_currentName;
+        std::unique_ptr<detail::LogFileArchiver> m_archiver;  // 有压缩或者保留策略时才有
         static const int k_OneDaySeconds = 60 * 60 * 24;  // 一天有多少秒
     };
 
+    // AsyncLogFile、BinaryLogFile中某个线程的LogRing满了时怎么办
+    struct LogOverflowPolicy {
+        enum Kind {
+            k_Block,           // 等后台线程腾出空间，blockSeconds秒之后还放不下就丢掉这一条，blockSeconds为0时一直等
+            k_DropNewest,      // 丢掉这一条
+            k_DropOldest,      // 丢掉最老的日志腾出空间
+            k_DropBelowLevel,  // 低于keepLevel的丢掉这一条，其他的一直等，ERROR及以上一条都不会丢
+        };
+        Kind kind = k_Block;
+        double blockSeconds = 0;
+        Logger::LogLevel keepLevel = Logger::LogLevel::ERROR;
+    };
+    // 丢掉的日志和LogRing的用量
+    struct LogRingStats {
+        uint64_t droppedLines = 0;
+        uint64_t droppedBytes = 0;
+        uint64_t highWatermark = 0;  // 单个LogRing最多被占用过多少字节
+        uint64_t ringCapacity = 0;   // 每个LogRing多少字节，内存用量是它乘以写过日志的线程数
+    };
+
+    namespace detail {
+        // AsyncLogFile中每个写日志的线程独占的单生产者单消费者环形缓冲区
+        // 每条日志前面有一个记录头，尾部放不下时留一个填充记录，从头开始写
+        class LogRing : uncopyable {
+        public:
+            struct Header {
+                uint32_t len;   // 日志的长度，k_Padding表示这是填充记录
+                uint32_t size;  // 整条记录占的字节数，16字节对齐
+                int64_t time;   // LogRingSet::Ticks，合并时用
+            };
+            static const uint32_t k_Padding = UINT32_MAX;
+
+            // capacity会向上取整到2的幂，isDropOldest时生产者可以丢掉最老的日志，消费者要用CopyAndPopFront
+            explicit LogRing(uint64_t capacity, bool isDropOldest = false);
+
+            // 生产者调用，放不下返回false
+            bool TryPush(const char* logline, uint64_t len, int64_t time);
+            // 生产者调用，丢掉最老的一条，返回它的长度，没有丢掉日志(只是填充记录或者消费者刚好读走了)时返回k_Padding
+            uint32_t DropFront();
+            // 消费者调用，看一眼此时已经写入的位置，之后Front只会读到这里
+            void Snapshot() { m_readLimit = m_tail.load(std::memory_order_acquire); }
+            // 消费者调用，返回下一条日志，读到Snapshot的位置时返回nullptr
+            const Header* Front();
+            // 消费者调用，丢掉Front返回的那条
+            void PopFront(const Header* header) { m_head.store(m_head.load(std::memory_order_relaxed) + header->size, std::memory_order_release); }
+            // 消费者调用，isDropOldest时用，把Front返回的那条复制到out再丢掉，期间被生产者丢掉了返回false，out的内容作废
+            bool CopyAndPopFront(const Header* header, std::vector<uint64_t>* out);
+
+            uint64_t Capacity() const { return m_mask + 1; }
+            uint64_t Used() const { return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed); }
+
+            std::atomic_bool isAbandoned = false;  // 写日志的线程已经退出，读完就可以丢掉
+
+        private:
+            const uint64_t m_mask;
+            const bool m_isDropOldest;
+            std::unique_ptr<char[]> m_buf;
+            alignas(64) std::atomic_uint64_t m_head = 0;  // 读的位置，单调递增，isDropOldest时生产者和消费者都用CAS推进
+            uint64_t m_readLimit = 0;                     // 消费者本轮最多读到哪里
+            alignas(64) std::atomic_uint64_t m_tail = 0;  // 写的位置，单调递增
+            uint64_t m_cachedHead = 0;                    // 生产者缓存的m_head，减少对消费者缓存行的访问
+        };
+
+        // 一组LogRing，每个写日志的线程一个，后台线程按时间戳把它们合并读出
+        class LogRingSet : uncopyable {
+        public:
+            LogRingSet(uint64_t ringSize, const LogOverflowPolicy& policy);
+
+            // 写入当前线程的LogRing，过半时叫醒后台线程，满了按LogOverflowPolicy处理，Close之后直接丢弃
+            void Push(const char* data, uint64_t len, Logger::LogLevel level);
+            // 后台线程调用，等到有LogRing过半或者超时
+            void Wait(int seconds);
+            // 后台线程调用，把所有LogRing中现有的日志按时间合并后依次交给func，同一个线程的日志保持顺序
+            void Drain(const std::function<void(const LogRing::Header*)>& func);
+            // 不再等待后台线程，并叫醒它
+            void Close();
+            LogRingStats Stats() const;
+            // 后台线程调用，把Ticks换算成system_clock的纳秒数，每次Drain前会重新校准
+            int64_t TicksToRealNs(int64_t ticks) const { return m_baseRealNs + int64_t(double(ticks - m_baseTicks) * m_nsPerTick); }
+
+            // 写入时打的时间戳，x86上直接读TSC，比steady_clock便宜得多
+            static int64_t Ticks()
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                return (int64_t)__rdtsc();
+#else
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+            }
+
+        private:
+            // 当前线程的LogRing，第一次调用时创建并登记
+            LogRing* ThreadRing();
+            // LogRing满了时按m_policy再试，返回false表示要丢掉这一条
+            bool PushFull(LogRing* ring, const char* data, uint64_t len, int64_t time, Logger::LogLevel level);
+            void CountDropped(uint64_t len);
+            void UpdateHighWatermark(uint64_t used);
+            // 用从构造到现在steady_clock走过的时间算出每个tick多少纳秒
+            void Calibrate();
+
+            const uint64_t m_ringSize;
+            const uint64_t m_id;                   // 区分不同的LogRingSet，线程用它找到自己的LogRing
+            std::atomic_bool m_isClosed = false;
+            std::atomic<pid_t> m_consumerTid = 0;  // 后台线程自己写日志时不能等自己
+            std::mutex m_wakeMu;
+            std::condition_variable m_wakeCond;    // 有LogRing过半或者满了
+            std::mutex m_ringsMu;                  // 保护m_rings，只在登记新线程和Drain时加锁
+            std::vector<std::shared_ptr<LogRing>> m_rings;
+            const LogOverflowPolicy m_policy;
+            std::vector<uint64_t> m_copyBuf;  // k_DropOldest时Drain复制日志用
+            std::atomic_uint64_t m_droppedLines = 0;
+            std::atomic_uint64_t m_droppedBytes = 0;
+            std::atomic_uint64_t m_highWatermark = 0;
+            int64_t m_baseTicks;     // 构造时的Ticks
+            int64_t m_baseSteadyNs;  // 构造时steady_clock的纳秒数
+            int64_t m_baseRealNs;    // 构造时system_clock的纳秒数
+            double m_nsPerTick = 1.0;
+            static std::atomic_uint64_t s_createdNum;
+        };
+    }  // namespace detail
+
+    // 异步日志文件，每个线程写自己的LogRing，Append不加锁
+    // 后台线程按时间戳把所有LogRing中的日志合并后写入文件，同一个线程的日志保持顺序
     class AsyncLogFile : detail::uncopyable {
     public:
-        AsyncLogFile(const std::string& basename, int64_t rollSize, bool isLocalTimeZone = false, int flushInterval = 3);
+        AsyncLogFile(const std::string& basename, int64_t rollSize, bool isLocalTimeZone = false, int flushInterval = 3, uint64_t ringSize = k_DefaultRingSize,
+                     const LogOverflowPolicy& policy = LogOverflowPolicy(), const LogFileOptions& fileOptions = LogFileOptions());
         ~AsyncLogFile();
 
+        // LogRing满了按LogOverflowPolicy处理，日志等级取Logger::OutputLevel
         void Append(const char* logline, uint64_t len);
         void Stop();
+        // 丢了多少日志，丢过日志时文件中也会写一行说明
+        LogRingStats Stats() const { return m_rings.Stats(); }
+
+        static const uint64_t k_DefaultRingSize = 1024 * 1024;  // 每个线程的LogRing的大小
 
     private:
-        using FixedBuf = detail::FixedBuffer<detail::k_LargeBuf>;
-        using BufVector = std::vector<std::unique_ptr<FixedBuf>>;
-        using BufPtr = BufVector::value_type;
         // m_thrd在此函数内循环
         void Handle();
 
@@ -551,31 +1473,381 @@ namespace kurisu {
         std::atomic_bool m_isRunning = false;  // 是否已运行
         const std::string m_fileName;
         const int64_t m_rollSize;  //  多少byte就roll一次
+        const LogFileOptions m_fileOptions;
+        detail::LogRingSet m_rings;
+        uint64_t m_reportedDropped = 0;  // 已经在文件中说明过的丢掉的条数
         detail::Thread m_thrd;
         detail::CountDownLatch m_latch = detail::CountDownLatch(1);
+    };
+
+    // 日志直接复制进mmap映射的文件，进程崩溃或者被kill时已经Append的日志都在page cache中，不会丢
+    // 文件按windowSize一段一段地预分配并映射，写满一段换下一段，多线程Append加锁
+    // 没有正常关闭的文件末尾会留下一些0字节
+    class MmapLogFile : detail::uncopyable {
+    public:
+        MmapLogFile(const std::string& basename, uint64_t rollSize, bool isLocalTimeZone = false, uint64_t windowSize = k_DefaultWindowSize);
+        ~MmapLogFile();
+
+        void Append(const char* logline, uint64_t len);
+        // 等日志落盘，进程崩溃不需要，机器掉电才需要
+        void Flush();
+
+        static const uint64_t k_DefaultWindowSize = 4 * 1024 * 1024;
+
+    private:
+        // 同一秒内不会roll两次
+        void Roll();
+        // 映射文件中从m_pos开始的一段，失败时m_window为nullptr
+        void MapWindow();
+        // 取消映射，把文件截断到实际写入的大小
+        void Close();
+
         std::mutex m_mu;
-        std::condition_variable m_fullCond;  // 前端的buf是否已满
-        BufPtr m_thisBuf;                    // 前端用的buf
-        BufPtr m_nextBuf;                    // 前端的备用buf
-        BufVector m_bufs;                    // 后端用的buf
+        const std::string m_basename;
+        const uint64_t m_rollSize;
+        const uint64_t m_windowSize;  // 页大小的整数倍
+        const bool m_isLocalTimeZone;
+        const std::string m_fileSuffix;  // .主机名.pid.log
+        int m_fd = -1;
+        char* m_window = nullptr;    // 当前映射的区域
+        uint64_t m_windowBegin = 0;  // 映射的区域在文件中的偏移
+        uint64_t m_pos = 0;          // 下一条日志写在文件的哪里
+        time_t m_lastRoll = 0;
     };
 
+    // LogSinks中一个输出怎么用
+    struct LogSinkOptions {
+        Logger::LogLevel minLevel = Logger::LogLevel::TRACE;  // 低于这个等级的日志不交给它
+        bool isAsync = false;                                  // 在自己的后台线程中输出，写日志的线程只排个队
+        uint64_t queueBytes = 16 * 1024 * 1024;                // isAsync时最多积压多少字节
+        LogOverflowPolicy policy;                              // isAsync时积压满了怎么办
+    };
 
+    // 同时输出到多个地方，比如ERROR以上到stderr、全部到AsyncLogFile、WARN以上到远端
+    // 一条日志只格式化一次，同步的输出直接用Logger的缓冲区，所有异步的输出共用同一份拷贝
+    // Add过之后Logger不再调用SetOutput、SetFlush设置的函数，全部Remove后恢复
+    class LogSinks {
+    public:
+        using OutputFunc = std::function<void(const char* msg, uint64_t len)>;
+        using FlushFunc = std::function<void()>;
+
+        // 返回的id用于Remove，output中用Logger::OutputLevel取这条日志的等级
+        static int Add(OutputFunc output, const LogSinkOptions& options = LogSinkOptions(), FlushFunc flush = nullptr);
+        // 返回后不会再有线程调用这个输出，异步的先输出完积压的日志，不能在输出函数中调用
+        static void Remove(int id);
+        // 等异步的输出完积压的日志，再调用所有的flush，FATAL时自动调用
+        static void Flush();
+        // 异步的输出丢掉的日志和积压的用量，ringCapacity是queueBytes
+        static LogRingStats Stats(int id);
+    };
+
+
+    namespace detail {
+        // 二进制日志参数的类型，整数都按64位存
+        enum class BinaryArgType : uint8_t {
+            k_Bool,
+            k_Char,
+            k_Int64,
+            k_Uint64,
+            k_Double,
+            k_String,  // 4字节长度加内容
+        };
 
+        template <typename T>
+        constexpr BinaryArgType BinaryArgTypeOf()
+        {
+            if constexpr (std::is_same_v<T, bool>)
+                return BinaryArgType::k_Bool;
+            else if constexpr (std::is_same_v<T, char>)
+                return BinaryArgType::k_Char;
+            else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+                return BinaryArgType::k_Int64;
+            else if constexpr (std::is_integral_v<T>)
+                return BinaryArgType::k_Uint64;
+            else if constexpr (std::is_floating_point_v<T>)
+                return BinaryArgType::k_Double;
+            else
+            {
+                static_assert(std::is_convertible_v<const T&, std::string_view>, "binary log only supports bool, char, integers, floating points and strings");
+                return BinaryArgType::k_String;
+            }
+        }
+
+        template <typename... Args>
+        struct BinaryArgTypes {
+            // 多放一个，避免没有参数时是空数组
+            static constexpr BinaryArgType k_Types[sizeof...(Args) + 1] = {BinaryArgTypeOf<std::decay_t<Args>>()..., BinaryArgType::k_Bool};
+        };
+
+        // 把一个参数的原始字节写到p，字符串超过end的部分被截断，返回写完的位置
+        template <typename T>
+        char* EncodeBinaryArg(char* p, char* end, const T& arg)
+        {
+            constexpr BinaryArgType type = BinaryArgTypeOf<std::decay_t<T>>();
+            if constexpr (type == BinaryArgType::k_Bool || type == BinaryArgType::k_Char)
+                *p++ = (char)arg;
+            else if constexpr (type == BinaryArgType::k_Int64)
+            {
+                int64_t val = arg;
+                memcpy(p, &val, sizeof(val));
+                p += sizeof(val);
+            }
+            else if constexpr (type == BinaryArgType::k_Uint64)
+            {
+                uint64_t val = arg;
+                memcpy(p, &val, sizeof(val));
+                p += sizeof(val);
+            }
+            else if constexpr (type == BinaryArgType::k_Double)
+            {
+                double val = arg;
+                memcpy(p, &val, sizeof(val));
+                p += sizeof(val);
+            }
+            else
+            {
+                std::string_view str(arg);
+                uint32_t len = (uint32_t)std::min<uint64_t>(str.size(), std::max<int64_t>(end - p - 4, 0));
+                memcpy(p, &len, sizeof(len));
+                memcpy(p + sizeof(len), str.data(), len);
+                p += sizeof(len) + len;
+            }
+            return p;
+        }
+
+        // 二进制日志的调用点，每个LOG_*_B展开成一个静态对象，记录里只放它的地址
+        struct LogSite {
+            const char* file;
+            int line;
+            Logger::LogLevel level;
+            const char* format;
+            std::atomic<const BinaryArgType*> argTypes = nullptr;  // 第一次调用时由参数的类型确定
+            std::atomic_int argNum = 0;
+        };
+
+        // 把一条二进制日志格式化成和Logger一样的文本行，追加到out
+        void FormatBinaryLog(std::string* out, int64_t timeNs, int tid, Logger::LogLevel level, std::string_view file, int line,
+                             std::string_view format, const BinaryArgType* argTypes, int argNum, const char* args, uint64_t len, bool isLocalTimeZone);
+    }  // namespace detail
+
+    // NanoLog风格的二进制日志，调用线程只往自己的LogRing里记下调用点的地址和参数的原始字节，不做格式化
+    // k_Binary模式由后台线程写成紧凑的二进制文件(.klog)，用BinaryLogFile::Decode或者kurisu_logdecode转成文本
+    // k_Text模式由后台线程格式化成和Logger一样的文本行，写入SyncLogFile
+    // 格式字符串是fmt的语法，参数只能是bool、char、整数、浮点数和字符串
+    class BinaryLogFile : detail::uncopyable {
+    public:
+        enum Mode {
+            k_Binary,
+            k_Text,
+        };
+
+        BinaryLogFile(const std::string& basename, int64_t rollSize, Mode mode = k_Binary, bool isLocalTimeZone = false, int flushInterval = 3, uint64_t ringSize = AsyncLogFile::k_DefaultRingSize,
+                      const LogOverflowPolicy& policy = LogOverflowPolicy());
+        ~BinaryLogFile();
+
+        template <typename... Args>
+        void Log(detail::LogSite* site, const Args&... args);
+        void Stop();
+        LogRingStats Stats() const { return m_rings.Stats(); }
+
+        // LOG_*_B写入的BinaryLogFile，为nullptr时LOG_*_B什么都不做
+        static void SetDefault(BinaryLogFile* log) { s_default.store(log, std::memory_order_release); }
+        static BinaryLogFile* Default() { return s_default.load(std::memory_order_acquire); }
+        // 把k_Binary模式写的文件转成文本写到out，文件格式不对时返回false
+        static bool Decode(const std::string& filename, FILE* out, bool isLocalTimeZone = false);
+
+    private:
+        // m_thrd在此函数内循环
+        void Handle();
+        // 处理LogRing中的一条记录
+        void Write(const detail::LogRing::Header* header);
+        // k_Binary模式下打开新文件，写文件头
+        void RollBinary();
+
+        static const uint64_t k_RecordPrefix = sizeof(detail::LogSite*) + sizeof(int32_t);  // 调用点的地址和tid
+
+        const int k_flushInterval;
+        const Mode m_mode;
+        bool m_isLocalTimeZone;
+        std::atomic_bool m_isRunning = false;
+        const std::string m_fileName;
+        const int64_t m_rollSize;
+        detail::LogRingSet m_rings;
+        std::unique_ptr<SyncLogFile> m_textFile;                      // k_Text模式
+        std::unique_ptr<detail::LogFileAppender> m_binaryFile;        // k_Binary模式
+        std::map<const detail::LogSite*, uint32_t> m_siteIDs;         // 当前的二进制文件中已经写过描述的调用点
+        std::string m_line;                                           // 格式化用的缓冲
+        detail::Thread m_thrd;
+        detail::CountDownLatch m_latch = detail::CountDownLatch(1);
+        static std::atomic<BinaryLogFile*> s_default;
+    };
+
+    template <typename... Args>
+    void BinaryLogFile::Log(detail::LogSite* site, const Args&... args)
+    {
+        if (site->argTypes.load(std::memory_order_relaxed) == nullptr)
+        {
+            site->argNum.store(sizeof...(Args), std::memory_order_relaxed);
+            site->argTypes.store(detail::BinaryArgTypes<Args...>::k_Types, std::memory_order_release);
+        }
+
+        // 调用点的地址、tid、参数，字符串太长时截断，给后面的定长参数留出位置
+        char buf[detail::k_SmallBuf];
+        char* p = buf;
+        memcpy(p, &site, sizeof(site));
+        p += sizeof(site);
+        int32_t tid = this_thrd::Tid();
+        memcpy(p, &tid, sizeof(tid));
+        p += sizeof(tid);
+        [[maybe_unused]] char* end = buf + sizeof(buf) - 12 * sizeof...(Args);
+        ((p = detail::EncodeBinaryArg(p, end, args)), ...);
+        m_rings.Push(buf, p - buf, site->level);
+    }
+
+
+
+// 编译期算出的__FILE__的文件名部分
+#define KURISU_FILE_BASENAME \
+    std::string_view(__FILE__).substr(std::integral_constant<uint64_t, kurisu::detail::BasenameOffset(__FILE__)>::value)
+
+// 低于这个等级的日志在编译期就被去掉，0~5对应TRACE~FATAL，FATAL不会被去掉
+#ifndef KURISU_LOG_MIN_LEVEL
+#define KURISU_LOG_MIN_LEVEL 0
+#endif
+// 被去掉的日志，while (false)里的代码不会生成，也不会吃掉外面的else
+#define KURISU_LOG_STRIPPED while (false)
+
+#if KURISU_LOG_MIN_LEVEL <= 0
 #define LOG_TRACE \
     if (kurisu::Logger::Level() <= kurisu::Logger::LogLevel::TRACE) \
-    kurisu::Logger(__FILE__, __LINE__, kurisu::Logger::LogLevel::TRACE, __func__).Stream()
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::TRACE, __func__).Stream()
+#else
+#define LOG_TRACE KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::TRACE, __func__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 1
 #define LOG_DEBUG \
     if (kurisu::Logger::Level() <= kurisu::Logger::LogLevel::DEBUG) \
-    kurisu::Logger(__FILE__, __LINE__, kurisu::Logger::LogLevel::DEBUG, __func__).Stream()
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::DEBUG, __func__).Stream()
+#else
+#define LOG_DEBUG KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::DEBUG, __func__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 2
 #define LOG_INFO \
     if (kurisu::Logger::Level() <= kurisu::Logger::LogLevel::INFO) \
-    kurisu::Logger(__FILE__, __LINE__).Stream()
-#define LOG_WARN kurisu::Logger(__FILE__, __LINE__, kurisu::Logger::LogLevel::WARN).Stream()
-#define LOG_ERROR kurisu::Logger(__FILE__, __LINE__, kurisu::Logger::LogLevel::ERROR).Stream()
-#define LOG_FATAL kurisu::Logger(__FILE__, __LINE__, kurisu::Logger::LogLevel::FATAL).Stream()
-#define LOG_SYSERR kurisu::Logger(__FILE__, __LINE__, false).Stream()
-#define LOG_SYSFATAL kurisu::Logger(__FILE__, __LINE__, true).Stream()
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__).Stream()
+#else
+#define LOG_INFO KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 3
+#define LOG_WARN kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::WARN).Stream()
+#else
+#define LOG_WARN KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::WARN).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 4
+#define LOG_ERROR kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::ERROR).Stream()
+#define LOG_SYSERR kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, false).Stream()
+#else
+#define LOG_ERROR KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::ERROR).Stream()
+#define LOG_SYSERR KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, false).Stream()
+#endif
+#define LOG_FATAL kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::FATAL).Stream()
+
+// 限流的日志，每个调用点有自己的无锁状态，被丢掉的条数写在下一条的开头，例如
+// LOG_EVERY_N(INFO, 100) << ...           每100条写一条
+// LOG_FIRST_N(WARN, 10) << ...            只写前10条
+// LOG_EVERY_SECONDS(ERROR, 1) << ...      每秒最多一条
+// LOG_RATE_LIMITED(ERROR, 10, 50) << ...  平均每秒10条，最多连续50条
+#define KURISU_LOG_LIMITED(level, limiter, args, logger) \
+    if ((int)kurisu::Logger::LogLevel::level >= KURISU_LOG_MIN_LEVEL && kurisu::Logger::Level() <= kurisu::Logger::LogLevel::level) \
+        if (static kurisu::detail::limiter kurisu_logLimiter args; true) \
+            if (uint64_t kurisu_suppressed = kurisu_logLimiter.Check(); kurisu_suppressed != kurisu::detail::k_LogDenied) \
+    logger << kurisu::detail::LogSuppressed{kurisu_suppressed}
+#define KURISU_LOG_LEVEL_LOGGER(level) kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::level).Stream()
+#define KURISU_LOG_SYSERR_LOGGER kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, false).Stream()
+
+#define LOG_EVERY_N(level, n) KURISU_LOG_LIMITED(level, LogEveryN, (n), KURISU_LOG_LEVEL_LOGGER(level))
+#define LOG_FIRST_N(level, n) KURISU_LOG_LIMITED(level, LogFirstN, (n), KURISU_LOG_LEVEL_LOGGER(level))
+#define LOG_EVERY_SECONDS(level, seconds) KURISU_LOG_LIMITED(level, LogEverySeconds, (seconds), KURISU_LOG_LEVEL_LOGGER(level))
+#define LOG_RATE_LIMITED(level, perSecond, burst) KURISU_LOG_LIMITED(level, LogRateLimit, (perSecond, burst), KURISU_LOG_LEVEL_LOGGER(level))
+#define LOG_SYSERR_EVERY_SECONDS(seconds) KURISU_LOG_LIMITED(ERROR, LogEverySeconds, (seconds), KURISU_LOG_SYSERR_LOGGER)
+#define LOG_SYSERR_RATE_LIMITED(perSecond, burst) KURISU_LOG_LIMITED(ERROR, LogRateLimit, (perSecond, burst), KURISU_LOG_SYSERR_LOGGER)
+
+// 按分类写日志，例如 LOG_DEBUG_C(connLog) << ...，分类关闭时只有一次relaxed load
+#if KURISU_LOG_MIN_LEVEL <= 0
+#define LOG_TRACE_C(category) \
+    if ((category).Level() <= kurisu::Logger::LogLevel::TRACE) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::TRACE, __func__).Stream()
+#else
+#define LOG_TRACE_C(category) KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::TRACE, __func__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 1
+#define LOG_DEBUG_C(category) \
+    if ((category).Level() <= kurisu::Logger::LogLevel::DEBUG) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::DEBUG, __func__).Stream()
+#else
+#define LOG_DEBUG_C(category) KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::DEBUG, __func__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 2
+#define LOG_INFO_C(category) \
+    if ((category).Level() <= kurisu::Logger::LogLevel::INFO) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__).Stream()
+#else
+#define LOG_INFO_C(category) KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 3
+#define LOG_WARN_C(category) \
+    if ((category).Level() <= kurisu::Logger::LogLevel::WARN) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::WARN).Stream()
+#else
+#define LOG_WARN_C(category) KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::WARN).Stream()
+#endif
+#if KURISU_LOG_MIN_LEVEL <= 4
+#define LOG_ERROR_C(category) \
+    if ((category).Level() <= kurisu::Logger::LogLevel::ERROR) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::ERROR).Stream()
+#else
+#define LOG_ERROR_C(category) KURISU_LOG_STRIPPED kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::ERROR).Stream()
+#endif
+#define LOG_SYSFATAL kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, true).Stream()
+
+// fmt风格的日志，例如 LOG_INFO_F("{} took {}us", name, us)，格式字符串在编译期检查，format必须是字符串字面量
+#define LOG_TRACE_F(format, ...) LOG_TRACE.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_DEBUG_F(format, ...) LOG_DEBUG.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_INFO_F(format, ...) LOG_INFO.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_WARN_F(format, ...) LOG_WARN.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_ERROR_F(format, ...) LOG_ERROR.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_FATAL_F(format, ...) LOG_FATAL.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_SYSERR_F(format, ...) LOG_SYSERR.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+#define LOG_SYSFATAL_F(format, ...) LOG_SYSFATAL.Format(FMT_COMPILE(format), ##__VA_ARGS__)
+
+// 结构化日志，例如 LOG_INFO_KV("request done", "path", path, "status", 200, "ms", 1.5)
+// 整行按Logger::SetKvFormat写成JSON或者logfmt
+#define KURISU_LOG_KV(level, msg, ...) \
+    if ((int)kurisu::Logger::LogLevel::level >= KURISU_LOG_MIN_LEVEL && kurisu::Logger::Level() <= kurisu::Logger::LogLevel::level) \
+    kurisu::Logger(KURISU_FILE_BASENAME, __LINE__, kurisu::Logger::LogLevel::level, kurisu::Logger::KvTag()).Kv(msg, ##__VA_ARGS__)
+#define LOG_TRACE_KV(msg, ...) KURISU_LOG_KV(TRACE, msg, ##__VA_ARGS__)
+#define LOG_DEBUG_KV(msg, ...) KURISU_LOG_KV(DEBUG, msg, ##__VA_ARGS__)
+#define LOG_INFO_KV(msg, ...) KURISU_LOG_KV(INFO, msg, ##__VA_ARGS__)
+#define LOG_WARN_KV(msg, ...) KURISU_LOG_KV(WARN, msg, ##__VA_ARGS__)
+#define LOG_ERROR_KV(msg, ...) KURISU_LOG_KV(ERROR, msg, ##__VA_ARGS__)
+#define LOG_FATAL_KV(msg, ...) KURISU_LOG_KV(FATAL, msg, ##__VA_ARGS__)
+
+// 二进制日志，例如 LOG_INFO_B("{} took {}us", name, us)，需要先BinaryLogFile::SetDefault
+#define KURISU_LOG_BINARY(level, format, ...) \
+    do \
+    { \
+        if ((int)(level) >= KURISU_LOG_MIN_LEVEL && kurisu::Logger::Level() <= level) \
+            if (kurisu::BinaryLogFile* kurisu_binaryLog = kurisu::BinaryLogFile::Default(); kurisu_binaryLog) \
+            { \
+                static kurisu::detail::LogSite kurisu_logSite{__FILE__, __LINE__, level, format}; \
+                kurisu_binaryLog->Log(&kurisu_logSite, ##__VA_ARGS__); \
+            } \
+    } while (0)
+#define LOG_TRACE_B(format, ...) KURISU_LOG_BINARY(kurisu::Logger::LogLevel::TRACE, format, ##__VA_ARGS__)
+#define LOG_DEBUG_B(format, ...) KURISU_LOG_BINARY(kurisu::Logger::LogLevel::DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO_B(format, ...) KURISU_LOG_BINARY(kurisu::Logger::LogLevel::INFO, format, ##__VA_ARGS__)
+#define LOG_WARN_B(format, ...) KURISU_LOG_BINARY(kurisu::Logger::LogLevel::WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR_B(format, ...) KURISU_LOG_BINARY(kurisu::Logger::LogLevel::ERROR, format, ##__VA_ARGS__)
 
 
 
@@ -589,12 +1861,21 @@ namespace kurisu {
         explicit SockAddr(const sockaddr& addr) : sa(addr) {}
         explicit SockAddr(const sockaddr_in& addr) : sin(addr) {}
         explicit SockAddr(const sockaddr_in6& addr) : sin6(addr) {}
+        explicit SockAddr(const sockaddr_un& addr) : sun(addr) {}
+
+        // AF_UNIX，文件系统中的路径
+        static SockAddr Unix(const std::string_view& path);
+        // AF_UNIX，抽象命名空间(不会在文件系统中创建文件)，ipString()显示为"@name"
+        static SockAddr AbstractUnix(const std::string_view& name);
 
         sockaddr& As_sockaddr() { return sa; }
         sockaddr_in& As_sockaddr_in() { return sin; }
         sockaddr_in6& As_sockaddr_in6() { return sin6; }
+        sockaddr_un& As_sockaddr_un() { return sun; }
 
         sa_family_t Famliy() const { return sa.sa_family; }
+        bool IsUnix() const { return sa.sa_family == AF_UNIX; }
+        bool IsAbstractUnix() const { return IsUnix() && sun.sun_path[0] == '\0' && sun.sun_path[1] != '\0'; }
         std::string ipString() const;
         std::string ipPortString() const;
         uint16_t HostPort() const;
@@ -607,12 +1888,14 @@ namespace kurisu {
             sockaddr sa;
             sockaddr_in sin;
             sockaddr_in6 sin6;
+            sockaddr_un sun;
         };
     };
 
     namespace detail {
         socklen_t SizeofSockAddr(SockAddr* addr);
         int MakeNonblockingSocket(sa_family_t family);
+        int MakeNonblockingUdpSocket(sa_family_t family);
         int Connect(int sockfd, SockAddr* addr);
         void Bind(int sockfd, SockAddr* addr);
         void Listen(int sockfd);
@@ -626,6 +1909,8 @@ namespace kurisu {
         int GetSocketError(int sockfd);
         SockAddr GetLocalAddr(int sockfd);
         SockAddr GetPeerAddr(int sockfd);
+        // 是否自连接(客户端的本地地址与对端地址相同)
+        bool IsSelfConnect(int sockfd);
         int MakeNonblockingTimerfd();
         timespec HowMuchTimeFromNow(Timestamp when);
         void ResetTimerfd(int timerfd, Timestamp runtime);
@@ -658,6 +1943,9 @@ namespace kurisu {
             /// Enable/disable TCP_NODELAY (disable/enable Nagle's algorithm).
             void SetTcpNoDelay(bool on);
 
+            /// SO_PEERCRED, only for AF_UNIX. return true if success.
+            bool GetPeerCred(ucred* cred) const;
+
             /// Enable/disable SO_REUSEADDR
             void SetReuseAddr(bool on);
 
@@ -761,9 +2049,15 @@ namespace kurisu {
         // 获取此线程的EventLoop
         static EventLoop* GetLoopOfThisThread();
 
+        // 可以跨线程调用，把线程池的完成回调交给loop执行，会接管completion
+        // 无锁入栈，只有栈从空变成非空时才AddTask，同一批完成回调只唤醒一次
+        void AddCompletion(detail::Completion* completion);
+
     private:
         void WakeUpRead();
         void RunTasks();
+        // 按完成的顺序执行攒下的完成回调
+        void RunCompletions();
 
         // DEBUG用的,打印每个事件
         void PrintActiveChannels() const;
@@ -787,6 +2081,7 @@ namespace kurisu {
         std::vector<std::function<void()>> m_waitingTasks;
         std::vector<std::function<void()>> m_runningTasks;
         mutable std::mutex m_mu;  // 保护Tasks
+        std::atomic<detail::Completion*> m_completions = nullptr;  // 完成回调的栈顶
     };
 
     namespace detail {
@@ -839,6 +2134,47 @@ namespace kurisu {
             std::vector<EventLoop*> m_loops;
         };
 
+
+        template <typename T>
+        void TaskHandle<T>::Then(Callback callback)
+        {
+            m_state->callback = std::move(callback);
+            Complete(m_state, k_CallbackReady);
+        }
+        template <typename T>
+        void TaskHandle<T>::Complete(const std::shared_ptr<State>& state, int flag)
+        {
+            int prev = state->flags.fetch_or(flag, std::memory_order_acq_rel);
+            if ((prev | flag) != (k_ResultReady | k_CallbackReady))
+                return;
+
+            auto fire = [state] {
+                if constexpr (std::is_void_v<T>)
+                    state->callback();
+                else
+                    state->callback(std::move(*state->result));
+            };
+            if (state->loop)
+                state->loop->AddCompletion(new Completion{std::move(fire)});
+            else
+                fire();
+        }
+        template <typename Func>
+        TaskHandle<std::invoke_result_t<std::decay_t<Func>&>> ThreadPool::Submit(Func&& func)
+        {
+            using T = std::invoke_result_t<std::decay_t<Func>&>;
+            auto state = std::make_shared<typename TaskHandle<T>::State>();
+            state->loop = EventLoop::GetLoopOfThisThread();
+            Run([state, func = std::forward<Func>(func)]() mutable {
+                if constexpr (std::is_void_v<T>)
+                    func();
+                else
+                    state->result.emplace(func());
+                TaskHandle<T>::Complete(state, TaskHandle<T>::k_ResultReady);
+            });
+            return TaskHandle<T>(std::move(state));
+        }
+
         class Channel : uncopyable {
         public:
             Channel(EventLoop* loop, int fd) : m_fd(fd), m_loop(loop) {}
@@ -1016,7 +2352,52 @@ namespace kurisu {
             Channel m_channel;
             std::function<void(int sockfd, const SockAddr&)> m_connectionCallback;
             bool m_isListening;
-            int m_voidfd;  // 空闲的fd,用于处理fd过多的情况
+            int m_voidfd;            // 空闲的fd,用于处理fd过多的情况
+            std::string m_unixPath;  // 监听文件系统中的AF_UNIX地址时，析构时删除这个socket文件
+        };
+
+        // 主动发起连接，连接失败会按指数退避重试
+        class Connector : uncopyable, public std::enable_shared_from_this<Connector> {
+        public:
+            Connector(EventLoop* loop, const SockAddr& serverAddr) : m_loop(loop), m_serverAddr(serverAddr) {}
+            ~Connector();
+            // 连接成功时会调用这个回调函数，参数为已连接的sockfd
+            void SetNewConnectionCallback(const std::function<void(int sockfd)>& callback) { m_newConnCallback = callback; }
+            const SockAddr& ServerAddr() const { return m_serverAddr; }
+
+            // 可以跨线程调用
+            void Start();
+            // 只能在loop线程调用，重置重试间隔并重新连接
+            void Restart();
+            // 可以跨线程调用
+            void Stop();
+
+        private:
+            static const int k_Disconnected = 0;
+            static const int k_Connecting = 1;
+            static const int k_Connected = 2;
+            static const int k_MaxRetryDelayMs = 30 * 1000;  // 最大重试间隔
+            static const int k_InitRetryDelayMs = 500;       // 初始重试间隔
+
+            void StartInLoop();
+            void StopInLoop();
+            void Connect();
+            // 连接正在进行中，等待可写事件
+            void Connecting(int sockfd);
+            void HandleWrite();
+            void HandleError();
+            void Retry(int sockfd);
+            // 注销并移除channel，返回它管理的sockfd
+            int RemoveAndResetChannel();
+            void ResetChannel() { m_channel.reset(); }
+
+            EventLoop* m_loop;
+            SockAddr m_serverAddr;
+            std::atomic_bool m_isConnect = false;  // 是否需要连接
+            int m_status = k_Disconnected;
+            int m_retryDelayMs = k_InitRetryDelayMs;
+            std::unique_ptr<Channel> m_channel;
+            std::function<void(int sockfd)> m_newConnCallback;
         };
 
 
@@ -1059,7 +2440,7 @@ namespace kurisu {
             Buf(uint64_t len) : ptr((char*)malloc(len)) {}
             // 尝试扩大原来的内存，不行就开辟一片新的内存，并且把原来的数据拷贝过去
             void Resize(uint64_t newSize) { ptr = (char*)realloc(ptr, newSize); }
-            ~Buf() { delete[] ptr; }
+            ~Buf() { free(ptr); }
         };
 
     public:
@@ -1191,6 +2572,8 @@ namespace kurisu {
         // return true if success.
         bool GetTcpInfo(struct tcp_info* tcpi) const;
         std::string GetTcpInfoString() const;
+        // 对端进程的pid/uid/gid，只对AF_UNIX有效
+        bool GetPeerCred(ucred* cred) const { return m_socket->GetPeerCred(cred); }
 
         void Send(std::string&& msg);  // C++11
         void Send(const void* data, int len) { Send(std::string_view((const char*)data, len)); }
@@ -1239,6 +2622,17 @@ namespace kurisu {
         const std::any& GetContext() const { return m_context; }
         std::any& GetContext() { return m_context; }
 
+        // 下面这些供TcpRelay这类直接读写fd的组件使用，必须在loop线程中调用
+        int fd() const { return m_channel->fd(); }
+        // 接管可读事件，设置后数据不再读入inputBuf，传入nullptr恢复
+        void SetReadHook(const std::function<void(Timestamp)>& hook) { m_readHook = hook; }
+        // outputBuf写完后(或者为空时可写)调用，返回true表示还要继续监听可写事件，传入nullptr恢复
+        void SetWriteHook(const std::function<bool()>& hook) { m_writeHook = hook; }
+        // 连接关闭时在connectionCallback之前调用
+        void SetCloseHook(const std::function<void()>& hook) { m_closeHook = hook; }
+        // 开始监听可写事件
+        void EnableWriting();
+
 
 
 
@@ -1276,6 +2670,9 @@ namespace kurisu {
         std::function<void(const std::shared_ptr<TcpConnection>&, Buffer*, Timestamp)> m_msgCallback;
         std::function<void(const std::shared_ptr<TcpConnection>&)> m_writeCompleteCallback;
         std::function<void(const std::shared_ptr<TcpConnection>&)> m_closeCallback;
+        std::function<void(Timestamp)> m_readHook;
+        std::function<bool()> m_writeHook;
+        std::function<void()> m_closeHook;
     };
 
     class TcpServer : detail::uncopyable {
@@ -1352,6 +2749,333 @@ namespace kurisu {
         ConnectionMap m_connections;
     };
 
+    class TcpClient : detail::uncopyable {
+    public:
+        TcpClient(EventLoop* loop, const SockAddr& serverAddr, const std::string& name);
+        ~TcpClient();
+
+        // 可以跨线程调用
+        void Connect();
+        // 关闭已建立的连接(shutdown)，可以跨线程调用
+        void Disconnect();
+        // 停止连接(对正在进行的connect有效)，可以跨线程调用
+        void Stop();
+
+        std::shared_ptr<TcpConnection> Connection() const
+        {
+            std::lock_guard locker(m_mu);
+            return m_connection;
+        }
+        EventLoop* GetLoop() const { return m_loop; }
+        const std::string& Name() const { return m_name; }
+        bool IsRetry() const { return m_isRetry; }
+        // 连接断开后自动重连
+        void EnableRetry() { m_isRetry = true; }
+        // must be called before Connect
+        void SetTcpNoDelay(bool on) { m_isTcpNoDelay = on; }
+
+        // 连接建立 销毁 产生关闭事件时 都会调用这个回调函数，线程不安全
+        void SetConnectionCallback(const std::function<void(const std::shared_ptr<TcpConnection>&)>& callback) { m_connCallback = callback; }
+        // 接收到数据之后会调用这个回调函数，线程不安全
+        void SetMessageCallback(const std::function<void(const std::shared_ptr<TcpConnection>&, Buffer*, Timestamp)>& callback)
+        {
+            m_msgCallback = callback;
+        }
+        // 写操作完成时会调用这个回调函数，线程不安全
+        void SetWriteCompleteCallback(const std::function<void(const std::shared_ptr<TcpConnection>&)>& callback)
+        {
+            m_writeCompleteCallback = callback;
+        }
+
+    private:
+        // Connector连接成功时会回调的函数
+        void NewConnection(int sockfd);
+        // 连接关闭时会回调的函数，在loop线程执行
+        void RemoveConnection(const std::shared_ptr<TcpConnection>& conn);
+
+    private:
+        bool m_isTcpNoDelay = false;
+        std::atomic_bool m_isRetry = false;
+        std::atomic_bool m_isConnect = true;
+        int m_nextConnID = 1;
+        EventLoop* m_loop;  // 连接所属的EventLoop
+        std::shared_ptr<detail::Connector> m_connector;
+        const std::string m_name;
+        std::function<void(const std::shared_ptr<TcpConnection>&)> m_connCallback;
+        std::function<void(const std::shared_ptr<TcpConnection>&, Buffer*, Timestamp)> m_msgCallback;
+        std::function<void(const std::shared_ptr<TcpConnection>&)> m_writeCompleteCallback;
+        mutable std::mutex m_mu;  // 保护m_connection
+        std::shared_ptr<TcpConnection> m_connection;
+    };
+
+    // 连接同一个后端的客户端连接池
+    // 每个EventLoop各有一个子池，子池只在其所属的线程中被访问，所以Acquire/Release无锁
+    class ConnectionPool : detail::uncopyable {
+    public:
+        ConnectionPool(const SockAddr& backendAddr, const std::string& name);
+        ~ConnectionPool();
+
+        // must be called before Start
+        // 每个子池的最小连接数(预热时建立)与最大连接数
+        void SetConnectionNum(int minNum, int maxNum);
+        // must be called before Start
+        // 所有连接的在途请求数都达到此值时才会新建连接
+        void SetMaxInflightPerConn(int num) { m_maxInflightPerConn = num; }
+        // must be called before Start
+        // 连续失败多少次的连接会被驱逐
+        void SetMaxFailures(int num) { m_maxFailures = num; }
+        // must be called before Start
+        // 超出最小连接数且空闲超过seconds秒的连接会被回收
+        void SetIdleTimeout(double seconds) { m_idleTimeout = seconds; }
+        // must be called before Start
+        void SetTcpNoDelay(bool on) { m_isTcpNoDelay = on; }
+        // must be called before Start
+        // 连接建立 销毁时都会调用这个回调函数
+        void SetConnectionCallback(const std::function<void(const std::shared_ptr<TcpConnection>&)>& callback) { m_connCallback = callback; }
+        // must be called before Start
+        // 接收到后端的数据之后会调用这个回调函数
+        void SetMessageCallback(const std::function<void(const std::shared_ptr<TcpConnection>&, Buffer*, Timestamp)>& callback)
+        {
+            m_msgCallback = callback;
+        }
+
+        // 在每个loop上各建立一个子池并开始预热，一般传入TcpServer::GetThreadPool()->GetAllLoops()
+        void Start(const std::vector<EventLoop*>& loops);
+        // 必须在子池所属的loop线程中调用
+        // 返回在途请求数最少的连接，并使其在途请求数+1，没有可用的连接时返回nullptr
+        std::shared_ptr<TcpConnection> Acquire();
+        // 必须在子池所属的loop线程中调用，与Acquire配对
+        // ok == false 表示这次请求失败，连续失败过多的连接会被驱逐
+        void Release(const std::shared_ptr<TcpConnection>& conn, bool ok = true);
+
+        // 所有子池是否都已建立了最小连接数
+        bool WarmedUp() const { return m_connectedNum >= m_minNum * (int)m_subPools.size(); }
+        // 等待预热完成，超时返回false
+        // 不能在某个子池所属的loop线程中调用，否则会一直等到超时
+        bool WaitForWarmup(double seconds);
+        const std::string& Name() const { return m_name; }
+
+    private:
+        class SubPool;
+
+        // 返回当前线程的子池，没有则返回nullptr
+        SubPool* GetSubPool();
+
+    private:
+        bool m_isTcpNoDelay = false;
+        int m_minNum = 1;
+        int m_maxNum = 8;
+        int m_maxInflightPerConn = 1;
+        int m_maxFailures = 3;
+        double m_idleTimeout = 60.0;
+        std::atomic_int m_connectedNum = 0;  // 所有子池中已连接的连接数
+        const SockAddr m_backendAddr;
+        const std::string m_name;
+        std::function<void(const std::shared_ptr<TcpConnection>&)> m_connCallback;
+        std::function<void(const std::shared_ptr<TcpConnection>&, Buffer*, Timestamp)> m_msgCallback;
+        std::vector<std::unique_ptr<SubPool>> m_subPools;  // Start后不再改变，所以可以无锁读
+    };
+
+    // 一个UDP数据报，接收时data指向UdpSocket内部的缓冲区，只在回调期间有效
+    struct Datagram {
+        char* data = nullptr;
+        uint64_t len = 0;
+        SockAddr peer;
+    };
+
+    // 非阻塞的UDP socket，用recvmmsg批量接收到预先分配好的缓冲区中，用sendmmsg批量发送
+    // 支持UDP_GRO(接收时内核合并同一个流的数据报)和UDP_SEGMENT(发送时由内核/网卡分段)
+    class UdpSocket : detail::uncopyable {
+    public:
+        // reuseport为true时多个UdpSocket可以绑定同一个地址，由内核按四元组把数据报分给不同的socket
+        UdpSocket(EventLoop* loop, const SockAddr& localAddr, bool reuseport = false);
+        ~UdpSocket();
+
+        // must be called before Start
+        // recvmmsg一次最多接收的数据报个数
+        void SetBatchSize(int num) { m_batchSize = std::max(num, 1); }
+        // must be called before Start
+        // 超过这个长度的数据报会被截断，开启GRO时每个缓冲区固定为64KB
+        void SetMaxDatagramSize(int size) { m_maxDatagramSize = std::max(size, 1); }
+        // must be called before Start
+        // 内核不支持时返回false
+        bool EnableGro(bool on);
+        // 发送时是否使用UDP_SEGMENT，内核不支持时返回false
+        bool EnableGso(bool on);
+        // must be called before Start
+        // 一批数据报到来时调用，可以在回调中用这个UdpSocket回复
+        void SetMessageCallback(const std::function<void(UdpSocket*, Datagram*, int, Timestamp)>& callback) { m_msgCallback = callback; }
+
+        // 开始接收，thread safe
+        void Start();
+        // 停止接收，thread safe
+        void Stop();
+
+        // 下面的Send都是thread safe的，UDP没有发送缓冲区，发不出去的数据报直接丢弃
+        // 发送成功返回true
+        bool SendTo(const SockAddr& peer, const void* data, uint64_t len);
+        // 批量发送，返回成功发出的数据报个数
+        // 开启GSO时，连续的发往同一个peer且长度相同的数据报(最后一个可以更短)会合并成一个消息交给内核分段
+        int SendBatch(const Datagram* datagrams, int count);
+
+        EventLoop* GetLoop() const { return m_loop; }
+        const SockAddr& LocalAddr() const { return m_localAddr; }
+        int fd() const { return m_sock.fd(); }
+        uint64_t ReceivedNum() const { return m_receivedNum; }
+        uint64_t DroppedNum() const { return m_droppedNum; }  // 发送时被丢弃的数据报个数
+
+    private:
+        void StartInLoop();
+        void StopInLoop();
+        // 分配接收用的缓冲区
+        void InitBuffers();
+        void HandleRead(Timestamp timestamp);
+        // 发送一批(不超过k_MaxSendBatch个)
+        int SendChunk(const Datagram* datagrams, int count);
+
+    private:
+        static const int k_MaxSendBatch = 64;  // 与内核的UDP_MAX_SEGMENTS相同
+        static const int k_GroBufferSize = 65536;
+
+        EventLoop* m_loop;
+        detail::Socket m_sock;
+        SockAddr m_localAddr;
+        std::unique_ptr<detail::Channel> m_channel;
+        bool m_isStarted = false;
+        bool m_isGro = false;
+        std::atomic_bool m_isGso = false;
+        int m_batchSize = 32;
+        int m_maxDatagramSize = 2048;
+        int m_bufferSize = 0;  // 每个数据报缓冲区的大小
+        std::atomic_uint64_t m_receivedNum = 0;
+        std::atomic_uint64_t m_droppedNum = 0;
+        std::vector<char> m_slab;  // m_batchSize个大小为m_bufferSize的缓冲区，只分配一次，反复使用
+        std::vector<mmsghdr> m_msgs;
+        std::vector<iovec> m_iovs;
+        std::vector<SockAddr> m_peers;
+        std::vector<char> m_controls;
+        std::vector<Datagram> m_datagrams;  // 交给回调的数据报，GRO合并的会被拆开
+        std::function<void(UdpSocket*, Datagram*, int, Timestamp)> m_msgCallback;
+    };
+
+    // 每个IO线程各有一个绑定同一地址的UdpSocket(SO_REUSEPORT)，由内核按四元组分流
+    class UdpServer : detail::uncopyable {
+    public:
+        enum Option {
+            k_NoReusePort,
+            k_ReusePort,
+        };
+
+        // 多于一个IO线程时总是会开启SO_REUSEPORT，k_ReusePort用于多个进程绑定同一地址
+        UdpServer(EventLoop* loop, const SockAddr& listenAddr, const std::string& name, Option option = k_NoReusePort);
+        ~UdpServer();
+
+        const std::string& ipPort() const { return m_ipPort; }
+        const std::string& Name() const { return m_name; }
+        EventLoop* GetLoop() const { return m_loop; }
+        // must be called before Start
+        void SetThreadNum(int num) { m_threadPool->SetThreadNum(num); }
+        // must be called before Start
+        void SetThreadInitCallback(const std::function<void(EventLoop*)>& callback) { m_threadInitCallback = callback; }
+        // must be called before Start
+        void SetBatchSize(int num) { m_batchSize = num; }
+        // must be called before Start
+        void SetMaxDatagramSize(int size) { m_maxDatagramSize = size; }
+        // must be called before Start
+        void SetGro(bool on) { m_isGro = on; }
+        // must be called before Start
+        void SetGso(bool on) { m_isGso = on; }
+        // must be called before Start
+        // 回调在收到数据报的UdpSocket所属的IO线程中执行
+        void SetMessageCallback(const std::function<void(UdpSocket*, Datagram*, int, Timestamp)>& callback) { m_msgCallback = callback; }
+
+        // must be called after Start
+        std::shared_ptr<detail::EventLoopThreadPool> GetThreadPool() { return m_threadPool; }
+        // must be called after Start
+        const std::vector<std::unique_ptr<UdpSocket>>& Sockets() const { return m_sockets; }
+
+        // start,thread safe
+        void Start();
+
+    private:
+        bool m_isReusePort;
+        bool m_isGro = true;
+        bool m_isGso = true;
+        int m_batchSize = 32;
+        int m_maxDatagramSize = 2048;
+        std::atomic_bool m_isStarted = false;
+        EventLoop* m_loop;
+        const SockAddr m_listenAddr;
+        std::shared_ptr<detail::EventLoopThreadPool> m_threadPool;
+        const std::string m_ipPort;
+        const std::string m_name;
+        std::function<void(UdpSocket*, Datagram*, int, Timestamp)> m_msgCallback;
+        std::function<void(EventLoop*)> m_threadInitCallback;
+        std::vector<std::unique_ptr<UdpSocket>> m_sockets;
+    };
+
+    // 在两个TcpConnection之间双向转发数据
+    // 用splice经过管道在内核中搬运，不经过用户空间的Buffer，管道取自当前线程的管道池
+    // 目的端写不进时停止读源端，可写后再恢复；splice不支持时退回到读到inputBuf再Send的拷贝方式
+    // 一端读到EOF后，数据发完就shutdown另一端的写，两个方向都结束后关闭两个连接
+    class TcpRelay : detail::uncopyable, public std::enable_shared_from_this<TcpRelay> {
+    public:
+        // 两个连接必须属于同一个EventLoop
+        TcpRelay(const std::shared_ptr<TcpConnection>& first, const std::shared_ptr<TcpConnection>& second);
+        ~TcpRelay();
+
+        // 接管两个连接的读写，必须在loop线程中调用
+        // inputBuf中已有的数据会先转发出去，Start后不要再对这两个连接调用Send
+        void Start();
+        // 把读写还给两个连接，不关闭连接，必须在loop线程中调用
+        void Stop();
+
+        EventLoop* GetLoop() const { return m_loop; }
+        uint64_t SplicedBytes() const { return m_splicedBytes; }
+        uint64_t CopiedBytes() const { return m_copiedBytes; }
+
+    private:
+        // 一个方向的转发
+        struct Direction {
+            TcpConnection* from = nullptr;
+            TcpConnection* to = nullptr;
+            int pipefd[2] = {-1, -1};
+            uint64_t pipeBytes = 0;  // 在管道中还没写到目的端的字节数
+            bool isCopy = false;     // splice不可用，走拷贝
+            bool isBlocked = false;  // 目的端写不进，已停止读源端
+            bool isEof = false;      // 源端读到EOF
+            bool isDone = false;     // EOF之前的数据都已发出，并已shutdown目的端
+        };
+
+        void HandleRead(Direction* dir);
+        void CopyRead(Direction* dir);
+        // 把管道中的数据写到目的端
+        void Flush(Direction* dir);
+        // splice写不了目的端时，把管道中剩下的数据读出来再Send
+        void DrainPipeByCopy(Direction* dir);
+        bool HandleWritable(Direction* dir);
+        void Block(Direction* dir);
+        void Finish(Direction* dir);
+        void HandleClose();
+        // 出错或结束时关闭两个连接
+        void CloseAll();
+        // Stop之后把读写还给两个连接
+        void ResetHooks();
+
+    private:
+        static const uint64_t k_SpliceSize = 64 * 1024;  // 管道的默认容量
+
+        EventLoop* m_loop;
+        bool m_isStarted = false;
+        bool m_isStopped = false;
+        uint64_t m_splicedBytes = 0;
+        uint64_t m_copiedBytes = 0;
+        std::shared_ptr<TcpConnection> m_first;
+        std::shared_ptr<TcpConnection> m_second;
+        Direction m_dirs[2];                // 0: first -> second   1: second -> first
+        std::shared_ptr<TcpRelay> m_self;  // Start到Stop之间保证自己活着
+    };
+
     class LengthFieldCodec : detail::copyable {
     public:
         LengthFieldCodec() = delete;
@@ -1381,6 +3105,99 @@ namespace kurisu {
         friend TcpServer;
     };
 
+    // RemoteLogSink怎么攒批、限内存、落盘
+    struct RemoteLogSinkOptions {
+        uint64_t batchBytes = 64 * 1024;              // 攒够多少字节发一帧，一行比它长时单独成一帧
+        double batchSeconds = 0.2;                    // 最多攒多久
+        uint64_t maxBufferBytes = 8 * 1024 * 1024;    // 还没发的和连接输出缓冲区中的日志各自最多占多少，超出的写spool或者丢掉
+        bool isCompress = false;                      // 帧用zlib压缩，编译时要打开KURISU_WITH_ZLIB
+        std::string spoolFile;                        // 连不上或者发不动时追加到这个文件，连上后先补发，空表示直接丢掉
+        uint64_t maxSpoolBytes = 256 * 1024 * 1024;  // spool文件最大多少字节
+        double closeSeconds = 3;                      // 析构时最多等多久把剩下的发完
+    };
+    // RemoteLogSink的状态，可以在任意线程读
+    struct RemoteLogSinkStats {
+        uint64_t sentBytes = 0;     // 交给连接的帧的字节数，包括补发的spool
+        uint64_t spooledBytes = 0;  // spool文件中还没补发的字节数
+        uint64_t droppedLines = 0;
+        uint64_t droppedBytes = 0;
+        bool isConnected = false;
+    };
+
+    // 把日志攒成批，通过自己的EventLoop线程上的TcpClient发给收集端，TCP和AF_UNIX都可以
+    // Append只把日志复制进内存，压缩、发送、读写spool文件都在EventLoop线程中，写日志的线程不做IO
+    // 每帧是[4字节长度][1字节标志][k_Zlib时4字节原长][日志]，长度和原长是网络字节序
+    // 收集端可以用LengthFieldCodec(maxFrameLength, 0, 4, 0, 4)拆帧，再用DecodeFrame还原
+    // 内存中没发的日志不超过maxBufferBytes，连接断开时已交给连接还没写出去的日志会丢，从spool补发的不会丢但可能重复
+    class RemoteLogSink : detail::uncopyable {
+    public:
+        RemoteLogSink(const SockAddr& collectorAddr, const std::string& name, const RemoteLogSinkOptions& options = RemoteLogSinkOptions());
+        // 没发完的发出去或者写进spool，最多等closeSeconds秒，先从LogSinks中Remove
+        ~RemoteLogSink();
+
+        // 任意线程调用，积压满了就丢掉这一行
+        void Append(const char* logline, uint64_t len);
+        // 把攒着的日志交给连接或者写进spool，不等发送完成
+        void Flush();
+        RemoteLogSinkStats Stats() const;
+
+        // body是去掉长度之后的帧，日志追加到out，帧不对或者不支持压缩时返回false
+        static bool DecodeFrame(const char* body, uint64_t len, std::string* out);
+
+        static const uint8_t k_Raw = 0;
+        static const uint8_t k_Zlib = 1;
+
+    private:
+        // 以下都在m_loop线程中执行
+        void OnConnection(const std::shared_ptr<TcpConnection>& conn);
+        void OnWriteComplete(const std::shared_ptr<TcpConnection>& conn);
+        // 取走攒着的批，编码成帧发出去
+        void SendPending();
+        void SendFrame(const std::string& frame, uint64_t lines);
+        // 追加到spool文件，之后的帧也都走spool，保证顺序
+        void Spool(const std::string& frame, uint64_t lines);
+        // 连接空闲时从spool文件中按整帧读出来补发，补发完清空文件
+        void ReplaySpool();
+        void EncodeFrame(const std::string& batch);
+        void Drop(uint64_t lines, uint64_t bytes);
+        void CheckClosed();
+        // 析构时在loop线程退出后调用，去掉spool中已经补发过的部分
+        void CompactSpool();
+
+    private:
+        const RemoteLogSinkOptions m_options;
+        std::unique_ptr<detail::EventLoopThread> m_loopThread;
+        EventLoop* m_loop;
+        std::unique_ptr<TcpClient> m_client;
+        TimerID m_timer;
+
+        mutable std::mutex m_mu;  // 保护下面几个，Append和m_loop线程共用
+        std::string m_batch;                 // 正在攒的批
+        std::vector<std::string> m_batches;  // 攒满了等m_loop取走的批
+        std::vector<std::string> m_spare;    // 用过的批，留着复用内存
+        uint64_t m_bufferedBytes = 0;        // m_batch和m_batches中的字节数
+        bool m_isClosing = false;
+        bool m_isClosed = false;  // 析构时剩下的都发完了
+        std::condition_variable m_closedCond;
+
+        // 以下只在m_loop线程中访问
+        std::shared_ptr<TcpConnection> m_conn;
+        std::string m_frame;
+        std::string m_zbuf;
+        std::string m_replayBuf;
+        int m_spoolFd = -1;
+        bool m_isSpooling = false;    // spool中有没补发完的，新的帧也要先进spool
+        uint64_t m_spoolSize = 0;     // spool文件的大小
+        uint64_t m_spoolReadPos = 0;  // 补发到哪里了
+        uint64_t m_spoolAckPos = 0;   // 这之前的都已经写进socket，断线后从这里重新补发
+
+        std::atomic_uint64_t m_sentBytes = 0;
+        std::atomic_uint64_t m_spooledBytes = 0;
+        std::atomic_uint64_t m_droppedLines = 0;
+        std::atomic_uint64_t m_droppedBytes = 0;
+        std::atomic_bool m_isConnected = false;
+    };
+
 
     namespace detail {
 
@@ -25,11 +25,14 @@
 #include <sys/uio.h>  // readv
 #include <sys/timerfd.h>
 #include <netinet/tcp.h>  //tcp_info
+#include <netinet/udp.h>  //UDP_SEGMENT UDP_GRO
 #include <unistd.h>
 #include <netdb.h>  //addrinfo
 #include <signal.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <map>
 #include <set>
 #include <any>
@@ -37,6 +40,13 @@
 #include "kurisu.h"
 #include "fmt/chrono.h"
 #include "fmt/compile.h"
+#include "fmt/args.h"
+#ifdef KURISU_WITH_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 uint64_t htonll(uint64_t val) { return htobe64(val); }
 uint64_t ntohll(uint64_t val) { return be64toh(val); }
@@ -331,8 +341,14 @@ namespace kurisu {
         int g_pageSize = (int)sysconf(_SC_PAGE_SIZE);
 
         __thread char t_errnobuf[512];  // 缓存errno的str
-        __thread char t_time[64];       // 缓存时间的str
-        __thread int64_t t_lastSecond;  // 上次缓存t_time的时间
+        // 每个线程缓存的日志前缀"[2021-01-01 00:00:00.000000] [  tid] "，秒、tid、时区变了才重新生成
+        __thread char t_logPrefix[64];
+        __thread int t_logPrefixLen;
+        __thread int64_t t_lastSecond;  // t_logPrefix的秒
+        __thread int t_lastUsec;        // t_logPrefix的微秒
+        __thread int t_prefixTid;       // t_logPrefix的tid
+        __thread bool t_prefixIsLocal;  // t_logPrefix是不是本地时区
+        const int k_UsecOffset = 21;    // 微秒在t_logPrefix中的位置
         // 生成errno的str
         const char* strerror_tl(int savedErrno) { return strerror_r(savedErrno, t_errnobuf, sizeof(t_errnobuf)); }
 
@@ -357,6 +373,151 @@ namespace kurisu {
             m_writtenBytes += written;
         }
 
+        DirectLogFileAppender::DirectLogFileAppender(StringArg filename, uint64_t preallocateSize, uint64_t syncBytes)
+            : m_fd(open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)), m_syncBytes(syncBytes), m_buf(new char[k_BufSize])
+        {
+            if (m_fd < 0)
+            {
+                fprintf(stderr, "DirectLogFileAppender open %s failed %s\n", filename.c_str(), strerror_tl(errno));
+                return;
+            }
+            // 和LogFileAppender一样接着已有的内容写
+            struct stat st;
+            if (fstat(m_fd, &st) == 0)
+                m_fileOffset = m_syncedOffset = (uint64_t)st.st_size;
+            if (preallocateSize > m_fileOffset && fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_fileOffset, preallocateSize - m_fileOffset) < 0 && errno != EOPNOTSUPP)
+                fprintf(stderr, "DirectLogFileAppender fallocate failed %s\n", strerror_tl(errno));
+        }
+        DirectLogFileAppender::~DirectLogFileAppender()
+        {
+            if (m_fd < 0)
+                return;
+            WriteBuf();
+            Sync();
+            // 释放预分配了但没用到的磁盘空间
+            if (ftruncate(m_fd, m_fileOffset) < 0)
+                fprintf(stderr, "DirectLogFileAppender ftruncate failed %s\n", strerror_tl(errno));
+            close(m_fd);
+        }
+        void DirectLogFileAppender::Append(const char* logline, const uint64_t len)
+        {
+            m_writtenBytes += len;
+            for (uint64_t copied = 0; copied != len;)
+            {
+                uint64_t n = std::min(len - copied, k_BufSize - m_bufLen);
+                memcpy(m_buf.get() + m_bufLen, logline + copied, n);
+                m_bufLen += n;
+                copied += n;
+                if (m_bufLen == k_BufSize)
+                    WriteBuf();
+            }
+        }
+        void DirectLogFileAppender::Flush() { WriteBuf(); }
+        void DirectLogFileAppender::WriteBuf()
+        {
+            for (uint64_t written = 0; written != m_bufLen;)
+            {
+                ssize_t n = pwrite(m_fd, m_buf.get() + written, m_bufLen - written, (off_t)m_fileOffset);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    fprintf(stderr, "DirectLogFileAppender pwrite failed %s\n", strerror_tl(errno));
+                    break;
+                }
+                written += n;
+                m_fileOffset += n;
+            }
+            m_bufLen = 0;
+            if (m_syncBytes != 0 && m_fileOffset - m_syncedOffset >= m_syncBytes)
+                Sync();
+        }
+        void DirectLogFileAppender::Sync()
+        {
+            if (m_fileOffset == m_syncedOffset)
+                return;
+            fdatasync(m_fd);
+            // 已经落盘的日志不会再读，不要让它把page cache里别的数据挤出去
+            posix_fadvise(m_fd, (off_t)m_syncedOffset, (off_t)(m_fileOffset - m_syncedOffset), POSIX_FADV_DONTNEED);
+            m_syncedOffset = m_fileOffset;
+        }
+
+
+        void Histogram::Record(uint64_t value)
+        {
+            m_buckets[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+            m_count.fetch_add(1, std::memory_order_relaxed);
+            m_sum.fetch_add(value, std::memory_order_relaxed);
+
+            uint64_t min = m_min.load(std::memory_order_relaxed);
+            while (value < min && !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed))
+                ;
+            uint64_t max = m_max.load(std::memory_order_relaxed);
+            while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+                ;
+        }
+        void Histogram::Merge(const Histogram& other)
+        {
+            for (uint64_t i = 0; i < k_BucketNum; i++)
+                if (uint64_t n = other.m_buckets[i].load(std::memory_order_relaxed); n)
+                    m_buckets[i].fetch_add(n, std::memory_order_relaxed);
+            m_count.fetch_add(other.Count(), std::memory_order_relaxed);
+            m_sum.fetch_add(other.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+            uint64_t value = other.m_min.load(std::memory_order_relaxed);
+            uint64_t min = m_min.load(std::memory_order_relaxed);
+            while (value < min && !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed))
+                ;
+            value = other.Max();
+            uint64_t max = m_max.load(std::memory_order_relaxed);
+            while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+                ;
+        }
+        void Histogram::Reset()
+        {
+            for (auto&& bucket : m_buckets)
+                bucket.store(0, std::memory_order_relaxed);
+            m_count.store(0, std::memory_order_relaxed);
+            m_sum.store(0, std::memory_order_relaxed);
+            m_min.store(UINT64_MAX, std::memory_order_relaxed);
+            m_max.store(0, std::memory_order_relaxed);
+        }
+        uint64_t Histogram::Percentile(double percentile) const
+        {
+            uint64_t count = Count();
+            if (count == 0)
+                return 0;
+            percentile = std::min(std::max(percentile, 0.0), 100.0);
+            uint64_t target = std::max((uint64_t)(percentile / 100.0 * (double)count + 0.5), (uint64_t)1);
+
+            uint64_t sum = 0;
+            for (uint64_t i = 0; i < k_BucketNum; i++)
+            {
+                sum += m_buckets[i].load(std::memory_order_relaxed);
+                if (sum >= target)
+                    return std::min(std::max(HighestOf(i), Min()), Max());  // 桶的上界可能超出实际记录的范围
+            }
+            return Max();
+        }
+        uint64_t Histogram::IndexOf(uint64_t value)
+        {
+            // 小于k_SubBucketNum的值每个值一个桶
+            if (value < k_SubBucketNum)
+                return value;
+            // 其余的值按最高位分组，每组再按最高位之后的k_SubBucketBits位线性细分
+            int shift = 63 - __builtin_clzll(value) - k_SubBucketBits;
+            return (uint64_t)(shift + 1) * k_SubBucketNum + ((value >> shift) & (k_SubBucketNum - 1));
+        }
+        uint64_t Histogram::HighestOf(uint64_t index)
+        {
+            if (index < k_SubBucketNum)
+                return index;
+            int shift = (int)(index / k_SubBucketNum) - 1;
+            uint64_t sub = index % k_SubBucketNum;
+            return ((k_SubBucketNum + sub + 1) << shift) - 1;
+        }
+
+
 
         std::atomic_int32_t Thread::s_createdNum = 0;
 
@@ -384,35 +545,179 @@ namespace kurisu {
 
 
 
+        namespace {
+            // 自旋等待时降低CPU占用
+            inline void CpuRelax()
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#else
+                std::this_thread::yield();
+#endif
+            }
+
+            thread_local ThreadPool* t_threadPool = nullptr;  // 当前线程所属的线程池
+            thread_local int t_workerIndex = 0;               // 当前线程在线程池中的下标
+
+            inline int64_t SteadyNowNs()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+        }  // namespace
+
+        WorkStealingDeque::WorkStealingDeque(int64_t capacity)
+        {
+            int64_t cap = 1;
+            while (cap < capacity)
+                cap <<= 1;  // 容量必须是2的幂
+            m_arrays.emplace_back(std::make_unique<Array>(cap));
+            m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+        }
+        WorkStealingDeque::~WorkStealingDeque()
+        {
+            // 还没执行的任务直接丢弃
+            Array* array = m_array.load(std::memory_order_relaxed);
+            for (int64_t i = m_top.load(std::memory_order_relaxed); i < m_bottom.load(std::memory_order_relaxed); i++)
+                delete array->Get(i);
+        }
+        void WorkStealingDeque::Push(Task* task)
+        {
+            int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+            int64_t top = m_top.load(std::memory_order_acquire);
+            Array* array = m_array.load(std::memory_order_relaxed);
+            if (bottom - top > array->capacity - 1)  // 满了就扩容
+            {
+                auto bigger = std::make_unique<Array>(array->capacity * 2);
+                for (int64_t i = top; i < bottom; i++)
+                    bigger->Put(i, array->Get(i));
+                array = bigger.get();
+                m_arrays.emplace_back(std::move(bigger));
+                m_array.store(array, std::memory_order_release);
+            }
+            array->Put(bottom, task);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        WorkStealingDeque::Task* WorkStealingDeque::Pop()
+        {
+            int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+            Array* array = m_array.load(std::memory_order_relaxed);
+            m_bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = m_top.load(std::memory_order_relaxed);
+
+            if (top > bottom)  // 空的
+            {
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            Task* task = array->Get(bottom);
+            if (top == bottom)  // 只剩最后一个，要和Steal竞争
+            {
+                if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    task = nullptr;
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+        WorkStealingDeque::Task* WorkStealingDeque::Steal()
+        {
+            int64_t top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t bottom = m_bottom.load(std::memory_order_acquire);
+            if (top >= bottom)
+                return nullptr;
+
+            Array* array = m_array.load(std::memory_order_acquire);
+            Task* task = array->Get(top);
+            if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;  // 被别的线程抢先了
+            return task;
+        }
+
+
+
+        ThreadPool::ThreadPool(const std::string& name) : m_name(name) {}
         ThreadPool::~ThreadPool()
         {
             if (m_isRunning)
                 Stop();
         }
+        void ThreadPool::SetElastic(int minThrdNum, int maxThrdNum, double maxQueueWait, double maxIdle)
+        {
+            m_isElastic = true;
+            m_isRecording = true;
+            m_minThrdNum = std::max(minThrdNum, 1);
+            m_maxThrdNum = std::max(maxThrdNum, m_minThrdNum);
+            m_maxQueueWait = (int64_t)(maxQueueWait * 1e9);
+            m_maxIdle = (int64_t)(maxIdle * 1e9);
+        }
         void ThreadPool::SetThrdNum(int thrdNum)
         {
             m_isRunning = 1;
-            m_thrds.reserve(thrdNum);
+            m_injection = std::make_unique<BoundedMpmcQueue<Task*>>(m_maxSize > 0 ? m_maxSize : k_DefaultQueueSize);
+            // 弹性模式下按上限建好所有Worker，窃取时会遍历m_workers，运行中不能再改变它的大小
+            int slotNum = thrdNum;
+            if (m_isElastic)
+            {
+                thrdNum = std::clamp(thrdNum, m_minThrdNum, m_maxThrdNum);
+                slotNum = m_maxThrdNum;
+            }
+            m_workers.reserve(slotNum);
+            for (int i = 0; i < slotNum; i++)
+                m_workers.emplace_back(std::make_unique<Worker>());
+            // 所有Worker都建好后再启动线程
             for (int i = 0; i < thrdNum; i++)
+                StartWorker(i);
+            if (m_isElastic)
             {
-                std::string id = fmt::format("{}", i + 1);
-                auto res = m_name + id;
-                m_thrds.emplace_back(std::make_unique<Thread>(std::bind(&kurisu::detail::ThreadPool::Handle, this), m_name + id));  // 创建线程
-                m_thrds[i]->Start();
+                m_monitor = std::make_unique<Thread>(std::bind(&ThreadPool::Monitor, this), m_name + "Monitor");
+                m_monitor->Start();
             }
 
             if (thrdNum == 0 && m_thrdInitCallBack)  // 如果创建的线程为0，也执行初始化后的回调函数
                 m_thrdInitCallBack();
         }
-        void ThreadPool::Handle()
+        void ThreadPool::StartWorker(int index)
+        {
+            Worker* worker = m_workers[index].get();
+            if (worker->thrd)
+                worker->thrd->Join();  // 退出了的线程，先回收
+            worker->isRetired = false;
+            m_activeNum.fetch_add(1, std::memory_order_relaxed);
+            std::string id = fmt::format("{}", index + 1);
+            worker->thrd = std::make_unique<Thread>(std::bind(&kurisu::detail::ThreadPool::Handle, this, index), m_name + id);  // 创建线程
+            worker->thrd->Start();
+        }
+        void ThreadPool::Handle(int index)
         {
+            t_threadPool = this;
+            t_workerIndex = index;
+            Worker* worker = m_workers[index].get();
             try
             {
                 if (m_thrdInitCallBack)
                     m_thrdInitCallBack();  // 如果有初始化的回调函数就执行
-                while (m_isRunning)
-                    if (std::function<void()> func(Take()); func)  // 从函数队列中拿出函数，是可执行的函数就执行，直到m_running被变成false
-                        func();
+                while (m_isRunning && !worker->isRetired)
+                {
+                    if (Task* task = Take(index); task)  // 取出任务执行，直到m_isRunning被变成false
+                    {
+                        if (m_isRecording)
+                        {
+                            int64_t start = SteadyNowNs();
+                            uint64_t wait = (uint64_t)std::max<int64_t>(start - task->enqueueTime, 0);
+                            worker->queueWait.Record(wait);
+                            worker->windowWaitSum.fetch_add(wait, std::memory_order_relaxed);
+                            worker->windowWaitNum.fetch_add(1, std::memory_order_relaxed);
+                            task->func();
+                            worker->runTime.Record((uint64_t)(SteadyNowNs() - start));
+                        }
+                        else
+                            task->func();
+                        delete task;
+                        m_pendingNum.fetch_sub(1, std::memory_order_release);
+                    }
+                }
             }
             catch (const Exception& ex)
             {
@@ -433,80 +738,481 @@ namespace kurisu {
                 throw;  // rethrow
             }
         }
-        std::function<void()> ThreadPool::Take()
+        ThreadPool::Task* ThreadPool::TryTake(int index)
         {
-            std::unique_lock locker(m_mu);
-            if (m_tasks.empty() && m_isRunning)
-                m_notEmptyCond.wait(locker, [this] { return !m_tasks.empty() || !m_isRunning; });  // 等到有任务为止
+            // 先取自己的
+            Task* task = m_workers[index]->deque.Pop();
+
+            // 再取注入队列的
+            if (task == nullptr && m_injection->TryPop(task))
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_notFullWaiterNum.load(std::memory_order_relaxed) > 0)
+                {
+                    std::lock_guard locker(m_notFullMu);
+                    m_notFullCond.notify_all();  // 通知在等待的Run，队列有空位了
+                }
+            }
+
+            // 注入队列满了才会用到溢出队列
+            if (task == nullptr && m_overflowNum.load(std::memory_order_relaxed) > 0 && m_overflowMu.try_lock())
+            {
+                if (!m_overflow.empty())
+                {
+                    task = m_overflow.front();
+                    m_overflow.pop_front();
+                    m_overflowNum.fetch_sub(1, std::memory_order_relaxed);
+                }
+                m_overflowMu.unlock();
+            }
+
+            // 最后从其他线程的队列顶部偷
+            int num = (int)m_workers.size();
+            for (int i = 1; task == nullptr && i < num; i++)
+                task = m_workers[(index + i) % num]->deque.Steal();
 
-            std::function<void()> func;
-            if (!m_tasks.empty())
+            if (task != nullptr)
+                m_queuedNum.fetch_sub(1, std::memory_order_seq_cst);
+            return task;
+        }
+        ThreadPool::Task* ThreadPool::Take(int index)
+        {
+            while (m_isRunning)
             {
-                func = std::move(m_tasks.front());  // 取出函数
-                m_tasks.pop_front();
+                for (int i = 0; i < k_SpinNum; i++)
+                {
+                    if (Task* task = TryTake(index); task)
+                        return task;
+                    if (!m_isRunning)
+                        return nullptr;
+                    if (i < k_SpinNum / 2)
+                        CpuRelax();
+                    else
+                        std::this_thread::yield();
+                }
+
+                // 自旋也没等到任务就睡眠
+                // m_sleeperNum与m_queuedNum都是seq_cst，Run要么看到有线程在睡眠，要么这里看到有任务，不会丢失唤醒
+                bool isIdleTooLong = false;
+                {
+                    std::unique_lock locker(m_parkMu);
+                    m_sleeperNum.fetch_add(1, std::memory_order_seq_cst);
+                    if (m_queuedNum.load(std::memory_order_seq_cst) <= 0 && m_isRunning)
+                    {
+                        if (m_isElastic)
+                            isIdleTooLong = (m_parkCond.wait_for(locker, std::chrono::nanoseconds(m_maxIdle)) == std::cv_status::timeout);
+                        else
+                            m_parkCond.wait(locker);
+                    }
+                    m_sleeperNum.fetch_sub(1, std::memory_order_relaxed);
+                }
+                // 自己的队列一定是空的，退出不会丢任务
+                if (isIdleTooLong && m_queuedNum.load(std::memory_order_seq_cst) <= 0 && TryRetire(index))
+                    return nullptr;
             }
-            if (m_maxSize > 0)
-                m_notFullCond.notify_one();  // 如果对等待队列做了大小限制，就通知其他线程，等待队列有空闲了
+            return nullptr;
+        }
+        bool ThreadPool::TryRetire(int index)
+        {
+            int activeNum = m_activeNum.load(std::memory_order_relaxed);
+            while (activeNum > m_minThrdNum)
+                if (m_activeNum.compare_exchange_weak(activeNum, activeNum - 1, std::memory_order_relaxed))
+                {
+                    m_workers[index]->isRetired = true;
+                    return true;
+                }
+            return false;
+        }
+        void ThreadPool::Monitor()
+        {
+            while (m_isRunning)
+            {
+                {
+                    std::unique_lock locker(m_monitorMu);
+                    m_monitorCond.wait_for(locker, std::chrono::milliseconds(k_MonitorIntervalMs), [this] { return !m_isRunning; });
+                }
+                if (!m_isRunning)
+                    break;
 
-            return func;
+                // 本周期内开始执行的任务的平均排队时间
+                uint64_t waitSum = 0;
+                uint64_t waitNum = 0;
+                for (auto&& worker : m_workers)
+                {
+                    waitSum += worker->windowWaitSum.exchange(0, std::memory_order_relaxed);
+                    waitNum += worker->windowWaitNum.exchange(0, std::memory_order_relaxed);
+                }
+                bool isQueued = m_queuedNum.load(std::memory_order_relaxed) > 0;
+                bool isSlow = waitNum > 0 && waitSum / waitNum > (uint64_t)m_maxQueueWait;
+                bool isStuck = waitNum == 0 && isQueued;  // 所有线程都卡在长任务上，一个任务都没开始
+                // 有睡眠的线程说明线程够用
+                if (!isQueued || !(isSlow || isStuck) || m_sleeperNum.load(std::memory_order_relaxed) > 0)
+                    continue;
+                if (m_activeNum.load(std::memory_order_relaxed) >= m_maxThrdNum)
+                    continue;
+
+                // 每个周期最多加一个线程，新线程会从注入队列和其他线程的队列中取任务
+                for (int i = 0; i < (int)m_workers.size(); i++)
+                    if (!m_workers[i]->thrd || m_workers[i]->isRetired)
+                    {
+                        StartWorker(i);
+                        break;
+                    }
+            }
+        }
+        ThreadPool::Task* ThreadPool::NewTask(std::function<void()>&& func)
+        {
+            return new Task{std::move(func), m_isRecording ? SteadyNowNs() : 0};
+        }
+        void ThreadPool::WakeUp(uint64_t num)
+        {
+            int sleeperNum = m_sleeperNum.load(std::memory_order_seq_cst);
+            if (sleeperNum > 0)
+            {
+                std::lock_guard locker(m_parkMu);
+                if (num >= (uint64_t)sleeperNum)
+                    m_parkCond.notify_all();
+                else
+                    for (uint64_t i = 0; i < num; i++)
+                        m_parkCond.notify_one();
+            }
+        }
+        void ThreadPool::WaitNotFull(uint64_t num)
+        {
+            std::unique_lock locker(m_notFullMu);
+            m_notFullWaiterNum.fetch_add(1, std::memory_order_seq_cst);
+            // 和TryTake中出队后读m_notFullWaiterNum配对，不会丢失唤醒
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            m_notFullCond.wait(locker, [this, num] { return m_injection->SizeApprox() + num <= m_injection->Capacity() || !m_isRunning; });
+            m_notFullWaiterNum.fetch_sub(1, std::memory_order_relaxed);
+        }
+        bool ThreadPool::Inject(Task** tasks, uint64_t num, bool isBlocking)
+        {
+            // 先计数再入队，保证睡眠前检查m_queuedNum的线程不会错过这些任务
+            m_pendingNum.fetch_add(num, std::memory_order_relaxed);
+            m_queuedNum.fetch_add(num, std::memory_order_seq_cst);
+            while (!(num == 1 ? m_injection->TryPush(std::move(tasks[0])) : m_injection->TryPushBatch(tasks, num)))
+            {
+                if (m_maxSize == 0)  // 不限制大小，放进溢出队列
+                {
+                    std::lock_guard locker(m_overflowMu);
+                    m_overflow.insert(m_overflow.end(), tasks, tasks + num);
+                    m_overflowNum.fetch_add(num, std::memory_order_relaxed);
+                    break;
+                }
+                if (!isBlocking || !m_isRunning)
+                {
+                    m_queuedNum.fetch_sub(num, std::memory_order_seq_cst);
+                    m_pendingNum.fetch_sub(num, std::memory_order_release);
+                    return false;
+                }
+                WaitNotFull(num);  // 线程池中的线程都忙，就等到有空位为止
+            }
+            WakeUp(num);
+            return true;
         }
         void ThreadPool::Run(std::function<void()> task)
         {
-            if (m_thrds.empty())
+            if (m_workers.empty())
+            {
                 task();  // 如果没有线程池，就直接用现在的线程执行函数
-            else
+                return;
+            }
+            if (!m_isRunning)  // 如果已经析构，线程退出
+                return;
+
+            Task* p = NewTask(std::move(task));
+            // 池内线程提交的任务放进自己的队列，不会阻塞，否则任务里Run可能会死锁
+            if (t_threadPool == this)
             {
-                std::unique_lock locker(m_mu);
+                m_pendingNum.fetch_add(1, std::memory_order_relaxed);
+                m_queuedNum.fetch_add(1, std::memory_order_seq_cst);
+                m_workers[t_workerIndex]->deque.Push(p);
+                WakeUp(1);
+            }
+            else if (!Inject(&p, 1, true))
+                delete p;
+        }
+        void ThreadPool::RunBatch(std::vector<std::function<void()>> tasks)
+        {
+            if (m_workers.empty())
+            {
+                for (auto&& task : tasks)
+                    task();
+                return;
+            }
+            if (!m_isRunning || tasks.empty())
+                return;
+
+            std::vector<Task*> ps;
+            ps.reserve(tasks.size());
+            for (auto&& task : tasks)
+                ps.emplace_back(NewTask(std::move(task)));
 
-                // 如果 m_maxSize == 0，full()的返回值恒为false
-                // 此时会直接跳到后面将task加入队列，即不对等待队列的大小做限制
-                // 这样做效率可能会有所提高，但是会更占用更多内存
-                // 而且使用不当还会造成等待队列爆满的情况，建议还是设置一个大小
-                // 除非你很清楚你在干什么
-                if (Full() && m_isRunning)
-                    m_notFullCond.wait(locker, [this] { return !Full() || !m_isRunning; });  // 线程池中的线程都忙，就等到有空闲的线程为止
+            if (t_threadPool == this)
+            {
+                m_pendingNum.fetch_add(ps.size(), std::memory_order_relaxed);
+                m_queuedNum.fetch_add(ps.size(), std::memory_order_seq_cst);
+                for (auto&& p : ps)
+                    m_workers[t_workerIndex]->deque.Push(p);
+                WakeUp(ps.size());
+                return;
+            }
 
-                if (!m_isRunning)  // 如果已经析构，线程退出
+            // 超过容量的部分分批放入
+            uint64_t capacity = m_injection->Capacity();
+            for (uint64_t i = 0; i < ps.size(); i += capacity)
+            {
+                uint64_t num = std::min<uint64_t>(ps.size() - i, capacity);
+                if (!Inject(&ps[i], num, true))
+                {
+                    for (uint64_t j = i; j < ps.size(); j++)
+                        delete ps[j];
                     return;
+                }
+            }
+        }
+        bool ThreadPool::TryRun(std::function<void()> task)
+        {
+            if (m_workers.empty())
+            {
+                task();
+                return true;
+            }
+            if (!m_isRunning)
+                return false;
+            // 满了就不必再分配任务
+            if (t_threadPool != this && m_maxSize > 0 && m_injection->SizeApprox() >= m_injection->Capacity())
+            {
+                m_rejectedNum.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
 
-                m_tasks.emplace_back(std::move(task));  // 将task加入队列
-                // printf("m_task.size()=%lu\n", m_task.size());
-                m_notEmptyCond.notify_one();  // 通知其他线程等待队列已有任务
+            Task* p = NewTask(std::move(task));
+            if (t_threadPool == this)
+            {
+                m_pendingNum.fetch_add(1, std::memory_order_relaxed);
+                m_queuedNum.fetch_add(1, std::memory_order_seq_cst);
+                m_workers[t_workerIndex]->deque.Push(p);
+                WakeUp(1);
+                return true;
             }
+            if (Inject(&p, 1, false))
+                return true;
+            delete p;
+            m_rejectedNum.fetch_add(1, std::memory_order_relaxed);
+            return false;
         }
         void ThreadPool::Stop()
         {
+            m_isRunning = 0;
+            // 先停监控线程，之后就不会再有新的工作线程
+            if (m_monitor)
             {
-                std::lock_guard locker(m_mu);
-                m_isRunning = 0;
+                {
+                    std::lock_guard locker(m_monitorMu);
+                    m_monitorCond.notify_all();
+                }
+                m_monitor->Join();
+                m_monitor.reset();
+            }
+            {
+                std::lock_guard locker(m_parkMu);
+                m_parkCond.notify_all();
+            }
+            {
+                std::lock_guard locker(m_notFullMu);
                 m_notFullCond.notify_all();
-                m_notEmptyCond.notify_all();
             }
-            for (auto&& thrd : m_thrds)
-                thrd->Join();
+            for (auto&& worker : m_workers)
+                if (worker->thrd && worker->thrd->Started())
+                    worker->thrd->Join();
+            m_activeNum = 0;
+
+            // 没来得及执行的任务直接丢弃
+            if (m_injection)
+                for (Task* task; m_injection->TryPop(task);)
+                    delete task;
+            std::lock_guard locker(m_overflowMu);
+            for (auto&& task : m_overflow)
+                delete task;
+            m_overflow.clear();
+            m_overflowNum = 0;
         }
         void ThreadPool::Join()
         {
-            detail::CountDownLatch latch(1);
+            // 工作窃取下任务的执行顺序不固定，所以等所有任务都执行完，而不是往队列里放一个倒计时任务
+            while (m_isRunning && m_pendingNum.load(std::memory_order_acquire) > 0)
+                this_thrd::SleepFor(1000);
+            Stop();
+        }
+        uint64_t ThreadPool::Size() const { return (uint64_t)std::max<int64_t>(m_queuedNum.load(std::memory_order_relaxed), 0); }
+        void ThreadPool::GetQueueWaitHistogram(Histogram* out) const
+        {
+            out->Reset();
+            for (auto&& worker : m_workers)
+                out->Merge(worker->queueWait);
+        }
+        void ThreadPool::GetRunTimeHistogram(Histogram* out) const
+        {
+            out->Reset();
+            for (auto&& worker : m_workers)
+                out->Merge(worker->runTime);
+        }
+        uint64_t ThreadPool::QueueDepth() const
+        {
+            if (!m_injection)
+                return 0;
+            return m_injection->SizeApprox() + (uint64_t)std::max<int64_t>(m_overflowNum.load(std::memory_order_relaxed), 0);
+        }
 
-            // 往线程池里加入一个倒计时任务
-            Run(std::bind(&kurisu::detail::CountDownLatch::CountDown, &latch));
 
-            // 等待倒计时任务被执行
-            // 被执行了就说明在这个任务之前的任务都被执行了
-            latch.Wait();
-            Stop();
+
+
+        Strand::~Strand()
+        {
+            // 线程池停止后没来得及执行的任务直接丢弃
+            for (Node* node = m_tail; node != nullptr;)
+            {
+                Node* next = node->next.load(std::memory_order_relaxed);
+                if (node != &m_stub)
+                    delete node;
+                node = next;
+            }
         }
-        uint64_t ThreadPool::Size() const
+        void Strand::Push(Node* node)
         {
-            std::lock_guard locker(m_mu);
-            return m_tasks.size();
+            node->next.store(nullptr, std::memory_order_relaxed);
+            Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);  // 在这之前Pop看不到node
+        }
+        Strand::Node* Strand::Pop()
+        {
+            Node* tail = m_tail;
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (tail == &m_stub)  // 跳过哨兵
+            {
+                if (next == nullptr)
+                    return nullptr;
+                m_tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+            if (next != nullptr)
+            {
+                m_tail = next;
+                return tail;
+            }
+            if (tail != m_head.load(std::memory_order_acquire))
+                return nullptr;  // 有生产者交换了m_head但还没连上next
+
+            // tail是最后一个节点，放回哨兵后才能把tail取走
+            Push(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next != nullptr)
+            {
+                m_tail = next;
+                return tail;
+            }
+            return nullptr;
+        }
+        void Strand::Run(std::function<void()> func)
+        {
+            // 先计数再入队，Drain取出的任务数不会超过m_pendingNum
+            bool isFirst = (m_pendingNum.fetch_add(1, std::memory_order_acq_rel) == 0);
+            Push(new Node{{nullptr}, std::move(func)});
+            if (isFirst)
+                m_pool->Run(std::bind(&Strand::Drain, shared_from_this()));
+        }
+        void Strand::Drain()
+        {
+            uint64_t doneNum = 0;
+            while (doneNum < k_BatchNum)
+            {
+                Node* node = Pop();
+                if (node == nullptr)
+                {
+                    if (doneNum == m_pendingNum.load(std::memory_order_acquire))
+                        break;  // 都执行完了
+                    std::this_thread::yield();  // 已经计数但还没入队，等一下
+                    continue;
+                }
+                node->task();
+                delete node;
+                doneNum++;
+            }
+
+            // 减完后还有任务说明这期间又有Run，由这里重新投递
+            if (m_pendingNum.fetch_sub(doneNum, std::memory_order_acq_rel) > doneNum)
+                m_pool->Run(std::bind(&Strand::Drain, shared_from_this()));
         }
-        bool ThreadPool::Full() const { return m_maxSize > 0 && m_tasks.size() >= m_maxSize; }
 
 
 
 
+        namespace {
+            // 每个线程缓存一块溢出缓冲区，长日志只在第一次或者变得更长时分配内存
+            struct LogSpillCache {
+                char* buf = nullptr;
+                uint64_t size = 0;
+                ~LogSpillCache() { free(buf); }
+            };
+            thread_local LogSpillCache t_spillCache;
+        }  // namespace
+
+        std::atomic_uint64_t LogBuffer::s_maxSize = 256 * 1024;
+
+        bool LogBuffer::Spill(uint64_t n)
+        {
+            uint64_t len = Size();
+            uint64_t capacity = m_end - m_data;
+            uint64_t maxSize = std::max(MaxSize(), capacity);
+            if (capacity == maxSize)
+                return false;
+            // 每次至少翻倍，避免一点点追加时反复搬运
+            uint64_t size = std::min(std::max({len + n, capacity * 2, 4 * k_SmallBuf}), maxSize);
+            char* buf;
+            if (m_data == m_inline)
+            {
+                // 缓存的缓冲区不够大或者被同一线程里嵌套的日志占着时单独分配，还回来时留下大的那块
+                if (t_spillCache.buf != nullptr && t_spillCache.size >= size)
+                {
+                    buf = t_spillCache.buf;
+                    size = t_spillCache.size;
+                    t_spillCache.buf = nullptr;
+                }
+                else
+                    buf = (char*)malloc(size);
+                if (buf != nullptr)
+                    memcpy(buf, m_data, len);
+            }
+            else
+                buf = (char*)realloc(m_data, size);
+            if (buf == nullptr)
+            {
+                fprintf(stderr, "LogBuffer spill malloc %lu bytes failed\n", size);
+                return false;
+            }
+            m_data = buf;
+            m_index = buf + len;
+            m_end = buf + size;
+            return AvalibleSize() >= n;
+        }
+        void LogBuffer::ReleaseSpill()
+        {
+            uint64_t size = m_end - m_data;
+            if (t_spillCache.buf == nullptr || t_spillCache.size < size)
+            {
+                free(t_spillCache.buf);
+                t_spillCache.buf = m_data;
+                t_spillCache.size = size;
+            }
+            else
+                free(m_data);
+            m_data = m_index = m_inline;
+            m_end = m_inline + k_SmallBuf;
+        }
+
         LogStream& LogStream::operator<<(bool val)
         {
             m_buf.Append(val ? "1" : "0", 1);
@@ -554,7 +1260,7 @@ namespace kurisu {
         }
         LogStream& LogStream::operator<<(double val)
         {
-            if (m_buf.AvalibleSize() >= k_MaxSize)
+            if (m_buf.Reserve(k_MaxSize))
             {
                 auto ptr = fmt::format_to(m_buf.Index(), FMT_COMPILE("{:.12g}"), val);
                 uint64_t len = ptr - m_buf.Index();
@@ -565,7 +1271,7 @@ namespace kurisu {
         LogStream& LogStream::operator<<(const void* p)
         {
             uintptr_t val = (uintptr_t)p;
-            if (m_buf.AvalibleSize() >= k_MaxSize)
+            if (m_buf.Reserve(k_MaxSize))
             {
                 char* buf = m_buf.Index();
                 buf[0] = '0';
@@ -598,7 +1304,7 @@ namespace kurisu {
             m_buf.Append(str.data(), str.size());
             return *this;
         }
-        LogStream& LogStream::operator<<(const FixedBuf& buf)
+        LogStream& LogStream::operator<<(const Buf& buf)
         {
             *this << buf.StringView();
             return *this;
@@ -612,6 +1318,7 @@ namespace kurisu {
     }  // namespace detail
 
     bool Logger::s_isLocalTimeZone = false;
+    Logger::KvFormat Logger::s_kvFormat = Logger::KvFormat::k_Json;
 
     namespace detail {
         void DefaultOutput(const char* msg, const uint64_t len) { fwrite(msg, 1, len, stdout); }
@@ -628,7 +1335,8 @@ namespace kurisu {
 
         void (*g_output)(const char* msg, const uint64_t len) = DefaultOutput;
         void (*g_flush)() = DefaultFlush;
-        Logger::LogLevel g_logLevel = InitLogLevel();
+        alignas(64) std::atomic<Logger::LogLevel> g_logLevel = InitLogLevel();
+        __thread Logger::LogLevel t_outputLevel = Logger::LogLevel::INFO;  // 正在交给g_output的日志的等级
         const char* LogLevelName[6] = {
             "[TRACE] ",
             "[DEBUG] ",
@@ -637,38 +1345,222 @@ namespace kurisu {
             "[ERROR] ",
             "[FATAL] ",
         };
+        const std::string_view KvLevelName[6] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
 
-    }  // namespace detail
-
-    namespace process {
-        pid_t Pid() { return getpid(); }
-        std::string PidString() { return fmt::format("{}", Pid()); }
-        uid_t Uid() { return getuid(); }
-        std::string UserName()
-        {
-            struct passwd pwd;
-            struct passwd* result = nullptr;
-            char buf[8192];
-            const char* name = "unknownuser";
-
-            getpwuid_r(Uid(), &pwd, buf, sizeof buf, &result);
-            if (result)
-                name = pwd.pw_name;
-            return name;
-        }
-        Timestamp StartTime() { return detail::g_startTime; }
-        int ClockTicksPerSecond() { return detail::g_clockTicks; }
-        int PageSize() { return detail::g_pageSize; }
-
+        namespace {
+            const uint64_t k_KvReserve = 8;  // 给结尾的引号、}和换行留的位置，截断时整行也是完整的
 
-        // read /proc/self/status
-        std::string ProcStatus()
-        {
-            std::string result;
-            detail::ReadFile("/proc/self/status", 65536, result);
-            return result;
-        }
-        // read /proc/self/stat
+            // [p, end)中第一个要特殊处理的字符，<=maxControl的字符、'"'、'\\'和extra，一次看16字节
+            const char* FindKvSpecial(const char* p, const char* end, uint8_t maxControl, char extra)
+            {
+#if defined(__SSE2__)
+                const __m128i max = _mm_set1_epi8((char)maxControl);
+                const __m128i quote = _mm_set1_epi8('"');
+                const __m128i backslash = _mm_set1_epi8('\\');
+                const __m128i ext = _mm_set1_epi8(extra);
+                for (; end - p >= 16; p += 16)
+                {
+                    __m128i x = _mm_loadu_si128((const __m128i*)p);
+                    __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(x, max), max);  // 无符号比较x<=maxControl
+                    __m128i special = _mm_or_si128(_mm_or_si128(control, _mm_cmpeq_epi8(x, quote)),
+                                                   _mm_or_si128(_mm_cmpeq_epi8(x, backslash), _mm_cmpeq_epi8(x, ext)));
+                    if (int mask = _mm_movemask_epi8(special); mask != 0)
+                        return p + __builtin_ctz(mask);
+                }
+#endif
+                for (; p != end; p++)
+                    if ((uint8_t)*p <= maxControl || *p == '"' || *p == '\\' || *p == extra)
+                        return p;
+                return end;
+            }
+            // 按JSON字符串的规则转义后写进buf，最多写limit字节，放不下时截断，不切开UTF-8字符
+            void AppendKvEscaped(LogStream::Buf& buf, std::string_view str, uint64_t limit)
+            {
+                char* out = buf.Index();
+                char* outEnd = out + limit;
+                const char* p = str.data();
+                const char* end = p + str.size();
+                bool isTruncated = false;
+                while (p != end)
+                {
+                    const char* special = FindKvSpecial(p, end, 0x1F, '"');
+                    uint64_t n = std::min<uint64_t>(special - p, outEnd - out);
+                    memcpy(out, p, n);
+                    out += n;
+                    p += n;
+                    if (p == end)
+                        break;
+                    char esc[8] = {'\\'};
+                    int escLen = 2;
+                    switch (*p)
+                    {
+                        case '"': esc[1] = '"'; break;
+                        case '\\': esc[1] = '\\'; break;
+                        case '\n': esc[1] = 'n'; break;
+                        case '\r': esc[1] = 'r'; break;
+                        case '\t': esc[1] = 't'; break;
+                        case '\b': esc[1] = 'b'; break;
+                        case '\f': esc[1] = 'f'; break;
+                        default: escLen = (int)(fmt::format_to(esc + 1, FMT_COMPILE("u{:04x}"), (uint8_t)*p) - esc); break;
+                    }
+                    if (p != special || outEnd - out < escLen)
+                    {
+                        isTruncated = true;
+                        break;
+                    }
+                    memcpy(out, esc, escLen);
+                    out += escLen;
+                    p++;
+                }
+                if (isTruncated)
+                {
+                    // 去掉末尾不完整的UTF-8字符
+                    char* q = out;
+                    while (q != buf.Index() && ((uint8_t)q[-1] & 0xC0) == 0x80)
+                        q--;
+                    if (q != buf.Index() && (uint8_t)q[-1] >= 0xC0)
+                        out = q - 1;
+                }
+                buf.IndexShiftRight(out - buf.Index());
+            }
+            // 转义后的长度，只在剩下的位置可能不够时才算
+            uint64_t KvEscapedSize(std::string_view str)
+            {
+                uint64_t size = str.size();
+                const char* end = str.data() + str.size();
+                for (const char* p = FindKvSpecial(str.data(), end, 0x1F, '"'); p != end; p = FindKvSpecial(p + 1, end, 0x1F, '"'))
+                {
+                    bool isShort = *p == '"' || *p == '\\' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\b' || *p == '\f';
+                    size += isShort ? 1 : 5;  // \x或者\u00xx
+                }
+                return size;
+            }
+            // 写入key和分隔符，剩下的位置不够写key和valueSize字节的value时什么都不写，返回false
+            bool BeginKv(LogStream::Buf& buf, Logger::KvFormat format, std::string_view key, uint64_t valueSize)
+            {
+                if (!buf.Reserve(k_KvReserve + key.size() * 6 + 4 + valueSize))
+                    return false;
+                if (format == Logger::KvFormat::k_Json)
+                {
+                    buf.Append(",\"", 2);
+                    AppendKvEscaped(buf, key, key.size() * 6);
+                    buf.Append("\":", 2);
+                }
+                else
+                {
+                    buf.Append(" ", 1);
+                    AppendKvEscaped(buf, key, key.size() * 6);
+                    buf.Append("=", 1);
+                }
+                return true;
+            }
+            template <typename T>
+            void AppendKvNumber(LogStream& strm, Logger::KvFormat format, std::string_view key, T val)
+            {
+                auto& buf = strm.Buffer();
+                if (BeginKv(buf, format, key, 32))
+                    buf.IndexShiftRight(fmt::format_to(buf.Index(), FMT_COMPILE("{}"), val) - buf.Index());
+            }
+        }  // namespace
+
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, std::string_view val)
+        {
+            auto& buf = strm.Buffer();
+            // logfmt中没有空格、=、引号和控制字符的值不用加引号
+            bool isQuoted = format == Logger::KvFormat::k_Json || val.empty() || FindKvSpecial(val.data(), val.data() + val.size(), ' ', '=') != val.data() + val.size();
+            if (!BeginKv(buf, format, key, 2))
+                return;
+            if (!isQuoted)
+            {
+                buf.Reserve(k_KvReserve + val.size());
+                buf.Append(val.data(), std::min<uint64_t>(val.size(), buf.AvalibleSize() - k_KvReserve));
+                return;
+            }
+            if (k_KvReserve + 1 + val.size() > buf.AvalibleSize())
+                buf.Reserve(k_KvReserve + 1 + KvEscapedSize(val));
+            buf.Append("\"", 1);
+            AppendKvEscaped(buf, val, buf.AvalibleSize() - k_KvReserve);
+            buf.Append("\"", 1);
+        }
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, bool val)
+        {
+            auto& buf = strm.Buffer();
+            if (BeginKv(buf, format, key, 5))
+                buf.Append(val ? "true" : "false", val ? 4 : 5);
+        }
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, int64_t val) { AppendKvNumber(strm, format, key, val); }
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, uint64_t val) { AppendKvNumber(strm, format, key, val); }
+        void AppendKv(LogStream& strm, Logger::KvFormat format, std::string_view key, double val)
+        {
+            // JSON没有inf和nan
+            if (format == Logger::KvFormat::k_Json && !std::isfinite(val))
+            {
+                auto& buf = strm.Buffer();
+                if (BeginKv(buf, format, key, 4))
+                    buf.Append("null", 4);
+            }
+            else
+                AppendKvNumber(strm, format, key, val);
+        }
+
+        namespace {
+            // 所有LogCategory，第一次用到时才创建，其他编译单元的全局LogCategory构造时也能用
+            struct LogCategoryRegistry {
+                std::mutex mu;
+                std::vector<LogCategory*> categories;
+                Logger::LogLevel level = InitLogLevel();  // 没有单独设置等级的分类用这个等级
+            };
+            LogCategoryRegistry& GetLogCategoryRegistry()
+            {
+                static LogCategoryRegistry registry;
+                return registry;
+            }
+            // "net.*"匹配"net."开头的，"*"匹配所有
+            bool MatchCategory(std::string_view pattern, std::string_view name)
+            {
+                if (pattern.size() >= 1 && pattern.back() == '*')
+                    return name.substr(0, pattern.size() - 1) == pattern.substr(0, pattern.size() - 1);
+                return pattern == name;
+            }
+        }  // namespace
+
+        LogCategory g_pollerLog("net.poller");
+        LogCategory g_loopLog("net.loop");
+        LogCategory g_connLog("net.conn");
+        LogCategory g_clientLog("net.client");
+        LogCategory g_serverLog("net.server");
+        LogCategory g_timerLog("timer");
+    }  // namespace detail
+
+    namespace process {
+        pid_t Pid() { return getpid(); }
+        std::string PidString() { return fmt::format("{}", Pid()); }
+        uid_t Uid() { return getuid(); }
+        std::string UserName()
+        {
+            struct passwd pwd;
+            struct passwd* result = nullptr;
+            char buf[8192];
+            const char* name = "unknownuser";
+
+            getpwuid_r(Uid(), &pwd, buf, sizeof buf, &result);
+            if (result)
+                name = pwd.pw_name;
+            return name;
+        }
+        Timestamp StartTime() { return detail::g_startTime; }
+        int ClockTicksPerSecond() { return detail::g_clockTicks; }
+        int PageSize() { return detail::g_pageSize; }
+
+
+        // read /proc/self/status
+        std::string ProcStatus()
+        {
+            std::string result;
+            detail::ReadFile("/proc/self/status", 65536, result);
+            return result;
+        }
+        // read /proc/self/stat
         std::string ProcStat()
         {
             std::string result;
@@ -761,17 +1653,34 @@ namespace kurisu {
         {
             if (addr->Famliy() == AF_INET)
                 return sizeof(struct sockaddr_in);
+            else if (addr->Famliy() == AF_UNIX)
+            {
+                // 抽象命名空间的地址以'\0'开头，长度不包括结尾的'\0'
+                const sockaddr_un& sun = addr->As_sockaddr_un();
+                if (addr->IsAbstractUnix())
+                    return (socklen_t)(offsetof(sockaddr_un, sun_path) + 1 + strnlen(sun.sun_path + 1, sizeof(sun.sun_path) - 1));
+                return (socklen_t)(offsetof(sockaddr_un, sun_path) + strnlen(sun.sun_path, sizeof(sun.sun_path)) + 1);
+            }
             else
                 return sizeof(struct sockaddr_in6);
         }
 
         int MakeNonblockingSocket(sa_family_t family)
         {
-            int sockfd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+            int protocol = (family == AF_UNIX) ? 0 : IPPROTO_TCP;
+            int sockfd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
             if (sockfd < 0)
                 LOG_SYSFATAL << "Socket::MakeNonblockingSocket";
             return sockfd;
         }
+        int MakeNonblockingUdpSocket(sa_family_t family)
+        {
+            int protocol = (family == AF_UNIX) ? 0 : IPPROTO_UDP;
+            int sockfd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+            if (sockfd < 0)
+                LOG_SYSFATAL << "Socket::MakeNonblockingUdpSocket";
+            return sockfd;
+        }
         int Connect(int sockfd, SockAddr* addr) { return connect(sockfd, &addr->As_sockaddr(), SizeofSockAddr(addr)); }
         void Bind(int sockfd, SockAddr* addr)
         {
@@ -793,7 +1702,7 @@ namespace kurisu {
             if (connfd < 0)
             {
                 int savedErrno = errno;
-                LOG_SYSERR << "Socket::Accept";
+                LOG_SYSERR_RATE_LIMITED(10, 50) << "Socket::Accept";
                 switch (savedErrno)
                 {
                     case EAGAIN:
@@ -821,6 +1730,8 @@ namespace kurisu {
                         break;
                 }
             }
+            else if (addrlen < sizeof(*addr))
+                memset((char*)addr + addrlen, 0, sizeof(*addr) - addrlen);  // AF_UNIX的地址是变长的，把剩下的清零
             return connfd;
         }
 
@@ -867,7 +1778,16 @@ namespace kurisu {
 
         void AddrToIp(char* buf, uint64_t size, SockAddr* addr)
         {
-            if (addr->Famliy() == AF_INET)
+            if (addr->Famliy() == AF_UNIX)
+            {
+                // 文件路径，抽象命名空间的地址显示为"@name"
+                const sockaddr_un& sun = addr->As_sockaddr_un();
+                if (addr->IsAbstractUnix())
+                    snprintf(buf, size, "@%.*s", (int)strnlen(sun.sun_path + 1, sizeof(sun.sun_path) - 1), sun.sun_path + 1);
+                else
+                    snprintf(buf, size, "%.*s", (int)strnlen(sun.sun_path, sizeof(sun.sun_path)), sun.sun_path);
+            }
+            else if (addr->Famliy() == AF_INET)
                 inet_ntop(AF_INET, &addr->As_sockaddr_in().sin_addr, buf, (socklen_t)size);
             else if (addr->Famliy() == AF_INET6)
                 inet_ntop(AF_INET6, &addr->As_sockaddr_in6().sin6_addr, buf, (socklen_t)size);
@@ -875,7 +1795,9 @@ namespace kurisu {
 
         void AddrToIpPort(char* buf, uint64_t size, SockAddr* addr)
         {
-            if (addr->Famliy() == AF_INET)
+            if (addr->Famliy() == AF_UNIX)
+                AddrToIp(buf, size, addr);  // 没有端口
+            else if (addr->Famliy() == AF_INET)
             {
                 AddrToIp(buf, size, addr);
                 uint64_t end = strlen(buf);
@@ -923,6 +1845,25 @@ namespace kurisu {
                 LOG_SYSERR << "Sockets::GetPeerAddr";
             return peeraddr;
         }
+        bool IsSelfConnect(int sockfd)
+        {
+            SockAddr localaddr = GetLocalAddr(sockfd);
+            SockAddr peeraddr = GetPeerAddr(sockfd);
+            if (localaddr.Famliy() == AF_INET)
+            {
+                const sockaddr_in& laddr = localaddr.As_sockaddr_in();
+                const sockaddr_in& raddr = peeraddr.As_sockaddr_in();
+                return laddr.sin_port == raddr.sin_port && laddr.sin_addr.s_addr == raddr.sin_addr.s_addr;
+            }
+            else if (localaddr.Famliy() == AF_INET6)
+            {
+                const sockaddr_in6& laddr = localaddr.As_sockaddr_in6();
+                const sockaddr_in6& raddr = peeraddr.As_sockaddr_in6();
+                return laddr.sin6_port == raddr.sin6_port && memcmp(&laddr.sin6_addr, &raddr.sin6_addr, sizeof(laddr.sin6_addr)) == 0;
+            }
+            else
+                return false;
+        }
 
         int MakeNonblockingTimerfd()
         {
@@ -994,6 +1935,12 @@ namespace kurisu {
             int optval = on ? 1 : 0;
             setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
         }
+        bool Socket::GetPeerCred(ucred* cred) const
+        {
+            socklen_t len = sizeof(*cred);
+            bzero(cred, len);
+            return getsockopt(m_fd, SOL_SOCKET, SO_PEERCRED, cred, &len) == 0;
+        }
         void Socket::SetReuseAddr(bool on)
         {
             int optval = on ? 1 : 0;
@@ -1043,7 +1990,7 @@ namespace kurisu {
         {
             uint64_t tmp;
             ssize_t n = read(timerfd, &tmp, sizeof(tmp));
-            LOG_TRACE << "TimerQueue::ReadTimerfd() " << tmp << " at " << now.GmFormatString() << "(GM)";
+            LOG_TRACE_C(detail::g_timerLog) << "TimerQueue::ReadTimerfd() " << tmp << " at " << now.GmFormatString() << "(GM)";
             if (n != sizeof(tmp))
                 LOG_ERROR << "TimerQueue::ReadTimerfd() reads " << n << " bytes instead of 8";
         }
@@ -1197,7 +2144,7 @@ namespace kurisu {
         void Channel::RunCallbackWithGuard(Timestamp timestamp)
         {
             m_isRunningCallback = true;
-            LOG_TRACE << ReventsString();
+            LOG_TRACE_C(detail::g_loopLog) << ReventsString();
             if ((m_revents & EPOLLHUP) && !(m_revents & EPOLLIN))  // 客户端主动关闭(调用close)
             {
                 if (m_logHup)
@@ -1252,7 +2199,7 @@ namespace kurisu {
 
         Timestamp Poller::Poll(int timeoutMs, std::vector<Channel*>* activeChannels)
         {
-            LOG_TRACE << "fd total count " << m_channels.size();
+            LOG_TRACE_C(detail::g_pollerLog) << "fd total count " << m_channels.size();
             activeChannels->clear();  // 删除所有active channel
             int eventsNum = epoll_wait(m_epollfd, m_events.data(), (int)m_events.size(), timeoutMs);
 
@@ -1260,7 +2207,7 @@ namespace kurisu {
             Timestamp now;
             if (eventsNum > 0)
             {
-                LOG_TRACE << eventsNum << " events happened";
+                LOG_TRACE_C(detail::g_pollerLog) << eventsNum << " events happened";
                 for (int i = 0; i < eventsNum; i++)
                 {
                     Channel* channel = (Channel*)m_events[i].data.ptr;
@@ -1272,7 +2219,7 @@ namespace kurisu {
             }
             else if (eventsNum == 0)
             {
-                LOG_TRACE << "nothing happened";
+                LOG_TRACE_C(detail::g_pollerLog) << "nothing happened";
             }
             else if (tmpErrno != EINTR)
             {
@@ -1285,7 +2232,7 @@ namespace kurisu {
         {
             Poller::AssertInLoopThread();
             const int status = channel->GetStatus();
-            LOG_TRACE << "fd = " << channel->fd()
+            LOG_TRACE_C(detail::g_pollerLog) << "fd = " << channel->fd()
                       << " events = " << channel->GetEvents() << " index = " << status;
             if (status == k_New || status == k_Deleted)  // 新的或之前被移出epoll但没有从ChannelMap里删除的
             {
@@ -1293,6 +2240,12 @@ namespace kurisu {
                 if (status == k_New)           // 如果是新的
                     m_channels[fd] = channel;  // 在ChannelMap里注册
 
+                // 没有要监听的事件就不加入epoll，否则关闭后的fd会一直触发EPOLLHUP
+                if (channel->IsNoneEvent())
+                {
+                    channel->SetStatus(k_Deleted);
+                    return;
+                }
                 // 旧的就不用注册到ChannelMap里了
                 channel->SetStatus(k_Added);     // 设置状态为已添加
                 Update(EPOLL_CTL_ADD, channel);  // 将channel对应的fd注册到epoll中
@@ -1318,7 +2271,7 @@ namespace kurisu {
         {
             Poller::AssertInLoopThread();
             int fd = channel->fd();
-            LOG_TRACE << "fd = " << fd;
+            LOG_TRACE_C(detail::g_pollerLog) << "fd = " << fd;
             int status = channel->GetStatus();
             m_channels.erase(fd);  // 从ChannelMap中移除
 
@@ -1347,7 +2300,7 @@ namespace kurisu {
             event.events = channel->GetEvents();
             event.data.ptr = channel;  // 这一步使得在epoll_wait返回时能通过data.ptr访问对应的channel
             int fd = channel->fd();
-            LOG_TRACE << "epoll_ctl op = " << OperationString(operation)
+            LOG_TRACE_C(detail::g_pollerLog) << "epoll_ctl op = " << OperationString(operation)
                       << " fd = " << fd << " event = { " << channel->EventsString() << " }";
 
             if (epoll_ctl(m_epollfd, operation, fd, &event) < 0)  // 将fd注册到epoll中
@@ -1477,6 +2430,15 @@ namespace kurisu {
             m_sock.SetReusePort(reuseport);  //  设置SO_REUSEPORT,作用是支持多个进程或线程绑定到同一端口
                                              // 内核会采用负载均衡的的方式分配客户端的连接请求给某一个进程或线程
 
+            // 文件系统中的AF_UNIX地址，上次没删掉的socket文件会让bind失败
+            if (listenAddr.IsUnix() && !listenAddr.IsAbstractUnix())
+            {
+                m_unixPath = listenAddr.ipString();
+                struct stat st;
+                if (lstat(m_unixPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                    unlink(m_unixPath.c_str());
+            }
+
             m_sock.bind((SockAddr*)&listenAddr);
             m_channel.SetReadCallback(std::bind(&Acceptor::Handle, this));
         }
@@ -1485,6 +2447,8 @@ namespace kurisu {
             m_channel.OffAll();
             m_channel.Remove();
             detail::Close(m_voidfd);
+            if (!m_unixPath.empty())
+                unlink(m_unixPath.c_str());
         }
         void Acceptor::Listen()
         {
@@ -1507,8 +2471,9 @@ namespace kurisu {
             }
             else  // FIXME  因为epoll不是ET模式，需要这样来防止因fd过多处理不了而导致epoll繁忙
             {
-                LOG_SYSERR << "in Acceptor::HandleRead";
-                if (errno == EMFILE)  // 打开了过多了fd,超过了允许的范围
+                int savedErrno = errno;  // 写日志可能改掉errno
+                LOG_SYSERR_EVERY_SECONDS(1) << "in Acceptor::HandleRead";
+                if (savedErrno == EMFILE)  // 打开了过多了fd,超过了允许的范围
                 {
                     detail::Close(m_voidfd);
                     m_voidfd = accept(m_sock.fd(), NULL, NULL);
@@ -1518,6 +2483,163 @@ namespace kurisu {
             }
         }
 
+
+
+        Connector::~Connector()
+        {
+            if (m_channel)
+                LOG_ERROR << "Connector::~Connector channel is not reset";
+        }
+        void Connector::Start()
+        {
+            m_isConnect = true;
+            m_loop->Run(std::bind(&Connector::StartInLoop, shared_from_this()));
+        }
+        void Connector::Restart()
+        {
+            m_loop->AssertInLoopThread();
+            m_status = k_Disconnected;
+            m_retryDelayMs = k_InitRetryDelayMs;
+            m_isConnect = true;
+            StartInLoop();
+        }
+        void Connector::Stop()
+        {
+            m_isConnect = false;
+            m_loop->AddTask(std::bind(&Connector::StopInLoop, shared_from_this()));
+        }
+        void Connector::StartInLoop()
+        {
+            m_loop->AssertInLoopThread();
+            if (m_status != k_Disconnected)
+                return;
+            if (m_isConnect)
+                Connect();
+            else
+                LOG_DEBUG_C(detail::g_clientLog) << "Connector::StartInLoop do not connect";
+        }
+        void Connector::StopInLoop()
+        {
+            m_loop->AssertInLoopThread();
+            if (m_status == k_Connecting)
+            {
+                m_status = k_Disconnected;
+                int sockfd = RemoveAndResetChannel();
+                detail::Close(sockfd);  // 不再重试，直接关闭
+            }
+        }
+        void Connector::Connect()
+        {
+            int sockfd = MakeNonblockingSocket(m_serverAddr.Famliy());
+            int res = detail::Connect(sockfd, &m_serverAddr);
+            int savedErrno = (res == 0) ? 0 : errno;
+            switch (savedErrno)
+            {
+                case 0:
+                case EINPROGRESS:  // 非阻塞connect正在进行
+                case EINTR:
+                case EISCONN:
+                    Connecting(sockfd);
+                    break;
+
+                case EAGAIN:
+                case EADDRINUSE:
+                case EADDRNOTAVAIL:
+                case ECONNREFUSED:
+                case ENETUNREACH:
+                case ENOENT:  // AF_UNIX，服务端还没有创建socket文件
+                    Retry(sockfd);
+                    break;
+
+                case EACCES:
+                case EPERM:
+                case EAFNOSUPPORT:
+                case EALREADY:
+                case EBADF:
+                case EFAULT:
+                case ENOTSOCK:
+                    errno = savedErrno;
+                    LOG_SYSERR << "connect error in Connector::Connect";
+                    detail::Close(sockfd);
+                    break;
+
+                default:
+                    errno = savedErrno;
+                    LOG_SYSERR << "Unexpected error in Connector::Connect";
+                    detail::Close(sockfd);
+                    break;
+            }
+        }
+        void Connector::Connecting(int sockfd)
+        {
+            m_status = k_Connecting;
+            m_channel = std::make_unique<Channel>(m_loop, sockfd);
+            // 连接成功或失败时sockfd都会变得可写
+            m_channel->SetWriteCallback(std::bind(&Connector::HandleWrite, this));
+            m_channel->SetErrorCallback(std::bind(&Connector::HandleError, this));
+            m_channel->OnWriting();
+        }
+        int Connector::RemoveAndResetChannel()
+        {
+            m_channel->OffAll();
+            m_channel->Remove();
+            int sockfd = m_channel->fd();
+            // 此时可能正处于channel的回调函数中，不能直接reset
+            m_loop->AddTask(std::bind(&Connector::ResetChannel, shared_from_this()));
+            return sockfd;
+        }
+        void Connector::HandleWrite()
+        {
+            LOG_TRACE_C(detail::g_clientLog) << "Connector::HandleWrite status=" << m_status;
+            if (m_status != k_Connecting)
+                return;
+
+            int sockfd = RemoveAndResetChannel();
+            if (int err = detail::GetSocketError(sockfd); err)
+            {
+                LOG_WARN << "Connector::HandleWrite - SO_ERROR = " << err << " " << detail::strerror_tl(err);
+                Retry(sockfd);
+            }
+            else if (detail::IsSelfConnect(sockfd))
+            {
+                LOG_WARN << "Connector::HandleWrite - Self connect";
+                Retry(sockfd);
+            }
+            else
+            {
+                m_status = k_Connected;
+                if (m_isConnect && m_newConnCallback)
+                    m_newConnCallback(sockfd);
+                else
+                    detail::Close(sockfd);
+            }
+        }
+        void Connector::HandleError()
+        {
+            LOG_ERROR << "Connector::HandleError status=" << m_status;
+            if (m_status == k_Connecting)
+            {
+                int sockfd = RemoveAndResetChannel();
+                int err = detail::GetSocketError(sockfd);
+                LOG_TRACE_C(detail::g_clientLog) << "SO_ERROR = " << err << " " << detail::strerror_tl(err);
+                Retry(sockfd);
+            }
+        }
+        void Connector::Retry(int sockfd)
+        {
+            detail::Close(sockfd);
+            m_status = k_Disconnected;
+            if (m_isConnect)
+            {
+                LOG_INFO_C(detail::g_clientLog) << "Connector::Retry - Retry connecting to " << m_serverAddr.ipPortString()
+                         << " in " << m_retryDelayMs << " milliseconds. ";
+                m_loop->RunAfter(m_retryDelayMs / 1000.0, detail::MakeWeakCallback(shared_from_this(), &Connector::StartInLoop));
+                m_retryDelayMs = std::min(m_retryDelayMs * 2, k_MaxRetryDelayMs);  // 指数退避
+            }
+            else
+                LOG_DEBUG_C(detail::g_clientLog) << "Connector::Retry do not connect";
+        }
+
     }  // namespace detail
 
     const char Buffer::k_CRLF[] = "\r\n";
@@ -1532,7 +2654,7 @@ namespace kurisu {
 
         void DefaultConnCallback(const std::shared_ptr<kurisu::TcpConnection>& conn)
         {
-            LOG_TRACE << conn->LocalAddr().ipPortString() << " -> "
+            LOG_TRACE_C(detail::g_connLog) << conn->LocalAddr().ipPortString() << " -> "
                       << conn->PeerAddr().ipPortString() << " is "
                       << (conn->Connected() ? "Connected" : "Disconnected");
         }
@@ -1596,73 +2718,660 @@ namespace kurisu {
 
 
     Logger::Formatter::Formatter(LogLevel level, int savedErrno, std::string_view file, int line)
-        : m_time(Timestamp::Now()), m_strm(), m_level(level), m_line(line)
+        : m_time(Timestamp::Now()), m_strm(), m_level(level), m_line(line), m_fileName(file.data()), m_fileNameSize(file.size())
     {
-        if (auto slash = file.rfind('/'); slash != std::string_view::npos)
-        {
-            file = file.substr(slash + 1);
-        }
-        m_fileName = file.data();
-        m_fileNameSize = file.size();
-
-        FormatTime();
-        this_thrd::Tid();
-        m_strm << '[' << detail::KnownLengthString(this_thrd::TidString(), this_thrd::TidStringLength()) << ']' << " ";
-        m_strm << detail::KnownLengthString(detail::LogLevelName[(int)level], 8);
+        FormatPrefix();
         if (savedErrno != 0)
             m_strm << detail::strerror_tl(savedErrno) << " (errno=" << savedErrno << ") ";
     }
-    void Logger::Formatter::FormatTime()
+    Logger::Formatter::Formatter(LogLevel level, std::string_view file, int line, KvTag)
+        : m_time(Timestamp::Now()), m_strm(), m_level(level), m_line(line), m_fileName(file.data()), m_fileNameSize(file.size()), m_isKv(true), m_kvFormat(s_kvFormat) {}
+    void Logger::Formatter::FormatPrefix()
+    {
+        UpdatePrefix();
+        m_strm.Append(detail::t_logPrefix, detail::t_logPrefixLen);
+        m_strm.Append(detail::LogLevelName[(int)m_level], 8);
+    }
+    void Logger::Formatter::FormatKvPrefix(std::string_view msg)
     {
         using namespace detail;
-        static KnownLengthString timeString(t_time, 0);
-        char* p = nullptr;
-
-        if (m_time.Sec() != t_lastSecond)
-        {
-            t_lastSecond = m_time.Sec();
-            if (!s_isLocalTimeZone)
-                p = m_time.GmLogFormat(t_time);
-            else
-                p = m_time.LocalLogFormat(t_time);
+        UpdatePrefix();
+        // 时间和tid都从缓存的前缀中复制，"[YYYY-MM-DD HH:MM:SS.uuuuuu] [  tid] "
+        bool isJson = m_kvFormat == KvFormat::k_Json;
+        std::string_view tid(this_thrd::TidString(), this_thrd::TidStringLength());
+        tid.remove_prefix(std::min(tid.find_first_not_of(' '), tid.size()));
+        std::string_view level = KvLevelName[(int)m_level];
+        char buf[128];
+        char* p = buf;
+        auto append = [&p](std::string_view str) {
+            memcpy(p, str.data(), str.size());
+            p += str.size();
+        };
+        append(isJson ? "{\"time\":\"" : "time=");
+        append(std::string_view(t_logPrefix + 1, 10));
+        *p++ = 'T';
+        append(std::string_view(t_logPrefix + 12, 15));
+        if (!s_isLocalTimeZone)
+            *p++ = 'Z';
+        append(isJson ? "\",\"tid\":" : " tid=");
+        append(tid);
+        append(isJson ? ",\"level\":\"" : " level=");
+        append(level);
+        if (isJson)
+            *p++ = '"';
+        m_strm.Append(buf, (int)(p - buf));
+        AppendKv(m_strm, m_kvFormat, "file", std::string_view(m_fileName, m_fileNameSize));
+        AppendKv(m_strm, m_kvFormat, "line", (int64_t)m_line);
+        AppendKv(m_strm, m_kvFormat, "msg", msg);
+    }
+    void Logger::Formatter::UpdatePrefix()
+    {
+        using namespace detail;
+        int64_t usecTotal = m_time.Usec();
+        int64_t sec = usecTotal / 1'000'000;
+        int usec = (int)(usecTotal - sec * 1'000'000);
+        int tid = this_thrd::Tid();
+
+        if (sec != t_lastSecond || tid != t_prefixTid || s_isLocalTimeZone != t_prefixIsLocal)
+        {
+            t_lastSecond = sec;
+            t_prefixTid = tid;
+            t_prefixIsLocal = s_isLocalTimeZone;
+            time_t seconds = (time_t)sec;
+            char* p = s_isLocalTimeZone ? fmt::format_to(t_logPrefix, FMT_COMPILE("[{:%F %T}."), fmt::localtime(seconds))
+                                        : fmt::format_to(t_logPrefix, FMT_COMPILE("[{:%F %T}."), fmt::gmtime(seconds));
+            p = fmt::format_to(p, FMT_COMPILE("{:06}] [{}] "), usec, std::string_view(this_thrd::TidString(), this_thrd::TidStringLength()));
+            t_logPrefixLen = (int)(p - t_logPrefix);
+            t_lastUsec = usec;
+        }
+        else if (usec != t_lastUsec)
+        {
+            // 只改变了的低位数字，高位相同就停下
+            char* p = t_logPrefix + k_UsecOffset + 5;
+            for (int cur = usec, last = t_lastUsec; cur != last; cur /= 10, last /= 10)
+                *p-- = (char)('0' + cur % 10);
+            t_lastUsec = usec;
         }
-
-        if (p)
-            timeString = KnownLengthString(t_time, p - t_time);
-
-        m_strm << timeString;
     }
     void Logger::Formatter::Finish()
     {
+        if (m_isKv)
+        {
+            // AppendKv给结尾留了位置
+            if (m_kvFormat == KvFormat::k_Json)
+                m_strm.Append("}\n", 2);
+            else
+                m_strm.Append("\n", 1);
+            return;
+        }
         m_strm << " - " << detail::KnownLengthString(m_fileName, m_fileNameSize) << ':' << m_line << '\n';
+        // 超过最大长度被截断时也以换行结尾
+        if (char* end = m_strm.Buffer().Index(); end[-1] != '\n')
+            end[-1] = '\n';
     }
     Logger::Logger(const std::string_view& file, int line) : m_fmt(LogLevel::INFO, 0, file, line) {}
     Logger::Logger(const std::string_view& file, int line, LogLevel level, const char* func)
         : m_fmt(level, 0, file, line) { m_fmt.m_strm << func << ' '; }
     Logger::Logger(const std::string_view& file, int line, LogLevel level) : m_fmt(level, 0, file, line) {}
+    Logger::Logger(const std::string_view& file, int line, LogLevel level, KvTag tag) : m_fmt(level, file, line, tag) {}
     Logger::Logger(const std::string_view& file, int line, bool toAbort)
         : m_fmt(toAbort ? LogLevel::FATAL : LogLevel::ERROR, errno, file, line) {}
+    namespace detail {
+        namespace {
+            // 格式化好的一条日志，所有异步的输出共用一份，最后一个用完的释放
+            struct LogRecord {
+                LogRecord(Logger::LogLevel level, uint64_t len, int refs) : refs(refs), level(level), len(len) {}
+
+                static LogRecord* Make(Logger::LogLevel level, const char* data, uint64_t len, int refs)
+                {
+                    auto record = new (malloc(sizeof(LogRecord) + len)) LogRecord(level, len, refs);
+                    memcpy(record->Data(), data, len);
+                    return record;
+                }
+                char* Data() { return (char*)(this + 1); }
+                void Release()
+                {
+                    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        free(this);
+                }
+
+                std::atomic_int refs;
+                const Logger::LogLevel level;
+                const uint64_t len;
+            };
+
+            // LogSinks中的一个输出，异步的有自己的队列和线程
+            class LogSink : uncopyable {
+            public:
+                LogSink(int id, LogSinks::OutputFunc output, const LogSinkOptions& options, LogSinks::FlushFunc flush)
+                    : m_id(id), m_output(std::move(output)), m_flush(std::move(flush)), m_options(options), m_thrd(std::bind(&LogSink::Handle, this), "LogSink")
+                {
+                    if (m_options.isAsync)
+                        m_thrd.Start();
+                }
+                // 异步的输出完积压的日志再退出
+                ~LogSink()
+                {
+                    if (!m_options.isAsync)
+                        return;
+                    {
+                        std::lock_guard locker(m_mu);
+                        m_isClosing = true;
+                    }
+                    m_notEmpty.notify_all();
+                    m_notFull.notify_all();
+                    m_thrd.Join();
+                }
+
+                int Id() const { return m_id; }
+                bool IsAsync() const { return m_options.isAsync; }
+                bool IsAccepted(Logger::LogLevel level) const { return level >= m_options.minLevel; }
+                void Output(const char* data, uint64_t len) { m_output(data, len); }
+                // 积压满了按LogOverflowPolicy处理，不要了就Release
+                void Push(LogRecord* record);
+                void Flush();
+                LogRingStats Stats();
+
+            private:
+                bool IsFull(uint64_t len) const { return m_queueBytes != 0 && m_queueBytes + len > m_options.queueBytes; }
+                // 异步的m_thrd在此函数内循环
+                void Handle();
+
+            private:
+                const int m_id;
+                const LogSinks::OutputFunc m_output;
+                const LogSinks::FlushFunc m_flush;
+                const LogSinkOptions m_options;
+                std::mutex m_mu;
+                std::condition_variable m_notEmpty;
+                std::condition_variable m_notFull;
+                std::condition_variable m_idle;  // 积压的日志都输出完了
+                std::deque<LogRecord*> m_queue;
+                uint64_t m_queueBytes = 0;
+                bool m_isBusy = false;  // m_thrd正在输出从队列中取走的日志
+                bool m_isClosing = false;
+                LogRingStats m_stats;
+                Thread m_thrd;
+            };
+
+            void LogSink::Push(LogRecord* record)
+            {
+                std::unique_lock locker(m_mu);
+                uint64_t len = record->len;
+                std::vector<LogRecord*> dropped;
+                if (IsFull(len))
+                {
+                    auto isReady = [this, len] { return !IsFull(len) || m_isClosing; };
+                    const LogOverflowPolicy& policy = m_options.policy;
+                    switch (policy.kind)
+                    {
+                        case LogOverflowPolicy::k_Block:
+                            if (policy.blockSeconds > 0)
+                                m_notFull.wait_for(locker, std::chrono::duration<double>(policy.blockSeconds), isReady);
+                            else
+                                m_notFull.wait(locker, isReady);
+                            break;
+                        case LogOverflowPolicy::k_DropNewest: break;
+                        case LogOverflowPolicy::k_DropOldest:
+                            while (IsFull(len))
+                            {
+                                dropped.push_back(m_queue.front());
+                                m_queueBytes -= m_queue.front()->len;
+                                m_queue.pop_front();
+                            }
+                            break;
+                        case LogOverflowPolicy::k_DropBelowLevel:
+                            if (record->level >= policy.keepLevel)
+                                m_notFull.wait(locker, isReady);
+                            break;
+                    }
+                }
+                if (IsFull(len) || m_isClosing)
+                    dropped.push_back(record);
+                else
+                {
+                    bool isEmpty = m_queue.empty();
+                    m_queue.push_back(record);
+                    m_queueBytes += len;
+                    m_stats.highWatermark = std::max(m_stats.highWatermark, m_queueBytes);
+                    if (isEmpty)
+                        m_notEmpty.notify_one();
+                }
+                for (auto&& item : dropped)
+                {
+                    m_stats.droppedLines++;
+                    m_stats.droppedBytes += item->len;
+                }
+                locker.unlock();
+                for (auto&& item : dropped)
+                    item->Release();
+            }
+            void LogSink::Flush()
+            {
+                if (m_options.isAsync)
+                {
+                    // 拿着锁调用flush，这期间m_thrd不会输出
+                    std::unique_lock locker(m_mu);
+                    m_idle.wait(locker, [this] { return (m_queue.empty() && !m_isBusy) || m_isClosing; });
+                    if (m_flush)
+                        m_flush();
+                }
+                else if (m_flush)
+                    m_flush();
+            }
+            LogRingStats LogSink::Stats()
+            {
+                std::lock_guard locker(m_mu);
+                LogRingStats stats = m_stats;
+                stats.ringCapacity = m_options.queueBytes;
+                return stats;
+            }
+            void LogSink::Handle()
+            {
+                std::deque<LogRecord*> records;
+                while (true)
+                {
+                    {
+                        std::unique_lock locker(m_mu);
+                        m_isBusy = false;
+                        if (m_queue.empty())
+                            m_idle.notify_all();
+                        m_notEmpty.wait(locker, [this] { return !m_queue.empty() || m_isClosing; });
+                        if (m_queue.empty())
+                            return;
+                        records.swap(m_queue);
+                        m_queueBytes = 0;
+                        m_isBusy = true;
+                    }
+                    m_notFull.notify_all();
+                    for (auto&& record : records)
+                    {
+                        t_outputLevel = record->level;
+                        m_output(record->Data(), record->len);
+                        record->Release();
+                    }
+                    t_outputLevel = Logger::LogLevel::INFO;
+                    records.clear();
+                }
+            }
+
+            using LogSinkList = std::vector<std::shared_ptr<LogSink>>;
+            // 写日志的线程拿一份列表的快照，Add、Remove换一个新列表
+            struct LogSinkRegistry {
+                std::mutex mu;
+                std::shared_ptr<const LogSinkList> sinks = std::make_shared<const LogSinkList>();
+                int nextId = 1;
+            };
+            LogSinkRegistry& GetLogSinkRegistry()
+            {
+                static LogSinkRegistry registry;
+                return registry;
+            }
+            std::atomic_bool g_hasSinks = false;
+
+            void OutputToSinks(Logger::LogLevel level, const char* data, uint64_t len)
+            {
+                std::shared_ptr<const LogSinkList> sinks = std::atomic_load(&GetLogSinkRegistry().sinks);
+                int asyncNum = 0;
+                for (auto&& sink : *sinks)
+                    if (sink->IsAsync() && sink->IsAccepted(level))
+                        asyncNum++;
+                LogRecord* record = asyncNum != 0 ? LogRecord::Make(level, data, len, asyncNum) : nullptr;
+                for (auto&& sink : *sinks)
+                {
+                    if (!sink->IsAccepted(level))
+                        continue;
+                    if (sink->IsAsync())
+                        sink->Push(record);
+                    else
+                        sink->Output(data, len);
+                }
+            }
+        }  // namespace
+    }  // namespace detail
+
+    int LogSinks::Add(OutputFunc output, const LogSinkOptions& options, FlushFunc flush)
+    {
+        auto& registry = detail::GetLogSinkRegistry();
+        std::lock_guard locker(registry.mu);
+        int id = registry.nextId++;
+        auto sinks = std::make_shared<detail::LogSinkList>(*registry.sinks);
+        sinks->push_back(std::make_shared<detail::LogSink>(id, std::move(output), options, std::move(flush)));
+        std::atomic_store(&registry.sinks, std::shared_ptr<const detail::LogSinkList>(std::move(sinks)));
+        detail::g_hasSinks.store(true, std::memory_order_release);
+        return id;
+    }
+    void LogSinks::Remove(int id)
+    {
+        auto& registry = detail::GetLogSinkRegistry();
+        std::shared_ptr<detail::LogSink> removed;
+        {
+            std::lock_guard locker(registry.mu);
+            auto sinks = std::make_shared<detail::LogSinkList>();
+            for (auto&& sink : *registry.sinks)
+            {
+                if (sink->Id() == id)
+                    removed = sink;
+                else
+                    sinks->push_back(sink);
+            }
+            if (!removed)
+                return;
+            detail::g_hasSinks.store(!sinks->empty(), std::memory_order_release);
+            std::atomic_store(&registry.sinks, std::shared_ptr<const detail::LogSinkList>(std::move(sinks)));
+        }
+        // 每份还在用的旧列表都持有它，等写日志的线程放下快照
+        while (removed.use_count() > 1)
+            std::this_thread::yield();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        removed.reset();
+    }
+    void LogSinks::Flush()
+    {
+        auto sinks = std::atomic_load(&detail::GetLogSinkRegistry().sinks);
+        for (auto&& sink : *sinks)
+            sink->Flush();
+    }
+    LogRingStats LogSinks::Stats(int id)
+    {
+        auto sinks = std::atomic_load(&detail::GetLogSinkRegistry().sinks);
+        for (auto&& sink : *sinks)
+            if (sink->Id() == id)
+                return sink->Stats();
+        return LogRingStats();
+    }
+
     Logger::~Logger()
     {
         using namespace std::chrono;
         m_fmt.Finish();
 
-        const detail::LogStream::FixedBuf& buf(Stream().Buffer());
+        const detail::LogStream::Buf& buf(Stream().Buffer());
+        bool hasSinks = detail::g_hasSinks.load(std::memory_order_acquire);
 
-        detail::g_output(buf.Data(), buf.Size());
+        detail::t_outputLevel = m_fmt.m_level;
+        if (hasSinks)
+            detail::OutputToSinks(m_fmt.m_level, buf.Data(), buf.Size());
+        else
+            detail::g_output(buf.Data(), buf.Size());
+        detail::t_outputLevel = LogLevel::INFO;
 
         if (m_fmt.m_level == LogLevel::FATAL)
         {
-            detail::g_flush();
+            if (hasSinks)
+                LogSinks::Flush();
+            else
+                detail::g_flush();
             abort();
         }
     }
-    Logger::LogLevel Logger::Level() { return detail::g_logLevel; }
     void Logger::SetOutput(void (*out)(const char* msg, const uint64_t len)) { detail::g_output = out; }
     void Logger::SetFlush(void (*flush)()) { detail::g_flush = flush; }
+    Logger::LogLevel Logger::OutputLevel() { return detail::t_outputLevel; }
+    void Logger::SetLevel(LogLevel level)
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        registry.level = level;
+        detail::g_logLevel.store(level, std::memory_order_relaxed);
+        for (auto&& category : registry.categories)
+            if (!category->m_isExplicit)
+                category->m_level.store(level, std::memory_order_relaxed);
+    }
 
+    namespace detail {
+        namespace {
+            // 限流只需要毫秒级的精度，粗粒度的时钟便宜得多
+            int64_t CoarseNowNs()
+            {
+                timespec ts;
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+                return (int64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
+            }
+        }  // namespace
 
+        uint64_t LogEverySeconds::Check()
+        {
+            int64_t now = CoarseNowNs();
+            int64_t next = m_nextNs.load(std::memory_order_relaxed);
+            // CAS失败说明别的线程刚写了一条
+            if (now < next || !m_nextNs.compare_exchange_strong(next, now + m_intervalNs, std::memory_order_relaxed))
+            {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return k_LogDenied;
+            }
+            return m_suppressed.exchange(0, std::memory_order_relaxed);
+        }
+        LogRateLimit::LogRateLimit(double perSecond, double burst)
+            : m_intervalNs((int64_t)(1e9 / (perSecond > 0 ? perSecond : 1e-9))),
+              m_toleranceNs((int64_t)((double)m_intervalNs * (burst > 1 ? burst - 1 : 0))) {}
+        uint64_t LogRateLimit::Check()
+        {
+            int64_t now = CoarseNowNs();
+            int64_t tat = m_tatNs.load(std::memory_order_relaxed);
+            int64_t newTat;
+            do
+            {
+                int64_t base = std::max(tat, now);
+                if (base - now > m_toleranceNs)  // 桶里没有令牌了
+                {
+                    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return k_LogDenied;
+                }
+                newTat = base + m_intervalNs;
+            } while (!m_tatNs.compare_exchange_weak(tat, newTat, std::memory_order_relaxed));
+            return m_suppressed.exchange(0, std::memory_order_relaxed);
+        }
+    }  // namespace detail
+
+    LogCategory::LogCategory(const char* name) : m_name(name)
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        m_level.store(registry.level, std::memory_order_relaxed);
+        registry.categories.emplace_back(this);
+    }
+    LogCategory::~LogCategory()
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        registry.categories.erase(std::find(registry.categories.begin(), registry.categories.end(), this));
+    }
+    void LogCategory::SetLevel(Logger::LogLevel level)
+    {
+        std::lock_guard locker(detail::GetLogCategoryRegistry().mu);
+        m_isExplicit = true;
+        m_level.store(level, std::memory_order_relaxed);
+    }
+    void LogCategory::ResetLevel()
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        m_isExplicit = false;
+        m_level.store(registry.level, std::memory_order_relaxed);
+    }
+    int LogCategory::SetLevel(std::string_view pattern, Logger::LogLevel level)
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        int num = 0;
+        for (auto&& category : registry.categories)
+            if (detail::MatchCategory(pattern, category->m_name))
+            {
+                category->m_isExplicit = true;
+                category->m_level.store(level, std::memory_order_relaxed);
+                num++;
+            }
+        return num;
+    }
+    std::vector<std::pair<std::string, Logger::LogLevel>> LogCategory::List()
+    {
+        auto& registry = detail::GetLogCategoryRegistry();
+        std::lock_guard locker(registry.mu);
+        std::vector<std::pair<std::string, Logger::LogLevel>> res;
+        res.reserve(registry.categories.size());
+        for (auto&& category : registry.categories)
+            res.emplace_back(category->m_name, category->Level());
+        return res;
+    }
+
+
+
+    namespace detail {
+        LogFileArchiver::LogFileArchiver(const std::string& basename, const LogFileOptions& options)
+            : m_dir([&basename] {
+                  auto pos = basename.rfind('/');
+                  return pos == std::string::npos ? std::string(".") : (pos == 0 ? std::string("/") : basename.substr(0, pos));
+              }()),
+              m_prefix(basename.substr(basename.rfind('/') + 1) + '.'),
+              m_options(options),
+              m_thrd(std::bind(&LogFileArchiver::Handle, this), "Log Archiver")
+        {
+#ifndef KURISU_WITH_ZLIB
+            if (m_options.isCompress)
+                fprintf(stderr, "LogFileArchiver: kurisu is built without KURISU_WITH_ZLIB, rolled log files are not compressed\n");
+#endif
+            m_thrd.Start();
+        }
+        LogFileArchiver::~LogFileArchiver()
+        {
+            {
+                std::lock_guard locker(m_mu);
+                m_isStopping = true;
+            }
+            m_cond.notify_one();
+            m_thrd.Join();
+        }
+        void LogFileArchiver::Add(const std::string& closedFile, const std::string& activeFile)
+        {
+            {
+                std::lock_guard locker(m_mu);
+                m_closedFiles.push_back(closedFile);
+                m_activeFile = activeFile;
+            }
+            m_cond.notify_one();
+        }
+        void LogFileArchiver::Handle()
+        {
+            setpriority(PRIO_PROCESS, this_thrd::Tid(), 19);  // 不和干活的线程抢CPU
+            while (true)
+            {
+                std::string closedFile;
+                std::string activeFile;
+                {
+                    std::unique_lock locker(m_mu);
+                    m_cond.wait(locker, [this] { return m_isStopping || !m_closedFiles.empty(); });
+                    if (m_closedFiles.empty())
+                        return;
+                    closedFile = std::move(m_closedFiles.front());
+                    m_closedFiles.pop_front();
+                    activeFile = m_activeFile;
+                }
+                if (m_options.isCompress)
+                    Compress(closedFile);
+                Retain(activeFile);
+            }
+        }
+        void LogFileArchiver::Compress(const std::string& filename)
+        {
+#ifdef KURISU_WITH_ZLIB
+            // 先写临时文件，写完再改名，中途退出不会留下不完整的.gz
+            std::string gzName = filename + ".gz";
+            std::string tmpName = gzName + ".tmp";
+            FILE* in = fopen(filename.c_str(), "re");
+            if (in == NULL)
+                return;
+            gzFile out = gzopen(tmpName.c_str(), "wb");
+            bool ok = out != NULL;
+            const uint64_t k_ChunkSize = 256 * 1024;
+            std::unique_ptr<char[]> buf(new char[k_ChunkSize]);
+            while (ok)
+            {
+                uint64_t n = fread(buf.get(), 1, k_ChunkSize, in);
+                if (n == 0)
+                    break;
+                ok = gzwrite(out, buf.get(), (unsigned)n) == (int)n;
+            }
+            ok = ok && !ferror(in);
+            fclose(in);
+            if (out != NULL && gzclose(out) != Z_OK)
+                ok = false;
+
+            if (ok && rename(tmpName.c_str(), gzName.c_str()) == 0)
+                unlink(filename.c_str());
+            else
+            {
+                fprintf(stderr, "LogFileArchiver compress %s failed\n", filename.c_str());
+                unlink(tmpName.c_str());
+            }
+#endif
+        }
+        void LogFileArchiver::Retain(const std::string& activeFile)
+        {
+            if (m_options.maxFiles <= 0 && m_options.maxTotalBytes == 0)
+                return;
+            DIR* dir = opendir(m_dir.c_str());
+            if (dir == NULL)
+                return;
+
+            // roll出来的文件名是 前缀.时间.主机名.pid.log，跳过正在写的和提前打开的
+            std::string_view activeName = std::string_view(activeFile).substr(activeFile.rfind('/') + 1);
+            auto endsWith = [](std::string_view name, std::string_view suffix) {
+                return name.size() >= suffix.size() && name.substr(name.size() - suffix.size()) == suffix;
+            };
+            std::vector<std::pair<std::string, uint64_t>> files;  // 路径与大小
+            while (dirent* ent = readdir(dir))
+            {
+                std::string_view name(ent->d_name);
+                if (name.size() <= m_prefix.size() || name.substr(0, m_prefix.size()) != m_prefix || !isdigit(name[m_prefix.size()]) || name == activeName)
+                    continue;
+                if (!endsWith(name, ".log") && !endsWith(name, ".log.gz"))
+                    continue;
+                std::string path = m_dir + '/' + std::string(name);
+                struct stat st;
+                if (stat(path.c_str(), &st) == 0)
+                    files.emplace_back(std::move(path), (uint64_t)st.st_size);
+            }
+            closedir(dir);
+
+            // 文件名中的时间可以直接按字典序比较，从新到旧
+            std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+            uint64_t totalBytes = 0;
+            for (int i = 0; i < (int)files.size(); i++)
+            {
+                totalBytes += files[i].second;
+                if ((m_options.maxFiles > 0 && i >= m_options.maxFiles) || (m_options.maxTotalBytes != 0 && totalBytes > m_options.maxTotalBytes))
+                    unlink(files[i].first.c_str());
+            }
+        }
+    }  // namespace detail
 
+    SyncLogFile::SyncLogFile(const std::string& filename, uint64_t rollSize, bool isLocalTimeZone, bool threadSafe, int flushInterval, int checkEveryN,
+                             const LogFileOptions& options)
+        : m_filename(filename),
+          k_RollSize(rollSize),
+          k_FlushInterval(flushInterval),
+          k_CheckEveryN(checkEveryN),
+          m_options(options),
+          m_isLocalTimeZone(isLocalTimeZone),
+          m_mu(threadSafe ? std::make_unique<std::mutex>() : NULL),
+          m_fileSuffix(fmt::format(".{}.{}.log", process::HostName(), process::Pid())),
+          m_nextName(filename + ".next" + m_fileSuffix)
+    {
+        if (options.isCompress || options.maxFiles > 0 || options.maxTotalBytes != 0)
+            m_archiver = std::make_unique<detail::LogFileArchiver>(filename, options);
+        Roll();
+    }
+    SyncLogFile::~SyncLogFile()
+    {
+        // 提前打开了但没用上的文件
+        if (m_nextAppender || m_nextDirectAppender)
+        {
+            m_nextAppender.reset();
+            m_nextDirectAppender.reset();
+            unlink(m_nextName.c_str());
+        }
+    }
     void SyncLogFile::Append(const char* logline, uint64_t len)
     {
         if (m_mu)
@@ -1678,8 +3387,15 @@ namespace kurisu {
         if (m_mu)
         {
             std::lock_guard locker(*m_mu);
-            m_appender->Flush();
+            FlushUnlocked();
         }
+        else
+            FlushUnlocked();
+    }
+    void SyncLogFile::FlushUnlocked()
+    {
+        if (m_directAppender)
+            m_directAppender->Flush();
         else
             m_appender->Flush();
     }
@@ -1697,11 +3413,62 @@ namespace kurisu {
             m_lastRoll = now;
             m_lastFlush = now;
             m_day = day;
-            m_appender.reset(new detail::LogFileAppender(filename));
+            OpenNext(filename);
+            std::string closedFile = std::move(m_currentName);
+            m_currentName = std::move(filename);
+            if (m_archiver && !closedFile.empty())
+                m_archiver->Add(closedFile, m_currentName);
             return true;
         }
         return false;
     }
+    void SyncLogFile::OpenNext(const std::string& filename)
+    {
+        // 有提前打开好的就只改个名字
+        bool isPrepared = (m_nextAppender || m_nextDirectAppender) && rename(m_nextName.c_str(), filename.c_str()) == 0;
+        if (m_options.isDirect)
+        {
+            m_directAppender.reset();  // 先关掉旧文件
+            if (isPrepared)
+                m_directAppender = std::move(m_nextDirectAppender);
+            else
+                m_directAppender.reset(new detail::DirectLogFileAppender(filename, m_options.isPreallocate ? k_RollSize : 0, m_options.syncBytes));
+        }
+        else
+        {
+            m_appender.reset();
+            if (isPrepared)
+                m_appender = std::move(m_nextAppender);
+            else
+                m_appender.reset(new detail::LogFileAppender(filename));
+        }
+    }
+    void SyncLogFile::PrepareNext()
+    {
+        if (!m_options.isPreopen)
+            return;
+        std::unique_lock<std::mutex> locker;
+        if (m_mu)
+            locker = std::unique_lock(*m_mu);
+        if (m_nextAppender || m_nextDirectAppender)
+            return;
+        if (locker.owns_lock())
+            locker.unlock();
+
+        // 在锁外打开，不挡住写日志的线程
+        std::unique_ptr<detail::LogFileAppender> appender;
+        std::unique_ptr<detail::DirectLogFileAppender> directAppender;
+        unlink(m_nextName.c_str());
+        if (m_options.isDirect)
+            directAppender.reset(new detail::DirectLogFileAppender(m_nextName, m_options.isPreallocate ? k_RollSize : 0, m_options.syncBytes));
+        else
+            appender.reset(new detail::LogFileAppender(m_nextName));
+
+        if (m_mu)
+            locker.lock();
+        m_nextAppender = std::move(appender);
+        m_nextDirectAppender = std::move(directAppender);
+    }
     std::string SyncLogFile::MakeLogFileName(const std::string& basename, const Timestamp& timestamp)
     {
         std::string filename;
@@ -1714,19 +3481,24 @@ namespace kurisu {
         else
             filename += timestamp.LocalFormatString();
 
-        filename += '.';
-        filename += process::HostName();
-
-        filename += fmt::format(".{}", process::Pid());
-
-        filename += ".log";
+        filename += m_fileSuffix;
         return filename;
     }
     void SyncLogFile::AppendUnlocked(const char* logline, const uint64_t len)
     {
-        m_appender->Append(logline, len);
+        uint64_t writtenBytes;
+        if (m_directAppender)
+        {
+            m_directAppender->Append(logline, len);
+            writtenBytes = m_directAppender->WrittenBytes();
+        }
+        else
+        {
+            m_appender->Append(logline, len);
+            writtenBytes = m_appender->WrittenBytes();
+        }
 
-        if (m_appender->WrittenBytes() > (uint64_t)k_RollSize)  // 如果写入的大小>rollSize就roll
+        if (writtenBytes > (uint64_t)k_RollSize)  // 如果写入的大小>rollSize就roll
             Roll();
         else if (++m_count >= k_CheckEveryN)
         {
@@ -1738,25 +3510,309 @@ namespace kurisu {
             else if (now - m_lastFlush > (time_t)k_FlushInterval)  // 没过0点就flush
             {
                 m_lastFlush = now;
-                m_appender->Flush();
+                FlushUnlocked();
             }
         }
     }
 
 
 
-    AsyncLogFile::AsyncLogFile(const std::string& basename, int64_t rollSize, bool localTimeZone, int flushInterval)
+    namespace detail {
+        namespace {
+            uint64_t RoundUpPowerOf2(uint64_t n)
+            {
+                uint64_t res = 1;
+                while (res < n)
+                    res <<= 1;
+                return res;
+            }
+        }  // namespace
+
+        LogRing::LogRing(uint64_t capacity, bool isDropOldest)
+            : m_mask(RoundUpPowerOf2(capacity) - 1), m_isDropOldest(isDropOldest), m_buf(new char[m_mask + 1]) {}
+        bool LogRing::TryPush(const char* logline, uint64_t len, int64_t time)
+        {
+            uint64_t size = (sizeof(Header) + len + 15) & ~(uint64_t)15;
+            uint64_t tail = m_tail.load(std::memory_order_relaxed);
+            uint64_t offset = tail & m_mask;
+            uint64_t toEnd = Capacity() - offset;
+            uint64_t need = (size <= toEnd) ? size : toEnd + size;  // 尾部放不下要先填充
+            if (need > Capacity())
+                return false;
+            if (tail + need - m_cachedHead > Capacity())
+            {
+                m_cachedHead = m_head.load(std::memory_order_acquire);
+                if (tail + need - m_cachedHead > Capacity())
+                    return false;
+            }
+
+            if (size > toEnd)
+            {
+                Header* padding = (Header*)(m_buf.get() + offset);
+                padding->len = k_Padding;
+                padding->size = (uint32_t)toEnd;
+                tail += toEnd;
+                offset = 0;
+            }
+            Header* header = (Header*)(m_buf.get() + offset);
+            header->len = (uint32_t)len;
+            header->size = (uint32_t)size;
+            header->time = time;
+            memcpy(header + 1, logline, len);
+            m_tail.store(tail + size, std::memory_order_release);
+            return true;
+        }
+        uint32_t LogRing::DropFront()
+        {
+            // 记录都是生产者自己写的，读记录头不会和别人冲突
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            if (head == m_tail.load(std::memory_order_relaxed))
+                return k_Padding;
+            const Header* header = (const Header*)(m_buf.get() + (head & m_mask));
+            uint32_t len = header->len;
+            if (!m_head.compare_exchange_strong(head, head + header->size, std::memory_order_acq_rel))
+                return k_Padding;  // 消费者刚好读走了
+            m_cachedHead = head + header->size;
+            return len;
+        }
+        const LogRing::Header* LogRing::Front()
+        {
+            while (true)
+            {
+                uint64_t head = m_head.load(m_isDropOldest ? std::memory_order_acquire : std::memory_order_relaxed);
+                if (head >= m_readLimit)
+                    return nullptr;
+                const Header* header = (const Header*)(m_buf.get() + (head & m_mask));
+                if (header->len != k_Padding)
+                    return header;
+                // 跳过填充
+                if (!m_isDropOldest)
+                    m_head.store(head + header->size, std::memory_order_release);
+                else
+                    m_head.compare_exchange_strong(head, head + header->size, std::memory_order_acq_rel);
+            }
+        }
+        bool LogRing::CopyAndPopFront(const Header* header, std::vector<uint64_t>* out)
+        {
+            // 生产者随时可能丢掉这条并覆盖它，先复制，再用CAS确认复制期间它还在
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            if (header != (const Header*)(m_buf.get() + (head & m_mask)))
+                return false;
+            Header copy;
+            memcpy(&copy, header, sizeof(Header));
+            uint64_t offset = head & m_mask;
+            uint64_t size = std::min<uint64_t>(copy.size, Capacity() - offset);  // 被覆盖时可能是任意值
+            out->resize((size + 7) / 8 + 1);
+            memcpy(out->data(), header, size);
+            if (size < sizeof(Header) || !m_head.compare_exchange_strong(head, head + copy.size, std::memory_order_acq_rel))
+                return false;
+            ((Header*)out->data())->len = std::min<uint32_t>(copy.len, (uint32_t)(size - sizeof(Header)));
+            return true;
+        }
+
+        namespace {
+            // 线程退出时把自己的LogRing标记为可以回收
+            struct LogRingCache {
+                ~LogRingCache()
+                {
+                    for (auto&& item : rings)
+                        item.second->isAbandoned = true;
+                }
+                std::vector<std::pair<uint64_t, std::shared_ptr<LogRing>>> rings;  // LogRingSet的id与对应的LogRing
+            };
+            thread_local LogRingCache t_logRingCache;
+        }  // namespace
+
+        std::atomic_uint64_t LogRingSet::s_createdNum = 0;
+        LogRingSet::LogRingSet(uint64_t ringSize, const LogOverflowPolicy& policy) : m_ringSize(ringSize), m_id(++s_createdNum), m_policy(policy)
+        {
+            using namespace std::chrono;
+            m_baseTicks = Ticks();
+            m_baseSteadyNs = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+            m_baseRealNs = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+            // 先粗略校准一次，之后每次Drain会用更长的时间跨度校准
+            while (duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count() - m_baseSteadyNs < 100000)
+                ;
+            Calibrate();
+        }
+        void LogRingSet::Calibrate()
+        {
+            int64_t ticks = Ticks();
+            int64_t steady = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            if (ticks > m_baseTicks && steady > m_baseSteadyNs)
+                m_nsPerTick = double(steady - m_baseSteadyNs) / double(ticks - m_baseTicks);
+        }
+        LogRing* LogRingSet::ThreadRing()
+        {
+            auto& rings = t_logRingCache.rings;
+            for (auto&& item : rings)
+                if (item.first == m_id)
+                    return item.second.get();
+
+            // 这个线程第一次往这里写日志
+            auto ring = std::make_shared<LogRing>(m_ringSize, m_policy.kind == LogOverflowPolicy::k_DropOldest);
+            {
+                std::lock_guard locker(m_ringsMu);
+                m_rings.emplace_back(ring);
+            }
+            rings.emplace_back(m_id, ring);
+            return ring.get();
+        }
+        void LogRingSet::Push(const char* data, uint64_t len, Logger::LogLevel level)
+        {
+            LogRing* ring = ThreadRing();
+            uint64_t half = ring->Capacity() / 2;
+            // 超过一半容量的日志就算腾空了也不一定放得下
+            if (m_isClosed.load(std::memory_order_relaxed) || sizeof(LogRing::Header) + len + 15 > half)
+            {
+                CountDropped(len);
+                return;
+            }
+            int64_t now = Ticks();
+            uint64_t usedBefore = ring->Used();
+            if (!ring->TryPush(data, len, now) && !PushFull(ring, data, len, now, level))
+            {
+                CountDropped(len);
+                return;
+            }
+            if (usedBefore < half && ring->Used() >= half)  // 刚过半就叫醒后台线程，不用等到满
+                m_wakeCond.notify_one();
+        }
+        bool LogRingSet::PushFull(LogRing* ring, const char* data, uint64_t len, int64_t time, Logger::LogLevel level)
+        {
+            using namespace std::chrono;
+            UpdateHighWatermark(ring->Capacity());
+            m_wakeCond.notify_one();
+            switch (m_policy.kind)
+            {
+                case LogOverflowPolicy::k_DropNewest:
+                    return false;
+                case LogOverflowPolicy::k_DropOldest:
+                    do
+                    {
+                        if (uint32_t droppedLen = ring->DropFront(); droppedLen != LogRing::k_Padding)
+                            CountDropped(droppedLen);
+                        else if (ring->Used() == 0)
+                            return false;
+                    } while (!ring->TryPush(data, len, time));
+                    return true;
+                case LogOverflowPolicy::k_DropBelowLevel:
+                    if (level < m_policy.keepLevel)
+                        return false;
+                    break;
+                default:
+                    break;
+            }
+
+            // 等后台线程腾出空间，后台线程自己写日志时不能等自己
+            bool hasDeadline = m_policy.kind == LogOverflowPolicy::k_Block && m_policy.blockSeconds > 0;
+            auto deadline = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(m_policy.blockSeconds));
+            do
+            {
+                if (m_isClosed.load(std::memory_order_relaxed) || this_thrd::Tid() == m_consumerTid.load(std::memory_order_relaxed))
+                    return false;
+                if (hasDeadline && steady_clock::now() >= deadline)
+                    return false;
+                std::this_thread::yield();
+                m_wakeCond.notify_one();
+            } while (!ring->TryPush(data, len, time));
+            return true;
+        }
+        void LogRingSet::CountDropped(uint64_t len)
+        {
+            m_droppedLines.fetch_add(1, std::memory_order_relaxed);
+            m_droppedBytes.fetch_add(len, std::memory_order_relaxed);
+        }
+        void LogRingSet::UpdateHighWatermark(uint64_t used)
+        {
+            uint64_t cur = m_highWatermark.load(std::memory_order_relaxed);
+            while (used > cur && !m_highWatermark.compare_exchange_weak(cur, used, std::memory_order_relaxed))
+                ;
+        }
+        LogRingStats LogRingSet::Stats() const
+        {
+            LogRingStats stats;
+            stats.droppedLines = m_droppedLines.load(std::memory_order_relaxed);
+            stats.droppedBytes = m_droppedBytes.load(std::memory_order_relaxed);
+            stats.highWatermark = m_highWatermark.load(std::memory_order_relaxed);
+            stats.ringCapacity = RoundUpPowerOf2(m_ringSize);
+            return stats;
+        }
+        void LogRingSet::Wait(int seconds)
+        {
+            m_consumerTid.store(this_thrd::Tid(), std::memory_order_relaxed);
+            std::unique_lock locker(m_wakeMu);
+            if (!m_isClosed)
+                m_wakeCond.wait_for(locker, std::chrono::seconds(seconds));
+        }
+        void LogRingSet::Close()
+        {
+            std::lock_guard locker(m_wakeMu);
+            m_isClosed = true;
+            m_wakeCond.notify_all();
+        }
+        void LogRingSet::Drain(const std::function<void(const LogRing::Header*)>& func)
+        {
+            Calibrate();
+            std::vector<std::shared_ptr<LogRing>> rings;
+            {
+                std::lock_guard locker(m_ringsMu);
+                // 线程已经退出并且读完了的LogRing可以丢掉
+                m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(), [](const std::shared_ptr<LogRing>& ring) {
+                                  return ring->isAbandoned && ring->Used() == 0;
+                              }),
+                              m_rings.end());
+                rings = m_rings;
+            }
+
+            // 多路归并，每次取时间戳最小的一条，同一个LogRing内本来就是有序的
+            using Item = std::pair<int64_t, LogRing*>;
+            std::vector<Item> heap;
+            heap.reserve(rings.size());
+            for (auto&& ring : rings)
+            {
+                ring->Snapshot();
+                UpdateHighWatermark(ring->Used());
+                if (auto header = ring->Front(); header)
+                    heap.emplace_back(header->time, ring.get());
+            }
+            auto cmp = [](const Item& a, const Item& b) { return a.first > b.first; };
+            std::make_heap(heap.begin(), heap.end(), cmp);
+            while (!heap.empty())
+            {
+                std::pop_heap(heap.begin(), heap.end(), cmp);
+                LogRing* ring = heap.back().second;
+                heap.pop_back();
+
+                // k_DropOldest时这期间生产者可能丢掉了它，要先复制出来
+                if (auto header = ring->Front(); !header)
+                    continue;
+                else if (m_policy.kind != LogOverflowPolicy::k_DropOldest)
+                {
+                    func(header);
+                    ring->PopFront(header);
+                }
+                else if (ring->CopyAndPopFront(header, &m_copyBuf))
+                    func((const LogRing::Header*)m_copyBuf.data());
+                if (auto next = ring->Front(); next)
+                {
+                    heap.emplace_back(next->time, ring);
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+    }  // namespace detail
+
+    AsyncLogFile::AsyncLogFile(const std::string& basename, int64_t rollSize, bool localTimeZone, int flushInterval, uint64_t ringSize,
+                               const LogOverflowPolicy& policy, const LogFileOptions& fileOptions)
         : k_flushInterval(flushInterval),
           m_isLocalTimeZone(localTimeZone),
           m_fileName(basename),
           m_rollSize(rollSize),
-          m_thrd(std::bind(&AsyncLogFile::Handle, this), "Async Logger"),
-          m_thisBuf(std::make_unique<FixedBuf>()),
-          m_nextBuf(std::make_unique<FixedBuf>())
+          m_fileOptions(fileOptions),
+          m_rings(ringSize, policy),
+          m_thrd(std::bind(&AsyncLogFile::Handle, this), "Async Logger")
     {
-        m_thisBuf->Zero();
-        m_nextBuf->Zero();
-        m_bufs.reserve(16);
         Logger::SetTimeZone(m_isLocalTimeZone);
 
         m_isRunning = true;
@@ -1768,125 +3824,486 @@ namespace kurisu {
         if (m_isRunning)
             Stop();
     }
-    void AsyncLogFile::Append(const char* logline, uint64_t len)
-    {
-        std::lock_guard locker(m_mu);
-        if (m_thisBuf->AvalibleSize() > len)  // 没满
-            m_thisBuf->Append(logline, len);
-        else  // 满了
-        {
-            m_bufs.push_back(std::move(m_thisBuf));  // 将此buf加入待输出的队列
-
-            if (m_nextBuf)
-                m_thisBuf = std::move(m_nextBuf);  // 拿下一个空的buf
-            else
-                m_thisBuf.reset(new FixedBuf);  // 没有空buf了就创建一个新的，但几乎不会发生
-
-            m_thisBuf->Append(logline, len);
-            m_fullCond.notify_one();  // 通知其他线程，buf满了
-        }
-    }
+    void AsyncLogFile::Append(const char* logline, uint64_t len) { m_rings.Push(logline, len, Logger::OutputLevel()); }
     void AsyncLogFile::Stop()
     {
         m_isRunning = false;
-        m_fullCond.notify_one();
+        m_rings.Close();
         m_thrd.Join();
     }
     void AsyncLogFile::Handle()
     {
         m_latch.CountDown();
-        SyncLogFile logFile(m_fileName, m_rollSize, m_isLocalTimeZone, false);
-
-        // 准备两个空的Buf
-        BufPtr newBuf1(new FixedBuf);
-        BufPtr newBuf2(new FixedBuf);
-        newBuf1->Zero();
-        newBuf2->Zero();
+        SyncLogFile logFile(m_fileName, m_rollSize, m_isLocalTimeZone, false, k_flushInterval, 1024, m_fileOptions);
+        auto write = [&logFile](const detail::LogRing::Header* header) { logFile.Append((const char*)(header + 1), header->len); };
+        // 丢过日志就在文件中写一行说明
+        auto report = [this, &logFile] {
+            LogRingStats stats = m_rings.Stats();
+            if (stats.droppedLines == m_reportedDropped)
+                return;
+            Timestamp now;
+            std::string line = fmt::format("[{}] AsyncLogFile dropped {} lines ({} bytes in total), LogRing capacity {} bytes\n",
+                                           m_isLocalTimeZone ? now.LocalFormatString() : now.GmFormatString(),
+                                           stats.droppedLines - m_reportedDropped, stats.droppedBytes, stats.ringCapacity);
+            logFile.Append(line.data(), line.size());
+            m_reportedDropped = stats.droppedLines;
+        };
 
-        BufVector bufVec;  // 空Buf
-        bufVec.reserve(16);
         while (m_isRunning)
         {
-            {
-                std::unique_lock locker(m_mu);
-                // 经常发生的情况
-                if (m_bufs.empty())
-                    m_fullCond.wait_for(locker, std::chrono::seconds(k_flushInterval));  // 等满的信号，最多等m_flushInterval秒
+            m_rings.Wait(k_flushInterval);  // 等有LogRing过半的信号，最多等k_flushInterval秒
+            m_rings.Drain(write);
+            report();
+            logFile.Flush();
+            logFile.PrepareNext();
+        }
+        // 把剩下的写完
+        m_rings.Drain(write);
+        report();
+        logFile.Flush();
+    }
 
-                m_bufs.push_back(std::move(m_thisBuf));  // 将当前buf加入待输出的队列
-                m_thisBuf = std::move(newBuf1);          // 当前buf换成一个空的buf
 
 
-                // 把前端的bufVec与后端的bufVec交换，
-                //  前端换上空的继续接收日志，后端来处理前端接收到的日志
-                bufVec.swap(m_bufs);
-                if (!m_nextBuf)                      // 如果nextBuf被用了
-                    m_nextBuf = std::move(newBuf2);  // 就补上
+    MmapLogFile::MmapLogFile(const std::string& basename, uint64_t rollSize, bool isLocalTimeZone, uint64_t windowSize)
+        : m_basename(basename),
+          m_rollSize(rollSize),
+          m_windowSize((std::max<uint64_t>(windowSize, 1) + process::PageSize() - 1) / process::PageSize() * process::PageSize()),
+          m_isLocalTimeZone(isLocalTimeZone),
+          m_fileSuffix(fmt::format(".{}.{}.log", process::HostName(), process::Pid())) { Roll(); }
+    MmapLogFile::~MmapLogFile() { Close(); }
+    void MmapLogFile::Append(const char* logline, uint64_t len)
+    {
+        std::lock_guard locker(m_mu);
+        if (m_pos >= m_rollSize)
+            Roll();
+        while (len != 0)
+        {
+            if (m_window == nullptr || m_pos == m_windowBegin + m_windowSize)
+            {
+                MapWindow();
+                if (m_window == nullptr)
+                    return;
             }
+            uint64_t n = std::min(len, m_windowBegin + m_windowSize - m_pos);
+            memcpy(m_window + (m_pos - m_windowBegin), logline, n);
+            m_pos += n;
+            logline += n;
+            len -= n;
+        }
+    }
+    void MmapLogFile::Flush()
+    {
+        std::lock_guard locker(m_mu);
+        if (m_fd >= 0)
+            fdatasync(m_fd);  // 通过mmap写的脏页也会一起写回
+    }
+    void MmapLogFile::Roll()
+    {
+        Timestamp now;
+        if (now.As_time_t() <= m_lastRoll)
+            return;
+        m_lastRoll = now.As_time_t();
+
+        Close();
+        std::string filename = fmt::format("{}.{}{}", m_basename, m_isLocalTimeZone ? now.LocalFormatString() : now.GmFormatString(), m_fileSuffix);
+        m_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            fprintf(stderr, "MmapLogFile open %s failed %s\n", filename.c_str(), detail::strerror_tl(errno));
+        m_pos = 0;
+    }
+    void MmapLogFile::MapWindow()
+    {
+        if (m_window != nullptr)
+            munmap(m_window, m_windowSize);
+        m_window = nullptr;
+        m_windowBegin = m_pos;
+        if (m_fd < 0)
+            return;
+
+        // 先分配好磁盘空间，不然磁盘满了时写映射的内存会收到SIGBUS
+        int err = fallocate(m_fd, 0, (off_t)m_windowBegin, (off_t)m_windowSize) < 0 ? errno : 0;
+        if (err == EOPNOTSUPP)
+            err = ftruncate(m_fd, (off_t)(m_windowBegin + m_windowSize)) < 0 ? errno : 0;
+        if (err != 0)
+        {
+            fprintf(stderr, "MmapLogFile fallocate failed %s\n", detail::strerror_tl(err));
+            return;
+        }
+        void* addr = mmap(NULL, m_windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, (off_t)m_windowBegin);
+        if (addr == MAP_FAILED)
+        {
+            fprintf(stderr, "MmapLogFile mmap failed %s\n", detail::strerror_tl(errno));
+            return;
+        }
+        m_window = (char*)addr;
+    }
+    void MmapLogFile::Close()
+    {
+        if (m_window != nullptr)
+            munmap(m_window, m_windowSize);
+        m_window = nullptr;
+        if (m_fd < 0)
+            return;
+        if (ftruncate(m_fd, (off_t)m_pos) < 0)
+            fprintf(stderr, "MmapLogFile ftruncate failed %s\n", detail::strerror_tl(errno));
+        close(m_fd);
+        m_fd = -1;
+    }
+
+
 
-            if (bufVec.size() > 25)  // 生产效率大于消费效率
+    namespace detail {
+        namespace {
+            template <typename T>
+            void AppendRaw(std::string* out, T val) { out->append((const char*)&val, sizeof(val)); }
+            template <typename T>
+            bool ReadRaw(const char*& p, const char* end, T* val)
             {
-                char buf[256];
-                fmt::format_to(buf, "Discardped log messages at {}, {} larger buffers\n",
-                               Timestamp::Now().GmFormatString(), bufVec.size() - 2);
-                fputs(buf, stderr);
-                logFile.Append(buf, strlen(buf));
-                bufVec.erase(bufVec.begin() + 2, bufVec.end());  // 处理方法是将buf都舍弃掉，只留下两个，废物利用
+                if (end - p < (int64_t)sizeof(T))
+                    return false;
+                memcpy(val, p, sizeof(T));
+                p += sizeof(T);
+                return true;
             }
-            for (auto&& item : bufVec)  // 遍历，输出所有要输出的buf
-                logFile.Append(item->Data(), item->Size());
-
-            if (bufVec.size() > 2)
-                bufVec.resize(2);  // 丢掉所有的buf，留两个是为了给之后newBuf1和newBuf2用，属于废物利用
 
-            if (!newBuf1)  // 如果newBuf1被用了就补上
+            const char k_BinaryLogMagic[] = "KRSLOG01";  // 二进制日志文件头，不含结尾的0
+        }  // namespace
+
+        void FormatBinaryLog(std::string* out, int64_t timeNs, int tid, Logger::LogLevel level, std::string_view file, int line,
+                             std::string_view format, const BinaryArgType* argTypes, int argNum, const char* args, uint64_t len, bool isLocalTimeZone)
+        {
+            using namespace std::chrono;
+            char buf[64];
+            Timestamp time(system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(timeNs))));
+            char* p = isLocalTimeZone ? time.LocalLogFormat(buf) : time.GmLogFormat(buf);
+            out->append(buf, p - buf);
+            fmt::format_to(std::back_inserter(*out), FMT_COMPILE("[{:5d}] "), tid);
+            out->append(LogLevelName[(int)level], 8);
+
+            // 按调用点记下的类型把参数读出来
+            fmt::dynamic_format_arg_store<fmt::format_context> store;
+            const char* end = args + len;
+            bool isBroken = false;
+            for (int i = 0; i < argNum && !isBroken; i++)
             {
-                newBuf1 = std::move(bufVec.back());
-                bufVec.pop_back();
-                newBuf1->Reset();
+                switch (argTypes[i])
+                {
+                    case BinaryArgType::k_Bool:
+                    case BinaryArgType::k_Char: {
+                        char c;
+                        if ((isBroken = !ReadRaw(args, end, &c)) == false)
+                        {
+                            if (argTypes[i] == BinaryArgType::k_Bool)
+                                store.push_back(c != 0);
+                            else
+                                store.push_back(c);
+                        }
+                        break;
+                    }
+                    case BinaryArgType::k_Int64: {
+                        int64_t val;
+                        if ((isBroken = !ReadRaw(args, end, &val)) == false)
+                            store.push_back(val);
+                        break;
+                    }
+                    case BinaryArgType::k_Uint64: {
+                        uint64_t val;
+                        if ((isBroken = !ReadRaw(args, end, &val)) == false)
+                            store.push_back(val);
+                        break;
+                    }
+                    case BinaryArgType::k_Double: {
+                        double val;
+                        if ((isBroken = !ReadRaw(args, end, &val)) == false)
+                            store.push_back(val);
+                        break;
+                    }
+                    case BinaryArgType::k_String: {
+                        uint32_t strLen;
+                        if ((isBroken = (!ReadRaw(args, end, &strLen) || end - args < (int64_t)strLen)) == false)
+                        {
+                            store.push_back(std::string_view(args, strLen));
+                            args += strLen;
+                        }
+                        break;
+                    }
+                    default:
+                        isBroken = true;
+                }
             }
 
-            if (!newBuf2)  // 如果newBuf2被用了也补上
+            if (isBroken)
+                out->append(format.data(), format.size()).append(" [broken arguments]");
+            else
             {
-                newBuf2 = std::move(bufVec.back());
-                bufVec.pop_back();
-                newBuf2->Reset();
+                size_t prefixLen = out->size();
+                try
+                {
+                    fmt::vformat_to(std::back_inserter(*out), format, store);
+                }
+                catch (const fmt::format_error& ex)
+                {
+                    out->resize(prefixLen);  // 丢掉格式化了一半的内容
+                    out->append(format.data(), format.size()).append(" [format error: ").append(ex.what()).append("]");
+                }
             }
 
-            bufVec.clear();
-            logFile.Flush();
+            if (auto slash = file.rfind('/'); slash != std::string_view::npos)
+                file = file.substr(slash + 1);
+            fmt::format_to(std::back_inserter(*out), FMT_COMPILE(" - {}:{}\n"), file, line);
         }
-        logFile.Flush();
-    }
-
-
+    }  // namespace detail
 
-    SockAddr::SockAddr(uint16_t port, const char* host) { detail::IpProtToAddr(port, host, this); }
-    std::string SockAddr::ipString() const
+    std::atomic<BinaryLogFile*> BinaryLogFile::s_default = nullptr;
+    BinaryLogFile::BinaryLogFile(const std::string& basename, int64_t rollSize, Mode mode, bool isLocalTimeZone, int flushInterval, uint64_t ringSize,
+                                 const LogOverflowPolicy& policy)
+        : k_flushInterval(flushInterval),
+          m_mode(mode),
+          m_isLocalTimeZone(isLocalTimeZone),
+          m_fileName(basename),
+          m_rollSize(rollSize),
+          m_rings(ringSize, policy),
+          m_thrd(std::bind(&BinaryLogFile::Handle, this), "Binary Logger")
     {
-        char buf[64] = {0};
-        detail::AddrToIp(buf, 64, (SockAddr*)this);
-        return buf;
+        m_isRunning = true;
+        m_thrd.Start();
+        m_latch.Wait();
     }
-    std::string SockAddr::ipPortString() const
+    BinaryLogFile::~BinaryLogFile()
     {
-        char buf[64] = {0};
-        detail::AddrToIpPort(buf, 64, (SockAddr*)this);
+        if (m_isRunning)
+            Stop();
+    }
+    void BinaryLogFile::Stop()
+    {
+        BinaryLogFile* self = this;
+        s_default.compare_exchange_strong(self, nullptr);  // 不再让LOG_*_B写进来
+        m_isRunning = false;
+        m_rings.Close();
+        m_thrd.Join();
+    }
+    void BinaryLogFile::Handle()
+    {
+        m_latch.CountDown();
+        if (m_mode == k_Text)
+            m_textFile = std::make_unique<SyncLogFile>(m_fileName, m_rollSize, m_isLocalTimeZone, false);
+        else
+            RollBinary();
+
+        auto write = std::bind(&BinaryLogFile::Write, this, std::placeholders::_1);
+        auto flush = [this] {
+            if (m_textFile)
+                m_textFile->Flush();
+            else
+                m_binaryFile->Flush();
+        };
+        while (m_isRunning)
+        {
+            m_rings.Wait(k_flushInterval);
+            m_rings.Drain(write);
+            flush();
+        }
+        // 把剩下的写完
+        m_rings.Drain(write);
+        flush();
+    }
+    void BinaryLogFile::RollBinary()
+    {
+        Timestamp now;
+        std::string filename = fmt::format("{}.{}.{}.{}.klog", m_fileName, m_isLocalTimeZone ? now.LocalFormatString() : now.GmFormatString(),
+                                           process::HostName(), process::Pid());
+        m_binaryFile = std::make_unique<detail::LogFileAppender>(filename);
+        m_binaryFile->Append(detail::k_BinaryLogMagic, sizeof(detail::k_BinaryLogMagic) - 1);
+        m_siteIDs.clear();  // 新文件要重新写调用点的描述
+    }
+    void BinaryLogFile::Write(const detail::LogRing::Header* header)
+    {
+        // 记录是 调用点的地址、tid、参数
+        const char* record = (const char*)(header + 1);
+        const detail::LogSite* site;
+        int32_t tid;
+        memcpy(&site, record, sizeof(site));
+        memcpy(&tid, record + sizeof(site), sizeof(tid));
+        const char* args = record + k_RecordPrefix;
+        uint64_t argLen = header->len - k_RecordPrefix;
+        int64_t timeNs = m_rings.TicksToRealNs(header->time);
+        const detail::BinaryArgType* argTypes = site->argTypes.load(std::memory_order_acquire);
+        int argNum = site->argNum.load(std::memory_order_relaxed);
+
+        m_line.clear();
+        if (m_mode == k_Text)
+        {
+            detail::FormatBinaryLog(&m_line, timeNs, tid, site->level, site->file, site->line, site->format, argTypes, argNum, args, argLen, m_isLocalTimeZone);
+            m_textFile->Append(m_line.data(), m_line.size());
+            return;
+        }
+
+        if (m_binaryFile->WrittenBytes() > (uint64_t)m_rollSize)
+            RollBinary();
+
+        // 'S' id level line argNum argTypes fileLen file formatLen format
+        uint32_t id;
+        if (auto it = m_siteIDs.find(site); it != m_siteIDs.end())
+            id = it->second;
+        else
+        {
+            id = (uint32_t)m_siteIDs.size() + 1;
+            m_siteIDs.emplace(site, id);
+            m_line += 'S';
+            detail::AppendRaw(&m_line, id);
+            detail::AppendRaw(&m_line, (uint8_t)site->level);
+            detail::AppendRaw(&m_line, (int32_t)site->line);
+            detail::AppendRaw(&m_line, (uint8_t)argNum);
+            m_line.append((const char*)argTypes, argNum);
+            detail::AppendRaw(&m_line, (uint32_t)strlen(site->file));
+            m_line += site->file;
+            detail::AppendRaw(&m_line, (uint32_t)strlen(site->format));
+            m_line += site->format;
+        }
+
+        // 'L' id tid time argLen args
+        m_line += 'L';
+        detail::AppendRaw(&m_line, id);
+        detail::AppendRaw(&m_line, tid);
+        detail::AppendRaw(&m_line, timeNs);
+        detail::AppendRaw(&m_line, (uint32_t)argLen);
+        m_line.append(args, argLen);
+        m_binaryFile->Append(m_line.data(), m_line.size());
+    }
+    bool BinaryLogFile::Decode(const std::string& filename, FILE* out, bool isLocalTimeZone)
+    {
+        struct Site {
+            Logger::LogLevel level;
+            int32_t line;
+            std::vector<detail::BinaryArgType> argTypes;
+            std::string file;
+            std::string format;
+        };
+
+        FILE* fp = fopen(filename.c_str(), "rbe");
+        if (fp == nullptr)
+            return false;
+        auto read = [fp](void* dst, uint64_t len) { return len == 0 || fread(dst, 1, len, fp) == len; };
+        auto readString = [&read](std::string* str) {
+            uint32_t len;
+            if (!read(&len, sizeof(len)))
+                return false;
+            str->resize(len);
+            return read(str->data(), len);
+        };
+
+        bool isOK = true;
+        char magic[sizeof(detail::k_BinaryLogMagic) - 1];
+        if (!read(magic, sizeof(magic)) || memcmp(magic, detail::k_BinaryLogMagic, sizeof(magic)) != 0)
+            isOK = false;
+
+        std::vector<Site> sites;
+        std::string args;
+        std::string line;
+        while (isOK)
+        {
+            int tag = fgetc(fp);
+            if (tag == EOF)
+                break;
+            if (tag == detail::k_BinaryLogMagic[0])  // 同一秒内roll的文件会接在后面，调用点重新编号
+            {
+                isOK = read(magic + 1, sizeof(magic) - 1) && memcmp(magic + 1, detail::k_BinaryLogMagic + 1, sizeof(magic) - 1) == 0;
+                sites.clear();
+            }
+            else if (tag == 'S')
+            {
+                uint32_t id;
+                uint8_t level, argNum;
+                Site site;
+                isOK = read(&id, sizeof(id)) && read(&level, sizeof(level)) && read(&site.line, sizeof(site.line)) && read(&argNum, sizeof(argNum));
+                if (isOK)
+                {
+                    site.level = (Logger::LogLevel)std::min<uint8_t>(level, (uint8_t)Logger::LogLevel::FATAL);
+                    site.argTypes.resize(argNum);
+                    isOK = read(site.argTypes.data(), argNum) && readString(&site.file) && readString(&site.format) && id == sites.size() + 1;
+                    sites.emplace_back(std::move(site));
+                }
+            }
+            else if (tag == 'L')
+            {
+                uint32_t id, argLen;
+                int32_t tid;
+                int64_t timeNs;
+                isOK = read(&id, sizeof(id)) && read(&tid, sizeof(tid)) && read(&timeNs, sizeof(timeNs)) && read(&argLen, sizeof(argLen));
+                if (isOK)
+                {
+                    args.resize(argLen);
+                    isOK = read(args.data(), argLen) && id >= 1 && id <= sites.size();
+                }
+                if (isOK)
+                {
+                    const Site& site = sites[id - 1];
+                    line.clear();
+                    detail::FormatBinaryLog(&line, timeNs, tid, site.level, site.file, site.line, site.format, site.argTypes.data(), (int)site.argTypes.size(),
+                                            args.data(), args.size(), isLocalTimeZone);
+                    fwrite(line.data(), 1, line.size(), out);
+                }
+            }
+            else
+                isOK = false;
+        }
+        fclose(fp);
+        return isOK;
+    }
+
+
+
+    SockAddr::SockAddr(uint16_t port, const char* host) { detail::IpProtToAddr(port, host, this); }
+    std::string SockAddr::ipString() const
+    {
+        char buf[128] = {0};  // 要放得下AF_UNIX的路径
+        detail::AddrToIp(buf, sizeof(buf), (SockAddr*)this);
         return buf;
     }
+    std::string SockAddr::ipPortString() const
+    {
+        char buf[128] = {0};
+        detail::AddrToIpPort(buf, sizeof(buf), (SockAddr*)this);
+        return buf;
+    }
+    SockAddr SockAddr::Unix(const std::string_view& path)
+    {
+        SockAddr addr;
+        bzero(&addr, sizeof(addr));
+        addr.sun.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun.sun_path))
+            LOG_ERROR << "SockAddr::Unix path too long: " << path;
+        memcpy(addr.sun.sun_path, path.data(), std::min(path.size(), sizeof(addr.sun.sun_path) - 1));
+        return addr;
+    }
+    SockAddr SockAddr::AbstractUnix(const std::string_view& name)
+    {
+        SockAddr addr;
+        bzero(&addr, sizeof(addr));
+        addr.sun.sun_family = AF_UNIX;
+        if (name.size() >= sizeof(addr.sun.sun_path))
+            LOG_ERROR << "SockAddr::AbstractUnix name too long: " << name;
+        memcpy(addr.sun.sun_path + 1, name.data(), std::min(name.size(), sizeof(addr.sun.sun_path) - 1));
+        return addr;
+    }
     uint16_t SockAddr::HostPort() const
     {
         if (Famliy() == AF_INET)
             return ntohs(sin.sin_port);
-        else
+        else if (Famliy() == AF_INET6)
             return ntohs(sin6.sin6_port);
+        else
+            return 0;
     }
     uint16_t SockAddr::NetPort() const
     {
         if (Famliy() == AF_INET)
             return sin.sin_port;
-        else
+        else if (Famliy() == AF_INET6)
             return sin6.sin6_port;
+        else
+            return 0;
     }
 
 
@@ -1898,7 +4315,7 @@ namespace kurisu {
           timerQueue_(std::make_unique<detail::TimerQueue>(this)),
           m_wakeUpChannel(std::make_unique<detail::Channel>(this, m_wakeUpfd))
     {
-        LOG_DEBUG << "EventLoop created " << this << " in thread " << m_threadID;
+        LOG_DEBUG_C(detail::g_loopLog) << "EventLoop created " << this << " in thread " << m_threadID;
         if (detail::t_loopOfThisThread)
             LOG_FATAL << "Another EventLoop " << detail::t_loopOfThisThread << " exists in this thread " << m_threadID;
         else
@@ -1910,12 +4327,19 @@ namespace kurisu {
     }
     EventLoop::~EventLoop()
     {
-        LOG_DEBUG << "EventLoop " << this << " of thread " << m_threadID
+        LOG_DEBUG_C(detail::g_loopLog) << "EventLoop " << this << " of thread " << m_threadID
                   << " destructs in thread " << this_thrd::Tid();
         m_wakeUpChannel->OffAll();
         m_wakeUpChannel->Remove();
         detail::Close(m_wakeUpfd);
         detail::t_loopOfThisThread = nullptr;
+        // 没来得及执行的完成回调直接丢弃
+        for (detail::Completion* p = m_completions.exchange(nullptr); p != nullptr;)
+        {
+            detail::Completion* next = p->next;
+            delete p;
+            p = next;
+        }
     }
     void EventLoop::Loop()
     {
@@ -1924,7 +4348,7 @@ namespace kurisu {
 
         m_isLooping = true;
         m_isQuit = false;
-        LOG_TRACE << "EventLoop " << this << " start looping";
+        LOG_TRACE_C(detail::g_loopLog) << "EventLoop " << this << " start looping";
 
         while (!m_isQuit)
         {
@@ -1943,7 +4367,7 @@ namespace kurisu {
             m_isRunningCallback = false;
             RunTasks();  // 执行额外的回调函数
         }
-        LOG_TRACE << "EventLoop " << this << " stop looping";
+        LOG_TRACE_C(detail::g_loopLog) << "EventLoop " << this << " stop looping";
         m_isLooping = false;
     }
     void EventLoop::Quit()
@@ -1997,6 +4421,38 @@ namespace kurisu {
         return m_poller->HasChannel(channel);
     }
     EventLoop* EventLoop::GetLoopOfThisThread() { return detail::t_loopOfThisThread; }
+    void EventLoop::AddCompletion(detail::Completion* completion)
+    {
+        detail::Completion* head = m_completions.load(std::memory_order_relaxed);
+        do
+            completion->next = head;
+        while (!m_completions.compare_exchange_weak(head, completion, std::memory_order_release, std::memory_order_relaxed));
+
+        if (head == nullptr)  // 栈原来是空的，说明还没有投递过RunCompletions
+            AddTask(std::bind(&EventLoop::RunCompletions, this));
+    }
+    void EventLoop::RunCompletions()
+    {
+        // 一次取走整个栈，之后到来的完成回调会重新投递
+        detail::Completion* head = m_completions.exchange(nullptr, std::memory_order_acquire);
+
+        // 栈是后进先出的，反转成完成的顺序
+        detail::Completion* prev = nullptr;
+        while (head != nullptr)
+        {
+            detail::Completion* next = head->next;
+            head->next = prev;
+            prev = head;
+            head = next;
+        }
+        while (prev != nullptr)
+        {
+            detail::Completion* next = prev->next;
+            prev->callback();
+            delete prev;
+            prev = next;
+        }
+    }
     void EventLoop::WakeUpRead()
     {
         uint64_t one = 1;
@@ -2024,7 +4480,7 @@ namespace kurisu {
     void EventLoop::PrintActiveChannels() const
     {
         for (auto&& channel : m_activeChannels)
-            LOG_TRACE << "{" << channel->ReventsString() << "} ";
+            LOG_TRACE_C(detail::g_loopLog) << "{" << channel->ReventsString() << "} ";
     }
     void EventLoop::AssertInLoopThread()
     {
@@ -2249,7 +4705,7 @@ namespace kurisu {
         {
             uint64_t readable = ReadableBytes();
             char* p = Begin();
-            memcpy(p + k_PrependSize, p + m_readIndex, readable);
+            memmove(p + k_PrependSize, p + m_readIndex, readable);  // 可能重叠
             m_readIndex = k_PrependSize;
             m_writeIndex = m_readIndex + readable;
         }
@@ -2304,11 +4760,11 @@ namespace kurisu {
         m_channel->SetWriteCallback(std::bind(&TcpConnection::HandleWrite, this));
         m_channel->SetCloseCallback(std::bind(&TcpConnection::HandleClose, this));
         m_channel->SetErrorCallback(std::bind(&TcpConnection::HandleError, this));
-        LOG_DEBUG << "TcpConnection::ctor[" << m_name << "] at " << this << " fd=" << sockfd;
+        LOG_DEBUG_C(detail::g_connLog) << "TcpConnection::ctor[" << m_name << "] at " << this << " fd=" << sockfd;
     }
     TcpConnection::~TcpConnection()
     {
-        LOG_DEBUG << "TcpConnection::~TcpConnection [" << m_name << "] at " << this
+        LOG_DEBUG_C(detail::g_connLog) << "TcpConnection::~TcpConnection [" << m_name << "] at " << this
                   << " fd=" << m_channel->fd()
                   << " state=" << StatusToString();
     }
@@ -2386,6 +4842,7 @@ namespace kurisu {
     {
         m_loop->AssertInLoopThread();
         m_status = k_Connected;
+        m_isReading = true;
         m_channel->Tie(shared_from_this());  // 使Channel生命周期与TcpConnection对象相同
         m_channel->OnReading();              // 将channel添加到Poller中
         m_connCallback(shared_from_this());  // 调用用户注册的回调函数
@@ -2404,6 +4861,11 @@ namespace kurisu {
     void TcpConnection::HandleRead(Timestamp receiveTime)
     {
         m_loop->AssertInLoopThread();
+        if (m_readHook)  // 可读事件被接管了
+        {
+            m_readHook(receiveTime);
+            return;
+        }
         int savedErrno = 0;
         // 尝试一次读完tcp缓冲区的所有数据,返回实际读入的字节数(一次可能读不完)
         ssize_t n = m_inputBuf.ReadSocket(m_channel->fd(), &savedErrno);
@@ -2417,7 +4879,7 @@ namespace kurisu {
         else  // 出错
         {
             errno = savedErrno;
-            LOG_SYSERR << "TcpConnection::HandleRead";
+            LOG_SYSERR_RATE_LIMITED(10, 50) << "TcpConnection::HandleRead";
             HandleError();
         }
     }
@@ -2426,6 +4888,17 @@ namespace kurisu {
         m_loop->AssertInLoopThread();
         if (m_channel->IsWriting())
         {
+            // outputBuf为空说明是被EnableWriting打开的写事件
+            if (m_outputBuf.ReadableBytes() == 0 && m_writeHook)
+            {
+                if (!m_writeHook())
+                {
+                    m_channel->OffWriting();
+                    if (m_status == k_Disconnecting)
+                        ShutdownInLoop();
+                }
+                return;
+            }
             // 尝试一次写完outputBuf的所有数据,返回实际写入的字节数(tcp缓冲区有可能仍然不能容纳所有数据)
             ssize_t n = write(m_channel->fd(), m_outputBuf.ReadIndex(), m_outputBuf.ReadableBytes());
             if (n > 0)
@@ -2434,6 +4907,8 @@ namespace kurisu {
                 // 如果写完了
                 if (m_outputBuf.ReadableBytes() == 0)
                 {
+                    if (m_writeHook && m_writeHook())
+                        return;  // 接管写事件的一方还有数据要写
                     // 不再监听写事件
                     m_channel->OffWriting();
                     // 如果设置了写完的回调函数就进行回调
@@ -2444,15 +4919,17 @@ namespace kurisu {
                 }
             }
             else
-                LOG_SYSERR << "TcpConnection::HandleWrite";
+                LOG_SYSERR_RATE_LIMITED(10, 50) << "TcpConnection::HandleWrite";
         }
         else
-            LOG_TRACE << "Connection fd = " << m_channel->fd() << " is down, no more writing";
+            LOG_TRACE_C(detail::g_connLog) << "Connection fd = " << m_channel->fd() << " is down, no more writing";
     }
     void TcpConnection::HandleClose()
     {
         m_loop->AssertInLoopThread();
-        LOG_TRACE << "fd = " << m_channel->fd() << " state = " << StatusToString();
+        LOG_TRACE_C(detail::g_connLog) << "fd = " << m_channel->fd() << " state = " << StatusToString();
+        if (m_status == k_Disconnected)  // 已经关闭过了，比如ForceClose之后在ConnectDestroyed之前又收到了EPOLLHUP
+            return;
         m_status = k_Disconnected;
         m_channel->OffAll();
 
@@ -2460,13 +4937,15 @@ namespace kurisu {
         // 此时当前的TcpConnection的引用计数为3
         // 1.guard  2.在TcpServer的map中 3.在Channel的tie中(保证Channel回调时TcpConnection还活着)
         // 这么做是为了保证执行callback时TcpConnection不会提前析构
+        if (m_closeHook)
+            m_closeHook();
         m_connCallback(guard);
         m_closeCallback(guard);
     }
     void TcpConnection::HandleError()
     {
         int err = detail::GetSocketError(m_channel->fd());
-        LOG_ERROR << "TcpConnection::HandleError [" << m_name << "] - SO_ERROR = " << err << " " << detail::strerror_tl(err);
+        LOG_RATE_LIMITED(ERROR, 10, 50) << "TcpConnection::HandleError [" << m_name << "] - SO_ERROR = " << err << " " << detail::strerror_tl(err);
     }
     void TcpConnection::SendInLoop(const void* data, size_t len)
     {
@@ -2476,7 +4955,7 @@ namespace kurisu {
         bool faultError = false;
         if (m_status == k_Disconnected)
         {
-            LOG_WARN << "disconnected, give up writing";
+            LOG_RATE_LIMITED(WARN, 10, 50) << "disconnected, give up writing";
             return;
         }
         // 如果没在epoll注册就直接发
@@ -2494,10 +4973,11 @@ namespace kurisu {
                 n = 0;
                 if (errno != EAGAIN)  // 如果错误为EAGAIN,表明tcp缓冲区已满
                 {
-                    LOG_SYSERR << "TcpConnection::SendInLoop";
+                    int savedErrno = errno;  // 写日志可能改掉errno
+                    LOG_SYSERR_RATE_LIMITED(10, 50) << "TcpConnection::SendInLoop";
                     // EPIPE表示客户端已经关闭了连接
                     //  ECONNRESET表示连接已重置
-                    if (errno == EPIPE || errno == ECONNRESET)
+                    if (savedErrno == EPIPE || savedErrno == ECONNRESET)
                         faultError = true;
                 }
             }
@@ -2540,116 +5020,1035 @@ namespace kurisu {
                 return "unknown status";
         }
     }
-    void TcpConnection::StartReadInLoop()
+    void TcpConnection::StartReadInLoop()
+    {
+        m_loop->AssertInLoopThread();
+        if (!m_isReading || !m_channel->IsReading())
+        {
+            m_channel->OnReading();
+            m_isReading = true;
+        }
+    }
+    void TcpConnection::StopReadInLoop()
+    {
+        m_loop->AssertInLoopThread();
+        if (m_isReading || m_channel->IsReading())
+        {
+            m_channel->OffReading();
+            m_isReading = false;
+        }
+    }
+    void TcpConnection::EnableWriting()
+    {
+        m_loop->AssertInLoopThread();
+        if (!m_channel->IsWriting())
+            m_channel->OnWriting();
+    }
+    bool TcpConnection::GetTcpInfo(struct tcp_info* tcpi) const { return m_socket->GetTcpInfo(tcpi); }
+
+
+
+    TcpServer::TcpServer(EventLoop* loop, const SockAddr& listenAddr, const std::string& name, Option option)
+        : m_nextConnID(1),
+          m_acceptor(std::make_unique<detail::Acceptor>(loop, listenAddr, option == k_ReusePort)),
+          m_loop(loop),
+          m_threadPool(std::make_shared<detail::EventLoopThreadPool>(loop, name)),
+          m_ipPort(listenAddr.ipPortString()),
+          m_name(name),
+          m_connCallback(detail::DefaultConnCallback),
+          m_msgCallback(detail::DefaultMsgCallback)
+    {
+        using namespace std::placeholders;
+        m_acceptor->SetConnectionCallback(std::bind(&TcpServer::NewConnection, this, _1, _2));
+    }
+    void TcpServer::Start()
+    {
+        if (!m_isStarted)
+        {
+            m_isStarted = true;
+            m_threadPool->Start(m_threadInitCallback);
+            m_loop->Run(std::bind(&detail::Acceptor::Listen, m_acceptor.get()));
+        }
+    }
+    TcpServer::~TcpServer()
+    {
+        m_loop->AssertInLoopThread();
+        LOG_TRACE_C(detail::g_serverLog) << "TcpServer::~TcpServer [" << m_name << "] destructing";
+
+        for (auto&& item : m_connections)
+        {
+            std::shared_ptr<TcpConnection> conn(item.second);
+            item.second.reset();
+            conn->GetLoop()->Run(std::bind(&TcpConnection::ConnectDestroyed, conn));
+        }
+    }
+    void TcpServer::NewConnection(int sockfd, const SockAddr& peerAddr)
+    {
+        m_loop->AssertInLoopThread();
+        EventLoop* ioLoop = m_threadPool->GetNextLoop();  // 取出一个EventLoop
+        std::string connName = fmt::format("{}-{}#{}", m_name, m_ipPort, m_nextConnID++);  // m_ipPort可能是很长的AF_UNIX路径
+
+        // LOG_INFO << "TcpServer::newConnection [" << m_name << "] - new connection [" << connName << "] from "
+        //          << peerAddr.ipPortString();
+
+        // 创建新的TcpConnection
+        SockAddr localAddr(detail::GetLocalAddr(sockfd));
+        auto& conn = m_connections[connName] = std::make_shared<TcpConnection>(ioLoop, connName, sockfd, localAddr, peerAddr);
+
+        // TcpServer将所有回调函数都传给新的TcpConnection
+        conn->SetConnectionCallback(m_connCallback);
+        conn->SetMessageCallback(m_msgCallback);
+        conn->SetWriteCompleteCallback(m_writeCompleteCallback);
+        // 关闭回调函数,作用是将这个关闭的TcpConnection从map中删除
+        conn->SetCloseCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
+        conn->SetTcpNoDelay(m_isTcpNoDelay);
+
+        ioLoop->Run(std::bind(&TcpConnection::ConnectEstablished, std::ref(conn)));
+    }
+    void TcpServer::RemoveConnection(const std::shared_ptr<TcpConnection>& conn)
+    {
+        // FIXME 不安全
+        // 因为调用TcpServer::RemoveConnection的线程是TcpConnection所在的EventLoop
+        // 因为TcpServer::RemoveConnection是TcpConnection的closeCallback
+        // 也就是说此时执行这个函数的线程是TcpConnection的EventLoop所在的线程
+        // 如果此时修改TcpServer里的东西,就可能会导致TcpServer出错，例如执行m_nextConnID++
+        // 所以理论上是不安全的,但其实并没有修改,而是立刻进入到TcpServer的EventLoop,所以其实是安全的
+        // 硬要说不安全,只有下面这一句话理论上不安全(其实也安全),其他全都是安全的
+        m_loop->Run(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
+    }
+    void TcpServer::RemoveConnectionInLoop(const std::shared_ptr<TcpConnection>& conn)
+    {
+        m_loop->AssertInLoopThread();
+
+        // LOG_INFO << "TcpServer::removeConnectionInLoop [" << m_name << "] - connection " << conn->name();
+        m_connections.erase(conn->Name());
+
+        // 不直接用m_loop->run是因为TcpConnection::ConnectDestroyed应该交给其对应的EventLoop执行
+        conn->GetLoop()->AddTask(std::bind(&TcpConnection::ConnectDestroyed, conn));
+        // 此时conn引用计数为2
+        // 1.conn本身   2.上面bind了一个
+        // 所以离开这个函数后就只剩1,然后执行完TcpConnection::ConnectDestroyed,对应的TcpConnection才真正析构
+    }
+    void TcpServer::SetLengthFieldCodec(LengthFieldCodec& codec)
+    {
+        using namespace std::placeholders;
+        codec.SetMessageCallback(std::move(m_msgCallback));
+        m_msgCallback = std::bind(&LengthFieldCodec::OnMessage, &codec, _1, _2, _3);
+    }
+
+
+
+    TcpClient::TcpClient(EventLoop* loop, const SockAddr& serverAddr, const std::string& name)
+        : m_loop(loop),
+          m_connector(std::make_shared<detail::Connector>(loop, serverAddr)),
+          m_name(name),
+          m_connCallback(detail::DefaultConnCallback),
+          m_msgCallback(detail::DefaultMsgCallback)
+    {
+        m_connector->SetNewConnectionCallback(std::bind(&TcpClient::NewConnection, this, std::placeholders::_1));
+        LOG_DEBUG_C(detail::g_clientLog) << "TcpClient::TcpClient[" << m_name << "] - connector " << m_connector.get();
+    }
+    TcpClient::~TcpClient()
+    {
+        LOG_DEBUG_C(detail::g_clientLog) << "TcpClient::~TcpClient[" << m_name << "] - connector " << m_connector.get();
+        std::shared_ptr<TcpConnection> conn;
+        bool unique = false;
+        {
+            std::lock_guard locker(m_mu);
+            unique = m_connection.use_count() == 1;
+            conn = m_connection;
+        }
+        if (conn)
+        {
+            // TcpClient已经析构，关闭回调不能再访问this
+            EventLoop* loop = m_loop;
+            auto callback = [loop](const std::shared_ptr<TcpConnection>& conn) {
+                loop->AddTask(std::bind(&TcpConnection::ConnectDestroyed, conn));
+            };
+            m_loop->Run([conn, callback] { conn->SetCloseCallback(callback); });
+            if (unique)
+                conn->ForceClose();
+        }
+        else
+        {
+            m_connector->Stop();
+            // 等Connector::StopInLoop执行完再释放connector
+            auto connector = m_connector;
+            m_loop->RunAfter(1.0, [connector] {});
+        }
+    }
+    void TcpClient::Connect()
+    {
+        LOG_INFO_C(detail::g_clientLog) << "TcpClient::Connect[" << m_name << "] - connecting to " << m_connector->ServerAddr().ipPortString();
+        m_isConnect = true;
+        m_connector->Start();
+    }
+    void TcpClient::Disconnect()
+    {
+        m_isConnect = false;
+        std::lock_guard locker(m_mu);
+        if (m_connection)
+            m_connection->Shutdown();
+    }
+    void TcpClient::Stop()
+    {
+        m_isConnect = false;
+        m_connector->Stop();
+    }
+    void TcpClient::NewConnection(int sockfd)
+    {
+        m_loop->AssertInLoopThread();
+        SockAddr peerAddr(detail::GetPeerAddr(sockfd));
+        SockAddr localAddr(detail::GetLocalAddr(sockfd));
+        std::string connName = fmt::format("{}:{}#{}", m_name, peerAddr.ipPortString(), m_nextConnID++);
+
+        auto conn = std::make_shared<TcpConnection>(m_loop, connName, sockfd, localAddr, peerAddr);
+        conn->SetConnectionCallback(m_connCallback);
+        conn->SetMessageCallback(m_msgCallback);
+        conn->SetWriteCompleteCallback(m_writeCompleteCallback);
+        conn->SetCloseCallback(std::bind(&TcpClient::RemoveConnection, this, std::placeholders::_1));
+        conn->SetTcpNoDelay(m_isTcpNoDelay);
+        {
+            std::lock_guard locker(m_mu);
+            m_connection = conn;
+        }
+        conn->ConnectEstablished();
+    }
+    void TcpClient::RemoveConnection(const std::shared_ptr<TcpConnection>& conn)
+    {
+        m_loop->AssertInLoopThread();
+        {
+            std::lock_guard locker(m_mu);
+            m_connection.reset();
+        }
+        m_loop->AddTask(std::bind(&TcpConnection::ConnectDestroyed, conn));
+        if (m_isRetry && m_isConnect)
+        {
+            LOG_INFO_C(detail::g_clientLog) << "TcpClient::RemoveConnection[" << m_name << "] - Reconnecting to " << m_connector->ServerAddr().ipPortString();
+            m_connector->Restart();
+        }
+    }
+
+
+
+    class ConnectionPool::SubPool : detail::uncopyable {
+    public:
+        SubPool(ConnectionPool* owner, EventLoop* loop) : m_owner(owner), m_loop(loop) {}
+        EventLoop* GetLoop() const { return m_loop; }
+        // 以下成员函数只能在m_loop线程调用，因而不用加锁
+        void Start();
+        void Stop();
+        std::shared_ptr<TcpConnection> Acquire();
+        void Release(const std::shared_ptr<TcpConnection>& conn, bool ok);
+
+    private:
+        class Entry {
+        public:
+            std::unique_ptr<TcpClient> m_client;
+            std::shared_ptr<TcpConnection> m_conn;  // 已建立的连接，未连接时为空
+            int m_inflight = 0;                     // 在途请求数
+            int m_failures = 0;                     // 连续失败的次数
+            Timestamp m_lastActive;                 // 上次被使用的时间
+        };
+
+        void AddEntry();
+        // 回收并析构这个连接
+        void RemoveEntry(Entry* entry);
+        void OnConnection(Entry* entry, const std::shared_ptr<TcpConnection>& conn);
+        // 定时回收空闲的连接并补足最小连接数
+        void Check();
+
+        ConnectionPool* m_owner;
+        EventLoop* m_loop;
+        int m_nextID = 1;
+        bool m_isStarted = false;
+        TimerID m_timer = TimerID(nullptr);  // 定时检查的Timer
+        std::vector<std::unique_ptr<Entry>> m_entries;
+    };
+
+    void ConnectionPool::SubPool::Start()
+    {
+        m_loop->AssertInLoopThread();
+        for (int i = 0; i < m_owner->m_minNum; i++)
+            AddEntry();
+        m_timer = m_loop->RunEvery(1.0, std::bind(&SubPool::Check, this));
+        m_isStarted = true;
+    }
+    void ConnectionPool::SubPool::Stop()
+    {
+        m_loop->AssertInLoopThread();
+        if (m_isStarted)
+            m_loop->Cancel(m_timer);
+        m_isStarted = false;
+        while (!m_entries.empty())
+            RemoveEntry(m_entries.back().get());
+    }
+    std::shared_ptr<TcpConnection> ConnectionPool::SubPool::Acquire()
+    {
+        m_loop->AssertInLoopThread();
+        Entry* best = nullptr;
+        for (auto&& entry : m_entries)
+            if (entry->m_conn && entry->m_conn->Connected() && (!best || entry->m_inflight < best->m_inflight))
+                best = entry.get();
+
+        // 所有连接都很忙且还没达到上限就扩容，新连接建立后才会被选中
+        if ((!best || best->m_inflight >= m_owner->m_maxInflightPerConn) && (int)m_entries.size() < m_owner->m_maxNum)
+            AddEntry();
+
+        if (!best)
+            return nullptr;
+        best->m_inflight++;
+        best->m_lastActive = m_loop->GetReturnTime();
+        return best->m_conn;
+    }
+    void ConnectionPool::SubPool::Release(const std::shared_ptr<TcpConnection>& conn, bool ok)
+    {
+        m_loop->AssertInLoopThread();
+        for (auto&& entry : m_entries)
+            if (entry->m_conn == conn)
+            {
+                if (entry->m_inflight > 0)
+                    entry->m_inflight--;
+                entry->m_lastActive = m_loop->GetReturnTime();
+                if (ok)
+                    entry->m_failures = 0;
+                else if (++entry->m_failures >= m_owner->m_maxFailures)
+                {
+                    // 不健康的连接直接关闭，TcpClient会自动重连
+                    LOG_WARN << "ConnectionPool[" << m_owner->m_name << "] evict " << conn->Name() << " after "
+                             << entry->m_failures << " failures";
+                    entry->m_failures = 0;
+                    conn->ForceClose();
+                }
+                return;
+            }
+    }
+    void ConnectionPool::SubPool::AddEntry()
+    {
+        auto entry = std::make_unique<Entry>();
+        Entry* p = entry.get();
+        std::string name = fmt::format("{}-{}#{}", m_owner->m_name, m_loop->GetThreadID(), m_nextID++);
+        p->m_client = std::make_unique<TcpClient>(m_loop, m_owner->m_backendAddr, name);
+        p->m_client->EnableRetry();
+        p->m_client->SetTcpNoDelay(m_owner->m_isTcpNoDelay);
+        p->m_client->SetConnectionCallback([this, p](const std::shared_ptr<TcpConnection>& conn) { OnConnection(p, conn); });
+        if (m_owner->m_msgCallback)
+            p->m_client->SetMessageCallback(m_owner->m_msgCallback);
+        m_entries.emplace_back(std::move(entry));
+        p->m_client->Connect();
+    }
+    void ConnectionPool::SubPool::RemoveEntry(Entry* entry)
+    {
+        if (entry->m_conn)
+        {
+            // entry即将析构，之后的连接事件不能再回调到这里
+            entry->m_conn->SetConnectionCallback(detail::DefaultConnCallback);
+            entry->m_conn.reset();
+            m_owner->m_connectedNum--;
+        }
+        auto it = std::find_if(m_entries.begin(), m_entries.end(), [entry](const auto& item) { return item.get() == entry; });
+        m_entries.erase(it);  // TcpClient析构时会关闭连接
+    }
+    void ConnectionPool::SubPool::OnConnection(Entry* entry, const std::shared_ptr<TcpConnection>& conn)
+    {
+        if (conn->Connected())
+        {
+            entry->m_conn = conn;
+            entry->m_inflight = 0;
+            entry->m_failures = 0;
+            entry->m_lastActive = Timestamp::Now();
+            m_owner->m_connectedNum++;
+        }
+        else if (entry->m_conn)
+        {
+            entry->m_conn.reset();
+            entry->m_inflight = 0;
+            m_owner->m_connectedNum--;
+        }
+        if (m_owner->m_connCallback)
+            m_owner->m_connCallback(conn);
+    }
+    void ConnectionPool::SubPool::Check()
+    {
+        Timestamp now;
+        for (uint64_t i = 0; i < m_entries.size() && (int)m_entries.size() > m_owner->m_minNum;)
+        {
+            Entry* entry = m_entries[i].get();
+            if (entry->m_conn && entry->m_inflight == 0 && Timestamp::TimeDifference(now, entry->m_lastActive) > m_owner->m_idleTimeout)
+                RemoveEntry(entry);
+            else
+                i++;
+        }
+        while ((int)m_entries.size() < m_owner->m_minNum)
+            AddEntry();
+    }
+
+    ConnectionPool::ConnectionPool(const SockAddr& backendAddr, const std::string& name) : m_backendAddr(backendAddr), m_name(name) {}
+    ConnectionPool::~ConnectionPool()
+    {
+        for (auto&& pool : m_subPools)
+        {
+            EventLoop* loop = pool->GetLoop();
+            if (loop->InLoopThread())
+                pool->Stop();
+            else
+            {
+                detail::CountDownLatch latch(1);
+                loop->Run([&pool, &latch] {
+                    pool->Stop();
+                    latch.CountDown();
+                });
+                latch.Wait();
+            }
+        }
+    }
+    void ConnectionPool::SetConnectionNum(int minNum, int maxNum)
+    {
+        m_minNum = minNum;
+        m_maxNum = std::max(minNum, maxNum);
+    }
+    void ConnectionPool::Start(const std::vector<EventLoop*>& loops)
+    {
+        // 先把所有子池都建好，再让它们在各自的线程里开始预热，保证m_subPools之后不会再被修改
+        for (auto&& loop : loops)
+            m_subPools.emplace_back(std::make_unique<SubPool>(this, loop));
+        for (auto&& pool : m_subPools)
+            pool->GetLoop()->Run(std::bind(&SubPool::Start, pool.get()));
+    }
+    ConnectionPool::SubPool* ConnectionPool::GetSubPool()
+    {
+        EventLoop* loop = EventLoop::GetLoopOfThisThread();
+        for (auto&& pool : m_subPools)
+            if (pool->GetLoop() == loop)
+                return pool.get();
+        return nullptr;
+    }
+    std::shared_ptr<TcpConnection> ConnectionPool::Acquire()
+    {
+        if (SubPool* pool = GetSubPool(); pool)
+            return pool->Acquire();
+        LOG_ERROR << "ConnectionPool::Acquire[" << m_name << "] - no sub pool in this thread";
+        return nullptr;
+    }
+    void ConnectionPool::Release(const std::shared_ptr<TcpConnection>& conn, bool ok)
+    {
+        if (SubPool* pool = GetSubPool(); pool)
+            pool->Release(conn, ok);
+    }
+    bool ConnectionPool::WaitForWarmup(double seconds)
+    {
+        Timestamp deadline = Timestamp::AddTime(Timestamp::Now(), seconds);
+        while (!WarmedUp())
+        {
+            if (Timestamp::Now() > deadline)
+                return false;
+            this_thrd::SleepFor(1000);
+        }
+        return true;
+    }
+
+
+
+    UdpSocket::UdpSocket(EventLoop* loop, const SockAddr& localAddr, bool reuseport)
+        : m_loop(loop), m_sock(detail::MakeNonblockingUdpSocket(localAddr.Famliy()))
+    {
+        m_sock.SetReuseAddr(true);
+        m_sock.SetReusePort(reuseport);  // 多个socket绑定同一地址，内核按四元组分流
+        m_sock.bind((SockAddr*)&localAddr);
+        m_localAddr = detail::GetLocalAddr(m_sock.fd());  // 绑定端口0时拿到真正的端口
+        EnableGro(true);
+        EnableGso(true);
+
+        m_channel = std::make_unique<detail::Channel>(loop, m_sock.fd());
+        m_channel->SetReadCallback(std::bind(&UdpSocket::HandleRead, this, std::placeholders::_1));
+    }
+    UdpSocket::~UdpSocket()
+    {
+        if (m_isStarted)
+        {
+            m_loop->AssertInLoopThread();
+            m_channel->OffAll();
+            m_channel->Remove();
+        }
+    }
+    bool UdpSocket::EnableGro(bool on)
+    {
+#ifdef UDP_GRO
+        int optval = on ? 1 : 0;
+        bool ok = setsockopt(m_sock.fd(), SOL_UDP, UDP_GRO, &optval, sizeof(optval)) == 0;
+        m_isGro = on && ok;
+        return ok;
+#else
+        m_isGro = false;
+        return !on;
+#endif
+    }
+    bool UdpSocket::EnableGso(bool on)
+    {
+#ifdef UDP_SEGMENT
+        // 默认的分段大小设为0，只探测内核是否支持，每次发送时再用cmsg指定分段大小
+        int optval = 0;
+        bool ok = !on || setsockopt(m_sock.fd(), SOL_UDP, UDP_SEGMENT, &optval, sizeof(optval)) == 0;
+        m_isGso = on && ok;
+        return ok;
+#else
+        m_isGso = false;
+        return !on;
+#endif
+    }
+    void UdpSocket::Start() { m_loop->Run(std::bind(&UdpSocket::StartInLoop, this)); }
+    void UdpSocket::Stop() { m_loop->Run(std::bind(&UdpSocket::StopInLoop, this)); }
+    void UdpSocket::StartInLoop()
+    {
+        m_loop->AssertInLoopThread();
+        if (m_isStarted)
+            return;
+        m_isStarted = true;
+        InitBuffers();
+        m_channel->OnReading();
+    }
+    void UdpSocket::StopInLoop()
+    {
+        m_loop->AssertInLoopThread();
+        if (!m_isStarted)
+            return;
+        m_isStarted = false;
+        m_channel->OffAll();
+        m_channel->Remove();
+    }
+    void UdpSocket::InitBuffers()
+    {
+        const uint64_t controlSize = CMSG_SPACE(sizeof(int));
+        m_bufferSize = m_isGro ? k_GroBufferSize : m_maxDatagramSize;
+        m_slab.resize((uint64_t)m_batchSize * m_bufferSize);
+        m_msgs.resize(m_batchSize);
+        m_iovs.resize(m_batchSize);
+        m_peers.resize(m_batchSize);
+        m_controls.resize(m_batchSize * controlSize);
+        m_datagrams.reserve(m_batchSize);
+
+        for (int i = 0; i < m_batchSize; i++)
+        {
+            m_iovs[i].iov_base = &m_slab[(uint64_t)i * m_bufferSize];
+            m_iovs[i].iov_len = m_bufferSize;
+
+            msghdr& hdr = m_msgs[i].msg_hdr;
+            bzero(&hdr, sizeof(hdr));
+            hdr.msg_name = &m_peers[i].As_sockaddr();
+            hdr.msg_iov = &m_iovs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = &m_controls[i * controlSize];
+        }
+    }
+    void UdpSocket::HandleRead(Timestamp timestamp)
+    {
+        const uint64_t controlSize = CMSG_SPACE(sizeof(int));
+        // 每次recvmmsg前都要重置这两个长度，内核会把它们改成实际的长度
+        for (auto&& msg : m_msgs)
+        {
+            msg.msg_hdr.msg_namelen = sizeof(SockAddr);
+            msg.msg_hdr.msg_controllen = m_isGro ? controlSize : 0;
+        }
+
+        int num = recvmmsg(m_sock.fd(), m_msgs.data(), m_batchSize, MSG_DONTWAIT, nullptr);
+        if (num < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                LOG_SYSERR_RATE_LIMITED(10, 50) << "UdpSocket::HandleRead";
+            return;
+        }
+
+        m_datagrams.clear();
+        for (int i = 0; i < num; i++)
+        {
+            msghdr& hdr = m_msgs[i].msg_hdr;
+            SockAddr& peer = m_peers[i];
+            if (hdr.msg_namelen < sizeof(SockAddr))
+                memset((char*)&peer + hdr.msg_namelen, 0, sizeof(SockAddr) - hdr.msg_namelen);
+            if (hdr.msg_flags & MSG_TRUNC)
+                LOG_RATE_LIMITED(WARN, 10, 50) << "UdpSocket::HandleRead - datagram from " << peer.ipPortString() << " truncated to " << m_bufferSize;
+
+            char* data = (char*)m_iovs[i].iov_base;
+            uint64_t len = m_msgs[i].msg_len;
+            uint64_t segmentSize = len;
+#ifdef UDP_GRO
+            // GRO合并的数据报会带上原来每个数据报的大小(最后一个可能更短)
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                {
+                    int gsoSize;
+                    memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+                    if (gsoSize > 0)
+                        segmentSize = gsoSize;
+                }
+            }
+#endif
+            if (len == 0)  // 长度为0的数据报也是合法的
+                m_datagrams.push_back(Datagram{data, 0, peer});
+            for (uint64_t offset = 0; offset < len; offset += segmentSize)
+                m_datagrams.push_back(Datagram{data + offset, std::min(segmentSize, len - offset), peer});
+        }
+
+        m_receivedNum.fetch_add(m_datagrams.size(), std::memory_order_relaxed);
+        if (m_msgCallback && !m_datagrams.empty())
+            m_msgCallback(this, m_datagrams.data(), (int)m_datagrams.size(), timestamp);
+    }
+    bool UdpSocket::SendTo(const SockAddr& peer, const void* data, uint64_t len)
+    {
+        SockAddr* addr = (SockAddr*)&peer;
+        if (sendto(m_sock.fd(), data, len, MSG_DONTWAIT, &addr->As_sockaddr(), detail::SizeofSockAddr(addr)) < 0)
+        {
+            if (errno != EAGAIN && errno != ENOBUFS)
+                LOG_SYSERR_RATE_LIMITED(10, 50) << "UdpSocket::SendTo " << peer.ipPortString();
+            m_droppedNum.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    int UdpSocket::SendBatch(const Datagram* datagrams, int count)
+    {
+        int sentNum = 0;
+        for (int i = 0; i < count; i += k_MaxSendBatch)
+        {
+            int num = std::min(count - i, k_MaxSendBatch);
+            int sent = SendChunk(datagrams + i, num);
+            sentNum += sent;
+            if (sent < num)  // 发送缓冲区满了，剩下的也发不出去
+            {
+                m_droppedNum.fetch_add(count - sentNum, std::memory_order_relaxed);
+                break;
+            }
+        }
+        return sentNum;
+    }
+    int UdpSocket::SendChunk(const Datagram* datagrams, int count)
+    {
+        const uint64_t controlSize = CMSG_SPACE(sizeof(uint16_t));
+        const uint64_t maxGsoBytes = 65000;  // 合并后的消息不能超过一个UDP数据报的最大长度
+        mmsghdr msgs[k_MaxSendBatch];
+        iovec iovs[k_MaxSendBatch];
+        int datagramNums[k_MaxSendBatch];  // 每个消息包含几个数据报
+        alignas(cmsghdr) char controls[k_MaxSendBatch][controlSize];
+        bool isGso = m_isGso;
+
+        int msgNum = 0;
+        for (int i = 0; i < count;)
+        {
+            const Datagram& first = datagrams[i];
+            SockAddr* peer = (SockAddr*)&first.peer;
+            socklen_t peerLen = detail::SizeofSockAddr(peer);
+            uint64_t total = first.len;
+            int j = i + 1;
+            // 找出可以合并的数据报：同一个peer，除最后一个外长度都与第一个相同
+            while (isGso && first.len > 0 && j < count && datagrams[j - 1].len == first.len && datagrams[j].len > 0 &&
+                   datagrams[j].len <= first.len && total + datagrams[j].len <= maxGsoBytes &&
+                   memcmp(&datagrams[j].peer, peer, peerLen) == 0)
+            {
+                total += datagrams[j].len;
+                j++;
+            }
+
+            for (int k = i; k < j; k++)
+            {
+                iovs[k].iov_base = datagrams[k].data;
+                iovs[k].iov_len = datagrams[k].len;
+            }
+            msghdr& hdr = msgs[msgNum].msg_hdr;
+            bzero(&hdr, sizeof(hdr));
+            hdr.msg_name = &peer->As_sockaddr();
+            hdr.msg_namelen = peerLen;
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = j - i;
+#ifdef UDP_SEGMENT
+            if (j - i > 1)
+            {
+                hdr.msg_control = controls[msgNum];
+                hdr.msg_controllen = controlSize;
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gsoSize = (uint16_t)first.len;
+                memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+            }
+#endif
+            datagramNums[msgNum++] = j - i;
+            i = j;
+        }
+
+        int sentNum = 0;
+        for (int msgIndex = 0; msgIndex < msgNum;)
+        {
+            int res = sendmmsg(m_sock.fd(), msgs + msgIndex, msgNum - msgIndex, MSG_DONTWAIT);
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                // 网卡不支持校验和卸载时GSO会失败，关掉GSO重发剩下的
+                if (isGso && (errno == EIO || errno == EINVAL))
+                {
+                    LOG_WARN << "UdpSocket::SendChunk - UDP_SEGMENT failed, disable GSO";
+                    m_isGso = false;
+                    return sentNum + SendChunk(datagrams + sentNum, count - sentNum);
+                }
+                if (errno != EAGAIN && errno != ENOBUFS)
+                    LOG_SYSERR << "UdpSocket::SendChunk";
+                break;
+            }
+            for (int k = 0; k < res; k++)
+                sentNum += datagramNums[msgIndex + k];
+            msgIndex += res;
+        }
+        return sentNum;
+    }
+
+
+
+    UdpServer::UdpServer(EventLoop* loop, const SockAddr& listenAddr, const std::string& name, Option option)
+        : m_isReusePort(option == k_ReusePort),
+          m_loop(loop),
+          m_listenAddr(listenAddr),
+          m_threadPool(std::make_shared<detail::EventLoopThreadPool>(loop, name)),
+          m_ipPort(listenAddr.ipPortString()),
+          m_name(name) {}
+    UdpServer::~UdpServer()
+    {
+        m_loop->AssertInLoopThread();
+        // UdpSocket要在所属的loop线程中析构
+        for (auto&& sock : m_sockets)
+        {
+            EventLoop* loop = sock->GetLoop();
+            if (loop->InLoopThread())
+                sock.reset();
+            else
+            {
+                detail::CountDownLatch latch(1);
+                loop->Run([&sock, &latch] {
+                    sock.reset();
+                    latch.CountDown();
+                });
+                latch.Wait();
+            }
+        }
+    }
+    void UdpServer::Start()
+    {
+        if (!m_isStarted)
+        {
+            m_isStarted = true;
+            m_threadPool->Start(m_threadInitCallback);
+
+            std::vector<EventLoop*> loops = m_threadPool->GetAllLoops();
+            bool reuseport = m_isReusePort || loops.size() > 1;
+            SockAddr addr = m_listenAddr;
+            for (auto&& loop : loops)
+            {
+                auto& sock = m_sockets.emplace_back(std::make_unique<UdpSocket>(loop, addr, reuseport));
+                sock->SetBatchSize(m_batchSize);
+                sock->SetMaxDatagramSize(m_maxDatagramSize);
+                sock->EnableGro(m_isGro);
+                sock->EnableGso(m_isGso);
+                sock->SetMessageCallback(m_msgCallback);
+                sock->Start();
+                addr = sock->LocalAddr();  // 监听端口0时，其余的socket要绑定第一个socket拿到的端口
+            }
+        }
+    }
+
+
+
+    namespace detail {
+        // 给TcpRelay用的管道池，每个线程一个，只在所属的loop线程中使用
+        class PipePool : uncopyable {
+        public:
+            ~PipePool()
+            {
+                for (auto&& [readfd, writefd] : m_pipes)
+                {
+                    close(readfd);
+                    close(writefd);
+                }
+            }
+            bool Get(int* pipefd)
+            {
+                if (!m_pipes.empty())
+                {
+                    pipefd[0] = m_pipes.back().first;
+                    pipefd[1] = m_pipes.back().second;
+                    m_pipes.pop_back();
+                    return true;
+                }
+                if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+                {
+                    LOG_SYSERR << "PipePool::Get";
+                    return false;
+                }
+                return true;
+            }
+            // 管道里还有数据的就不能再复用了
+            void Put(int* pipefd, bool isEmpty)
+            {
+                if (isEmpty && m_pipes.size() < k_MaxIdleNum)
+                    m_pipes.emplace_back(pipefd[0], pipefd[1]);
+                else
+                {
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                }
+                pipefd[0] = pipefd[1] = -1;
+            }
+
+        private:
+            static const uint64_t k_MaxIdleNum = 64;
+            std::vector<std::pair<int, int>> m_pipes;
+        };
+
+        thread_local PipePool t_pipePool;
+    }  // namespace detail
+
+    TcpRelay::TcpRelay(const std::shared_ptr<TcpConnection>& first, const std::shared_ptr<TcpConnection>& second)
+        : m_loop(first->GetLoop()), m_first(first), m_second(second)
+    {
+        if (second->GetLoop() != m_loop)
+            LOG_FATAL << "TcpRelay::TcpRelay - " << first->Name() << " and " << second->Name() << " are not in the same EventLoop";
+        m_dirs[0].from = first.get();
+        m_dirs[0].to = second.get();
+        m_dirs[1].from = second.get();
+        m_dirs[1].to = first.get();
+    }
+    TcpRelay::~TcpRelay()
+    {
+        // 没有机会还给管道池的管道直接关掉
+        for (auto&& dir : m_dirs)
+        {
+            if (dir.pipefd[0] >= 0)
+            {
+                close(dir.pipefd[0]);
+                close(dir.pipefd[1]);
+            }
+        }
+    }
+    void TcpRelay::Start()
+    {
+        m_loop->AssertInLoopThread();
+        if (m_isStarted)
+            return;
+        m_isStarted = true;
+        m_self = shared_from_this();
+
+        for (auto&& dir : m_dirs)
+        {
+            if (!detail::t_pipePool.Get(dir.pipefd))
+                dir.isCopy = true;
+            dir.from->SetReadHook(std::bind(&TcpRelay::HandleRead, this, &dir));
+            dir.to->SetWriteHook(std::bind(&TcpRelay::HandleWritable, this, &dir));
+        }
+        m_first->SetCloseHook(std::bind(&TcpRelay::HandleClose, this));
+        m_second->SetCloseHook(std::bind(&TcpRelay::HandleClose, this));
+
+        if (!m_first->Connected() || !m_second->Connected())
+        {
+            LOG_WARN << "TcpRelay::Start - " << m_first->Name() << " or " << m_second->Name() << " is not connected";
+            CloseAll();
+            return;
+        }
+
+        // 接管之前已经读进inputBuf的数据先转发出去
+        for (auto&& dir : m_dirs)
+        {
+            Buffer* buf = dir.from->GetInputBuffer();
+            if (buf->ReadableBytes() == 0)
+                continue;
+            m_copiedBytes += buf->ReadableBytes();
+            dir.to->Send(buf);
+            if (dir.to->GetOutputBuffer()->ReadableBytes() > 0)
+                Block(&dir);
+        }
+    }
+    void TcpRelay::Stop()
     {
         m_loop->AssertInLoopThread();
-        if (!m_isReading || !m_channel->IsReading())
+        if (!m_isStarted || m_isStopped)
+            return;
+        m_isStopped = true;
+        // 可能正处于某个hook中，等这一轮回调结束后再清除hook
+        m_loop->AddTask([self = std::move(m_self)] { self->ResetHooks(); });
+    }
+    void TcpRelay::ResetHooks()
+    {
+        for (auto&& dir : m_dirs)
         {
-            m_channel->OnReading();
-            m_isReading = true;
+            // 管道中还没发出去的数据交给TcpConnection的outputBuf
+            if (dir.pipeBytes > 0 && dir.to->Connected())
+                DrainPipeByCopy(&dir);
+            if (dir.pipefd[0] >= 0)
+                detail::t_pipePool.Put(dir.pipefd, dir.pipeBytes == 0);
+
+            dir.from->SetReadHook(nullptr);
+            dir.to->SetWriteHook(nullptr);
+            if (dir.isBlocked && !dir.isEof && dir.from->Connected())
+                dir.from->StartRead();
         }
+        m_first->SetCloseHook(nullptr);
+        m_second->SetCloseHook(nullptr);
     }
-    void TcpConnection::StopReadInLoop()
+    void TcpRelay::HandleRead(Direction* dir)
     {
-        m_loop->AssertInLoopThread();
-        if (m_isReading || m_channel->IsReading())
+        if (m_isStopped)
+            return;
+        if (dir->isCopy)
         {
-            m_channel->OffReading();
-            m_isReading = false;
+            CopyRead(dir);
+            return;
         }
-    }
-    bool TcpConnection::GetTcpInfo(struct tcp_info* tcpi) const { return m_socket->GetTcpInfo(tcpi); }
-
 
-
-    TcpServer::TcpServer(EventLoop* loop, const SockAddr& listenAddr, const std::string& name, Option option)
-        : m_nextConnID(1),
-          m_acceptor(std::make_unique<detail::Acceptor>(loop, listenAddr, option == k_ReusePort)),
-          m_loop(loop),
-          m_threadPool(std::make_shared<detail::EventLoopThreadPool>(loop, name)),
-          m_ipPort(listenAddr.ipPortString()),
-          m_name(name),
-          m_connCallback(detail::DefaultConnCallback),
-          m_msgCallback(detail::DefaultMsgCallback)
+        ssize_t n = splice(dir->from->fd(), nullptr, dir->pipefd[1], nullptr, k_SpliceSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            dir->pipeBytes += n;
+            m_splicedBytes += n;
+            Flush(dir);
+        }
+        else if (n == 0)  // 对端关闭了写
+        {
+            dir->isEof = true;
+            dir->from->StopRead();
+            if (dir->pipeBytes == 0)
+                Finish(dir);
+        }
+        else if (errno == EAGAIN || errno == EINTR)
+            return;
+        else if (errno == EINVAL)  // 这个socket不支持splice
+        {
+            LOG_WARN << "TcpRelay::HandleRead - splice unsupported on " << dir->from->Name() << ", fall back to copy";
+            dir->isCopy = true;
+            CopyRead(dir);
+        }
+        else
+        {
+            LOG_SYSERR << "TcpRelay::HandleRead " << dir->from->Name();
+            CloseAll();
+        }
+    }
+    void TcpRelay::CopyRead(Direction* dir)
     {
-        using namespace std::placeholders;
-        m_acceptor->SetConnectionCallback(std::bind(&TcpServer::NewConnection, this, _1, _2));
+        int savedErrno = 0;
+        Buffer* buf = dir->from->GetInputBuffer();
+        ssize_t n = buf->ReadSocket(dir->from->fd(), &savedErrno);
+        if (n > 0)
+        {
+            m_copiedBytes += n;
+            dir->to->Send(buf);
+            if (dir->to->GetOutputBuffer()->ReadableBytes() > 0)
+                Block(dir);
+        }
+        else if (n == 0)
+        {
+            dir->isEof = true;
+            dir->from->StopRead();
+            // outputBuf中还有数据时，等写完后在HandleWritable中结束
+            if (dir->to->GetOutputBuffer()->ReadableBytes() == 0)
+                Finish(dir);
+        }
+        else if (savedErrno != EAGAIN && savedErrno != EINTR)
+        {
+            errno = savedErrno;
+            LOG_SYSERR << "TcpRelay::CopyRead " << dir->from->Name();
+            CloseAll();
+        }
     }
-    void TcpServer::Start()
+    void TcpRelay::Flush(Direction* dir)
     {
-        if (!m_isStarted)
+        while (dir->pipeBytes > 0)
         {
-            m_isStarted = true;
-            m_threadPool->Start(m_threadInitCallback);
-            m_loop->Run(std::bind(&detail::Acceptor::Listen, m_acceptor.get()));
+            ssize_t n = splice(dir->pipefd[0], nullptr, dir->to->fd(), nullptr, dir->pipeBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                dir->pipeBytes -= n;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && errno == EAGAIN)  // 目的端的发送缓冲区满了
+                break;
+            else if (n < 0 && errno == EINVAL)
+            {
+                LOG_WARN << "TcpRelay::Flush - splice unsupported on " << dir->to->Name() << ", fall back to copy";
+                DrainPipeByCopy(dir);
+                return;
+            }
+            else
+            {
+                LOG_SYSERR << "TcpRelay::Flush " << dir->to->Name();
+                CloseAll();
+                return;
+            }
         }
+        if (dir->pipeBytes > 0)
+            Block(dir);
     }
-    TcpServer::~TcpServer()
+    void TcpRelay::DrainPipeByCopy(Direction* dir)
     {
-        m_loop->AssertInLoopThread();
-        LOG_TRACE << "TcpServer::~TcpServer [" << m_name << "] destructing";
-
-        for (auto&& item : m_connections)
+        dir->isCopy = true;
+        Buffer buf(dir->pipeBytes);
+        while (dir->pipeBytes > 0)
+        {
+            ssize_t n = read(dir->pipefd[0], buf.WriteIndex(), buf.WriteableBytes());
+            if (n <= 0)
+                break;
+            buf.WriteIndexRightShift(n);
+            dir->pipeBytes -= n;
+        }
+        dir->pipeBytes = 0;
+        dir->to->Send(&buf);
+        if (dir->to->GetOutputBuffer()->ReadableBytes() > 0)
+            Block(dir);
+    }
+    bool TcpRelay::HandleWritable(Direction* dir)
+    {
+        if (m_isStopped)
+            return false;
+        if (dir->pipeBytes > 0)
         {
-            std::shared_ptr<TcpConnection> conn(item.second);
-            item.second.reset();
-            conn->GetLoop()->Run(std::bind(&TcpConnection::ConnectDestroyed, conn));
+            Flush(dir);
+            if (dir->pipeBytes > 0 && !m_isStopped)
+                return true;  // 继续等可写
+        }
+        // 目的端的数据都发出去了，恢复读源端
+        if (dir->isBlocked)
+        {
+            dir->isBlocked = false;
+            if (!dir->isEof)
+                dir->from->StartRead();
         }
+        if (dir->isEof && !dir->isDone)
+            Finish(dir);
+        return false;
     }
-    void TcpServer::NewConnection(int sockfd, const SockAddr& peerAddr)
+    void TcpRelay::Block(Direction* dir)
     {
-        m_loop->AssertInLoopThread();
-        EventLoop* ioLoop = m_threadPool->GetNextLoop();  // 取出一个EventLoop
-        char buf[64] = {0};
-        fmt::format_to(buf, "-{}#{}", m_ipPort.c_str(), m_nextConnID++);
-        std::string connName = m_name + buf;
-
-        // LOG_INFO << "TcpServer::newConnection [" << m_name << "] - new connection [" << connName << "] from "
-        //          << peerAddr.ipPortString();
-
-        // 创建新的TcpConnection
-        SockAddr localAddr(detail::GetLocalAddr(sockfd));
-        auto& conn = m_connections[connName] = std::make_shared<TcpConnection>(ioLoop, connName, sockfd, localAddr, peerAddr);
-
-        // TcpServer将所有回调函数都传给新的TcpConnection
-        conn->SetConnectionCallback(m_connCallback);
-        conn->SetMessageCallback(m_msgCallback);
-        conn->SetWriteCompleteCallback(m_writeCompleteCallback);
-        // 关闭回调函数,作用是将这个关闭的TcpConnection从map中删除
-        conn->SetCloseCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
-        conn->SetTcpNoDelay(m_isTcpNoDelay);
-
-        ioLoop->Run(std::bind(&TcpConnection::ConnectEstablished, std::ref(conn)));
+        if (!dir->isBlocked)
+        {
+            dir->isBlocked = true;
+            dir->from->StopRead();
+        }
+        dir->to->EnableWriting();
     }
-    void TcpServer::RemoveConnection(const std::shared_ptr<TcpConnection>& conn)
+    void TcpRelay::Finish(Direction* dir)
     {
-        // FIXME 不安全
-        // 因为调用TcpServer::RemoveConnection的线程是TcpConnection所在的EventLoop
-        // 因为TcpServer::RemoveConnection是TcpConnection的closeCallback
-        // 也就是说此时执行这个函数的线程是TcpConnection的EventLoop所在的线程
-        // 如果此时修改TcpServer里的东西,就可能会导致TcpServer出错，例如执行m_nextConnID++
-        // 所以理论上是不安全的,但其实并没有修改,而是立刻进入到TcpServer的EventLoop,所以其实是安全的
-        // 硬要说不安全,只有下面这一句话理论上不安全(其实也安全),其他全都是安全的
-        m_loop->Run(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
+        dir->isDone = true;
+        dir->to->Shutdown();  // 正在监听可写时，TcpConnection会在写完后再shutdown
+        if (m_dirs[0].isDone && m_dirs[1].isDone)
+            CloseAll();
     }
-    void TcpServer::RemoveConnectionInLoop(const std::shared_ptr<TcpConnection>& conn)
+    void TcpRelay::HandleClose()
     {
-        m_loop->AssertInLoopThread();
-
-        // LOG_INFO << "TcpServer::removeConnectionInLoop [" << m_name << "] - connection " << conn->name();
-        m_connections.erase(conn->Name());
-
-        // 不直接用m_loop->run是因为TcpConnection::ConnectDestroyed应该交给其对应的EventLoop执行
-        conn->GetLoop()->AddTask(std::bind(&TcpConnection::ConnectDestroyed, conn));
-        // 此时conn引用计数为2
-        // 1.conn本身   2.上面bind了一个
-        // 所以离开这个函数后就只剩1,然后执行完TcpConnection::ConnectDestroyed,对应的TcpConnection才真正析构
+        if (!m_isStopped)
+            CloseAll();
     }
-    void TcpServer::SetLengthFieldCodec(LengthFieldCodec& codec)
+    void TcpRelay::CloseAll()
     {
-        using namespace std::placeholders;
-        codec.SetMessageCallback(std::move(m_msgCallback));
-        m_msgCallback = std::bind(&LengthFieldCodec::OnMessage, &codec, _1, _2, _3);
+        Stop();
+        m_first->ForceClose();
+        m_second->ForceClose();
     }
 
 
@@ -2785,4 +6184,384 @@ namespace kurisu {
                 return 0;
         }
     }
+
+
+
+    namespace {
+        const uint64_t k_FrameHeaderSize = 5;        // 4字节长度，1字节标志
+        const uint64_t k_ReplayChunk = 256 * 1024;  // 补发spool时每次读多少，连接输出缓冲区中少于这些时接着读
+
+        uint32_t ReadUint32(const char* p)
+        {
+            uint32_t n;
+            memcpy(&n, p, sizeof(n));
+            return ntohl(n);
+        }
+        void WriteUint32(char* p, uint32_t n)
+        {
+            n = htonl(n);
+            memcpy(p, &n, sizeof(n));
+        }
+    }  // namespace
+
+    RemoteLogSink::RemoteLogSink(const SockAddr& collectorAddr, const std::string& name, const RemoteLogSinkOptions& options)
+        : m_options(options), m_loopThread(std::make_unique<detail::EventLoopThread>(nullptr, name)), m_loop(m_loopThread->Start()), m_timer(nullptr)
+    {
+#ifndef KURISU_WITH_ZLIB
+        if (m_options.isCompress)
+            fprintf(stderr, "RemoteLogSink: kurisu is built without KURISU_WITH_ZLIB, frames are not compressed\n");
+#endif
+        m_batch.reserve(m_options.batchBytes);
+        if (!m_options.spoolFile.empty())
+        {
+            // 上次没补发完的接着补发
+            m_spoolFd = open(m_options.spoolFile.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            struct stat st;
+            if (m_spoolFd < 0)
+                fprintf(stderr, "RemoteLogSink: open %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+            else if (fstat(m_spoolFd, &st) == 0 && st.st_size > 0)
+            {
+                m_spoolSize = st.st_size;
+                m_spooledBytes = m_spoolSize;
+                m_isSpooling = true;
+            }
+        }
+
+        m_client = std::make_unique<TcpClient>(m_loop, collectorAddr, name);
+        m_client->SetConnectionCallback(std::bind(&RemoteLogSink::OnConnection, this, std::placeholders::_1));
+        m_client->SetWriteCompleteCallback(std::bind(&RemoteLogSink::OnWriteComplete, this, std::placeholders::_1));
+        m_client->SetMessageCallback([](const std::shared_ptr<TcpConnection>&, Buffer* buf, Timestamp) { buf->DiscardAll(); });
+        m_client->EnableRetry();
+        m_client->Connect();
+        m_timer = m_loop->RunEvery(m_options.batchSeconds, std::bind(&RemoteLogSink::SendPending, this));
+    }
+    RemoteLogSink::~RemoteLogSink()
+    {
+        m_loop->Cancel(m_timer);
+        m_loop->Run([this] {
+            {
+                std::lock_guard locker(m_mu);
+                m_isClosing = true;
+            }
+            SendPending();
+            CheckClosed();
+        });
+        {
+            std::unique_lock locker(m_mu);
+            m_closedCond.wait_for(locker, std::chrono::duration<double>(m_options.closeSeconds), [this] { return m_isClosed; });
+        }
+        // 先停掉loop线程，回调中还会用到其他成员
+        m_client.reset();
+        m_loopThread.reset();
+        if (m_spoolFd >= 0)
+        {
+            CompactSpool();
+            close(m_spoolFd);
+        }
+    }
+
+    void RemoteLogSink::Append(const char* logline, uint64_t len)
+    {
+        bool isWakeup = false;
+        {
+            std::lock_guard locker(m_mu);
+            if (m_bufferedBytes + len > m_options.maxBufferBytes || m_isClosing)
+            {
+                m_droppedLines.fetch_add(1, std::memory_order_relaxed);
+                m_droppedBytes.fetch_add(len, std::memory_order_relaxed);
+                return;
+            }
+            if (!m_batch.empty() && m_batch.size() + len > m_options.batchBytes)
+            {
+                m_batches.push_back(std::move(m_batch));
+                if (!m_spare.empty())
+                {
+                    m_batch = std::move(m_spare.back());
+                    m_spare.pop_back();
+                }
+                else
+                {
+                    m_batch = std::string();
+                    m_batch.reserve(m_options.batchBytes);
+                }
+                isWakeup = m_batches.size() == 1;
+            }
+            m_batch.append(logline, len);
+            m_bufferedBytes += len;
+        }
+        // 总是排队执行，loop线程自己写的日志也会进来，不能在这里就地发送
+        if (isWakeup)
+            m_loop->AddTask(std::bind(&RemoteLogSink::SendPending, this));
+    }
+    void RemoteLogSink::Flush()
+    {
+        if (m_loop->InLoopThread())
+        {
+            SendPending();
+            return;
+        }
+        detail::CountDownLatch latch(1);
+        m_loop->Run([this, &latch] {
+            SendPending();
+            latch.CountDown();
+        });
+        latch.Wait();
+    }
+    RemoteLogSinkStats RemoteLogSink::Stats() const
+    {
+        RemoteLogSinkStats stats;
+        stats.sentBytes = m_sentBytes.load(std::memory_order_relaxed);
+        stats.spooledBytes = m_spooledBytes.load(std::memory_order_relaxed);
+        stats.droppedLines = m_droppedLines.load(std::memory_order_relaxed);
+        stats.droppedBytes = m_droppedBytes.load(std::memory_order_relaxed);
+        stats.isConnected = m_isConnected.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    bool RemoteLogSink::DecodeFrame(const char* body, uint64_t len, std::string* out)
+    {
+        if (len < 1)
+            return false;
+        if ((uint8_t)body[0] == k_Raw)
+        {
+            out->append(body + 1, len - 1);
+            return true;
+        }
+#ifdef KURISU_WITH_ZLIB
+        if ((uint8_t)body[0] == k_Zlib && len >= k_FrameHeaderSize)
+        {
+            uLongf rawLen = ReadUint32(body + 1);
+            uint64_t oldSize = out->size();
+            out->resize(oldSize + rawLen);
+            if (uncompress((Bytef*)out->data() + oldSize, &rawLen, (const Bytef*)body + k_FrameHeaderSize, len - k_FrameHeaderSize) == Z_OK)
+            {
+                out->resize(oldSize + rawLen);
+                return true;
+            }
+            out->resize(oldSize);
+        }
+#endif
+        return false;
+    }
+
+    void RemoteLogSink::OnConnection(const std::shared_ptr<TcpConnection>& conn)
+    {
+        if (conn->Connected())
+        {
+            m_conn = conn;
+            m_isConnected = true;
+            ReplaySpool();
+            return;
+        }
+        if (conn != m_conn)
+            return;
+        m_conn.reset();
+        m_isConnected = false;
+        // 没确认写进socket的部分重新补发
+        m_spoolReadPos = m_spoolAckPos;
+        m_spooledBytes = m_spoolSize - m_spoolReadPos;
+        CheckClosed();
+    }
+    void RemoteLogSink::OnWriteComplete(const std::shared_ptr<TcpConnection>& conn)
+    {
+        if (conn != m_conn)
+            return;
+        ReplaySpool();
+        CheckClosed();
+    }
+
+    void RemoteLogSink::SendPending()
+    {
+        std::vector<std::string> batches;
+        {
+            std::lock_guard locker(m_mu);
+            batches.swap(m_batches);
+            if (!m_batch.empty())
+            {
+                batches.push_back(std::move(m_batch));
+                m_batch = std::string();
+            }
+        }
+        uint64_t sentBytes = 0;
+        for (auto&& batch : batches)
+        {
+            EncodeFrame(batch);
+            SendFrame(m_frame, std::count(batch.begin(), batch.end(), '\n'));
+            sentBytes += batch.size();
+            batch.clear();
+        }
+
+        std::lock_guard locker(m_mu);
+        m_bufferedBytes -= sentBytes;
+        // 留够攒满maxBufferBytes用的，多的释放掉
+        for (auto&& batch : batches)
+            if (m_spare.size() * m_options.batchBytes < m_options.maxBufferBytes)
+                m_spare.push_back(std::move(batch));
+        if (m_batch.capacity() == 0)
+        {
+            if (!m_spare.empty())
+            {
+                m_batch = std::move(m_spare.back());
+                m_spare.pop_back();
+            }
+            else
+                m_batch.reserve(m_options.batchBytes);
+        }
+    }
+    void RemoteLogSink::EncodeFrame(const std::string& batch)
+    {
+        m_frame.resize(k_FrameHeaderSize);
+        m_frame[4] = (char)k_Raw;
+#ifdef KURISU_WITH_ZLIB
+        if (m_options.isCompress)
+        {
+            uLongf zlen = compressBound(batch.size());
+            m_zbuf.resize(zlen);
+            // 压缩后没变小就不压缩
+            if (compress2((Bytef*)m_zbuf.data(), &zlen, (const Bytef*)batch.data(), batch.size(), Z_BEST_SPEED) == Z_OK && zlen + 4 < batch.size())
+            {
+                m_frame[4] = (char)k_Zlib;
+                m_frame.resize(k_FrameHeaderSize + 4);
+                WriteUint32(m_frame.data() + k_FrameHeaderSize, (uint32_t)batch.size());
+                m_frame.append(m_zbuf.data(), zlen);
+            }
+        }
+#endif
+        if (m_frame[4] == (char)k_Raw)
+            m_frame.append(batch);
+        WriteUint32(m_frame.data(), (uint32_t)(m_frame.size() - 4));
+    }
+    void RemoteLogSink::SendFrame(const std::string& frame, uint64_t lines)
+    {
+        if (m_isSpooling || !m_conn || m_conn->GetOutputBuffer()->ReadableBytes() > m_options.maxBufferBytes)
+        {
+            Spool(frame, lines);
+            return;
+        }
+        m_conn->Send(std::string_view(frame));
+        m_sentBytes.fetch_add(frame.size(), std::memory_order_relaxed);
+    }
+    void RemoteLogSink::Spool(const std::string& frame, uint64_t lines)
+    {
+        if (m_spoolFd < 0 || m_spoolSize + frame.size() > m_options.maxSpoolBytes)
+        {
+            Drop(lines, frame.size());
+            return;
+        }
+        ssize_t n = write(m_spoolFd, frame.data(), frame.size());
+        if (n != (ssize_t)frame.size())
+        {
+            if (n < 0)
+                fprintf(stderr, "RemoteLogSink: write %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+            // 去掉写了一半的帧，补发时帧边界不能乱
+            if (ftruncate(m_spoolFd, m_spoolSize) < 0)
+                fprintf(stderr, "RemoteLogSink: ftruncate %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+            Drop(lines, frame.size());
+            return;
+        }
+        m_spoolSize += frame.size();
+        m_spooledBytes = m_spoolSize - m_spoolReadPos;
+        m_isSpooling = true;
+    }
+    void RemoteLogSink::ReplaySpool()
+    {
+        while (m_isSpooling && m_conn)
+        {
+            uint64_t outputBytes = m_conn->GetOutputBuffer()->ReadableBytes();
+            if (outputBytes == 0)
+                m_spoolAckPos = m_spoolReadPos;
+            else if (outputBytes >= k_ReplayChunk)
+                return;  // 等OnWriteComplete
+            if (m_spoolReadPos == m_spoolSize)
+            {
+                // 都确认写进socket后才清空
+                if (outputBytes != 0)
+                    return;
+                if (ftruncate(m_spoolFd, 0) < 0)
+                    fprintf(stderr, "RemoteLogSink: ftruncate %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+                m_spoolSize = m_spoolReadPos = m_spoolAckPos = 0;
+                m_spooledBytes = 0;
+                m_isSpooling = false;
+                return;
+            }
+
+            uint64_t n = std::min(k_ReplayChunk, m_spoolSize - m_spoolReadPos);
+            m_replayBuf.resize(n);
+            if (pread(m_spoolFd, m_replayBuf.data(), n, m_spoolReadPos) != (ssize_t)n)
+            {
+                fprintf(stderr, "RemoteLogSink: read %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+                return;
+            }
+            // 只发完整的帧
+            uint64_t pos = 0;
+            while (pos + 4 <= n && pos + 4 + ReadUint32(m_replayBuf.data() + pos) <= n)
+                pos += 4 + ReadUint32(m_replayBuf.data() + pos);
+            if (pos == 0)
+            {
+                // 一帧比k_ReplayChunk大，单独读
+                uint64_t frameSize = n >= 4 ? 4 + ReadUint32(m_replayBuf.data()) : n + 1;
+                if (m_spoolReadPos + frameSize > m_spoolSize)
+                {
+                    // 文件末尾有写了一半的帧，跳过
+                    Drop(0, m_spoolSize - m_spoolReadPos);
+                    m_spoolReadPos = m_spoolSize;
+                    continue;
+                }
+                m_replayBuf.resize(frameSize);
+                if (pread(m_spoolFd, m_replayBuf.data(), frameSize, m_spoolReadPos) != (ssize_t)frameSize)
+                {
+                    fprintf(stderr, "RemoteLogSink: read %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+                    return;
+                }
+                pos = frameSize;
+            }
+            m_conn->Send(std::string_view(m_replayBuf.data(), pos));
+            m_spoolReadPos += pos;
+            m_spooledBytes = m_spoolSize - m_spoolReadPos;
+            m_sentBytes.fetch_add(pos, std::memory_order_relaxed);
+        }
+    }
+    void RemoteLogSink::CompactSpool()
+    {
+        if (m_spoolAckPos == 0)
+            return;
+        // 已经补发过的去掉，下次从没补发的开始，写临时文件再改名
+        std::string tmpName = m_options.spoolFile + ".tmp";
+        int fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        off_t offset = m_spoolAckPos;
+        uint64_t remain = m_spoolSize - m_spoolAckPos;
+        while (remain > 0)
+        {
+            ssize_t n = sendfile(fd, m_spoolFd, &offset, remain);
+            if (n <= 0)
+                break;
+            remain -= n;
+        }
+        close(fd);
+        if (remain != 0 || rename(tmpName.c_str(), m_options.spoolFile.c_str()) < 0)
+        {
+            fprintf(stderr, "RemoteLogSink: compact %s failed: %s\n", m_options.spoolFile.c_str(), detail::strerror_tl(errno));
+            unlink(tmpName.c_str());
+        }
+    }
+    void RemoteLogSink::Drop(uint64_t lines, uint64_t bytes)
+    {
+        m_droppedLines.fetch_add(lines, std::memory_order_relaxed);
+        m_droppedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    void RemoteLogSink::CheckClosed()
+    {
+        // 析构时等剩下的写进socket，没连上或者还在补发spool时就留在spool中
+        {
+            std::lock_guard locker(m_mu);
+            if (!m_isClosing || m_isClosed)
+                return;
+            if (m_conn && !m_isSpooling && m_conn->GetOutputBuffer()->ReadableBytes() != 0)
+                return;
+            m_isClosed = true;
+        }
+        m_closedCond.notify_all();
+    }
 }  // namespace kurisu
@@ -0,0 +1,33 @@
+// 把BinaryLogFile(k_Binary模式)写的.klog文件转成和Logger一样的文本，输出到stdout
+//
+// 例:
+//   kurisu_logdecode server.2026-10-17 20:48:02.host.1234.klog > server.log
+//   kurisu_logdecode --local *.klog
+#include <kurisu/kurisu.h>
+
+int main(int argc, char* argv[])
+{
+    bool isLocalTimeZone = false;
+    int fileNum = 0;
+    int ret = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--local") == 0)
+        {
+            isLocalTimeZone = true;
+            continue;
+        }
+        fileNum++;
+        if (!kurisu::BinaryLogFile::Decode(argv[i], stdout, isLocalTimeZone))
+        {
+            fprintf(stderr, "%s: cannot decode %s (missing, not a .klog file or truncated)\n", argv[0], argv[i]);
+            ret = 1;
+        }
+    }
+    if (fileNum == 0)
+    {
+        fprintf(stderr, "Usage: %s [--local] FILE...\n", argv[0]);
+        return 1;
+    }
+    return ret;
+}